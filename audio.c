@@ -55,6 +55,9 @@ extern audio_output audio_dummy;
 #ifdef CONFIG_PIPE
 extern audio_output audio_pipe;
 #endif
+#ifdef CONFIG_CHUNK
+extern audio_output audio_chunk;
+#endif
 #ifdef CONFIG_STDOUT
 extern audio_output audio_stdout;
 #endif
@@ -81,6 +84,9 @@ static audio_output *outputs[] = {
 #ifdef CONFIG_PIPE
     &audio_pipe,
 #endif
+#ifdef CONFIG_CHUNK
+    &audio_chunk,
+#endif
 #ifdef CONFIG_STDOUT
     &audio_stdout,
 #endif
@@ -42,6 +42,11 @@ typedef struct {
   int (*rate_info)(uint64_t *elapsed_time,
                    uint64_t *frames_played); // use this to get the true rate of the DAC
 
+  // may be NULL. If implemented, it's called just before a block of audio is played with the local
+  // time, in nanoseconds, at which the block's first frame should be heard. Blocks of silence may
+  // be played without it.
+  void (*presentation_time)(uint64_t time_to_play);
+
   // may be NULL, in which case soft volume is applied
   void (*volume)(double vol);
 
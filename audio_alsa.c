@@ -28,13 +28,20 @@
 #define ALSA_PCM_NEW_HW_PARAMS_API
 
 #include <alsa/asoundlib.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <math.h>
 #include <memory.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
 #include "config.h"
 
 #include "activity_monitor.h"
@@ -67,6 +74,8 @@ static void volume(double vol);
 void do_volume(double vol);
 int prepare(void);
 int do_play(void *buf, int samples);
+static void output_device_lost(void);
+void *alsa_hotplug_thread_code(void *arg);
 
 static void parameters(audio_parameters *info);
 int mute(int do_mute); // returns true if it actually is allowed to use the mute
@@ -98,6 +107,21 @@ static pthread_mutex_t alsa_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t alsa_mixer_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 pthread_t alsa_buffer_monitor_thread;
+pthread_t alsa_hotplug_thread;
+
+// If the output device goes away -- a USB DAC is unplugged or resets, say -- it's closed and marked
+// as gone. While it's gone, play() and delay() return at once, without waiting for the alsa_mutex,
+// so the player carries on in time, its frames being discarded. The hot-plug thread, started when
+// a device is first lost, waits for device nodes to appear in /dev/snd and then reopens the device,
+// with the format and rate found when it was first opened and the mixer settings found then, so
+// that the player isn't held up. If nothing wants the device by then -- the session has ended and
+// keep_dac_busy is off -- it isn't reopened; it's just no longer marked as gone, and the next
+// play() or prepare() opens it, or finds it still missing and marks it as gone again.
+static volatile int output_device_gone = 0;
+static volatile int output_device_wanted = 0; // set by play() and prepare(), cleared by flush()
+static uint64_t output_device_gone_time;
+static int hotplug_pipe[2] = {-1, -1}; // a byte written to this wakes the hot-plug thread
+static int hotplug_thread_started = 0;
 
 // for deciding when to activate mute
 // there are two sources of requests to mute -- the backend itself, e.g. when it
@@ -118,7 +142,7 @@ uint64_t stall_monitor_error_threshold; // if the time is longer than this, it's
                                         // an error
 
 static snd_output_t *output = NULL;
-int frame_size; // in bytes for interleaved stereo
+int frame_size; // in bytes for interleaved frames of config.output_channels channels
 
 int alsa_device_initialised; // boolean to ensure the initialisation is only
                              // done once
@@ -138,6 +162,12 @@ static long alsa_mix_minv, alsa_mix_maxv;
 static long alsa_mix_mindb, alsa_mix_maxdb;
 
 static char *alsa_out_dev = "default";
+static int period_wakeups_disabled = 0; // set if the device is running without period interrupts
+static snd_pcm_uframes_t period_size_in_use; // for comparing wakeups with period interrupts
+static uint64_t open_time, frames_written_since_open, timer_wakeups_since_open;
+static char direct_hw_device[64]; // the hw: device beneath alsa_out_dev, if it's used directly
+static yndk_type direct_hw_device_status =
+    YNDK_DONT_KNOW; // initially, we don't know if the hw: device can be used directly
 static char *alsa_mix_dev = NULL;
 static char *alsa_mix_ctrl = NULL;
 static int alsa_mix_index = 0;
@@ -352,12 +382,10 @@ void actual_close_alsa_device() {
 // requested.
 // There is no benefit to upconverting the frame rate, other than for compatibility.
 // The lowest rate that the DAC is capable of is chosen.
+// Multiples of 44,100 are preferred, as they don't need the resampler.
 
 unsigned int auto_speed_output_rates[] = {
-    44100,
-    88200,
-    176400,
-    352800,
+    44100, 88200, 176400, 352800, 48000, 96000, 192000,
 };
 
 // This array is of all the formats known to Shairport Sync, in order of the SPS_FORMAT definitions,
@@ -397,6 +425,247 @@ sps_format_t auto_format_check_sequence[] = {
     SPS_FORMAT_S16_BE, SPS_FORMAT_S8,      SPS_FORMAT_U8,
 };
 
+// Describe the chain of PCM plugins between us and the hardware, e.g. "Rate conversion PCM
+// (48000, sformat=S32_LE), Route conversion PCM (sformat=S32_LE)" by picking out the PCM
+// descriptions from the dump of the device. The plugins only show their conversions once the
+// hardware parameters have been set. If shared is non-NULL, it is set if any stage shares the
+// device with other applications (dmix, etc.) or hands the audio on to a sound server.
+static void describe_pcm_stages(snd_pcm_t *pcm, char *description, size_t description_length,
+                                int *shared) {
+  description[0] = '\0';
+  if (shared)
+    *shared = 0;
+  snd_output_t *dump_output;
+  if (snd_output_buffer_open(&dump_output) == 0) {
+    char *dump;
+    snd_pcm_dump(pcm, dump_output);
+    snd_output_buffer_string(dump_output, &dump);
+    char *line = dump;
+    while ((line != NULL) && (*line != '\0')) {
+      char *next_line = strchr(line, '\n');
+      if (next_line)
+        *next_line++ = '\0';
+      while (*line == ' ')
+        line++;
+      // the description starts after any "Plug PCM: " or "Slave: " prefix
+      if (strstr(line, "Plug PCM: ") == line)
+        line += strlen("Plug PCM: ");
+      if (strstr(line, "Slave: ") == line)
+        line += strlen("Slave: ");
+      if ((strstr(line, " PCM") != NULL) && (strstr(line, "Hardware PCM") != line)) {
+        if ((shared) && ((strstr(line, "Direct Stream Mixing") != NULL) ||
+                         (strstr(line, "Share") != NULL) || (strstr(line, "I/O Plugin") != NULL)))
+          *shared = 1;
+        if (description[0] != '\0')
+          strncat(description, ", ", description_length - strlen(description) - 1);
+        strncat(description, line, description_length - strlen(description) - 1);
+      }
+      line = next_line;
+    }
+    snd_output_close(dump_output);
+  }
+  if (description[0] == '\0')
+    strncpy(description, "none", description_length);
+}
+
+// Parse a channel map such as "L R M:-3 - L:0:12 R:0:12", giving the source of each output
+// channel in turn -- L, R, M for the average of the two, or - for silence -- optionally followed
+// by a gain in dB and then by a delay in milliseconds. Returns 0 if it's valid.
+static int parse_channel_map(const char *str) {
+  char *map = strdup(str);
+  if (map == NULL)
+    return -1;
+  int response = 0;
+  int channels = 0;
+  char *saveptr = NULL;
+  char *token = strtok_r(map, " ,\t", &saveptr);
+  while ((token) && (response == 0)) {
+    if (channels == MAX_OUTPUT_CHANNELS) {
+      response = -1;
+      break;
+    }
+    channel_map_entry *entry = &config.channel_map[channels];
+    entry->gain_db = 0.0;
+    entry->delay = 0.0;
+    switch (token[0]) {
+    case 'L':
+    case 'l':
+      entry->source = CM_left;
+      break;
+    case 'R':
+    case 'r':
+      entry->source = CM_right;
+      break;
+    case 'M':
+    case 'm':
+      entry->source = CM_mono;
+      break;
+    case '-':
+      entry->source = CM_silent;
+      break;
+    default:
+      response = -1;
+      break;
+    }
+    char *p = token + 1;
+    char *end;
+    if ((response == 0) && (*p == ':')) {
+      entry->gain_db = strtod(p + 1, &end);
+      if ((end == p + 1) || (entry->gain_db < -96.0) || (entry->gain_db > 20.0))
+        response = -1;
+      p = end;
+      if ((response == 0) && (*p == ':')) {
+        double delay_ms = strtod(p + 1, &end);
+        if ((end == p + 1) || (delay_ms < 0.0) || (delay_ms > 1000.0))
+          response = -1;
+        entry->delay = delay_ms * 0.001;
+        p = end;
+      }
+    }
+    if (*p != '\0')
+      response = -1;
+    channels++;
+    token = strtok_r(NULL, " ,\t", &saveptr);
+  }
+  if (channels == 0)
+    response = -1;
+  if (response == 0) {
+    config.output_channels = channels;
+    // plain stereo needs no map, and leaves the way clear for passthrough
+    config.channel_map_in_use =
+        (channels != 2) || (config.channel_map[0].source != CM_left) ||
+        (config.channel_map[1].source != CM_right) || (config.channel_map[0].gain_db != 0.0) ||
+        (config.channel_map[1].gain_db != 0.0) || (config.channel_map[0].delay != 0.0) ||
+        (config.channel_map[1].delay != 0.0);
+  }
+  free(map);
+  return response;
+}
+
+// See if the output device is a plugin chain on top of a hw: device that can take our output as
+// it is. If so, and nothing else shares the device, it can be opened directly. That avoids the
+// plug layer's conversions and buffering and gives a more accurate delay.
+// As process_sample can produce any of the output formats, any of them the hardware accepts
+// natively will do. The rate must be one the player can produce -- the rate set, or, if auto is
+// requested, one from auto_speed_output_rates, where the 48,000 family is made by the resampler --
+// and the device must take the number of channels we make -- two, unless a channel map is in use.
+// assuming pthread cancellation is disabled and the alsa_mutex is held
+static void find_direct_hw_device() {
+  direct_hw_device_status = YNDK_NO; // unless it's found to be possible
+  if (strstr(alsa_out_dev, "hw:") == alsa_out_dev) {
+    debug(2, "alsa: \"%s\" is already a hardware device.", alsa_out_dev);
+    return;
+  }
+
+  snd_pcm_t *pcm;
+  snd_pcm_hw_params_t *params;
+  snd_pcm_info_t *info;
+  snd_pcm_hw_params_alloca(&params);
+  snd_pcm_info_alloca(&info);
+  int card = -1, device = 0, shared = 0;
+  char stages[512] = "unknown";
+  unsigned int rate = config.output_rate;
+
+  if (snd_pcm_open(&pcm, alsa_out_dev, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK) < 0) {
+    debug(1, "alsa: can't open \"%s\" to look for a hardware device beneath it.", alsa_out_dev);
+    return;
+  }
+  if (snd_pcm_info(pcm, info) == 0) {
+    card = snd_pcm_info_get_card(info);
+    device = snd_pcm_info_get_device(info);
+  }
+  // set the parameters as they would be set when playing, so that the conversions appear
+  sps_format_t format = config.output_format;
+  if ((config.output_format_auto_requested) || (format <= SPS_FORMAT_UNKNOWN) ||
+      (format >= SPS_FORMAT_AUTO))
+    format = SPS_FORMAT_S16_LE;
+  if ((snd_pcm_hw_params_any(pcm, params) >= 0) &&
+      (snd_pcm_hw_params_set_access(pcm, params, SND_PCM_ACCESS_RW_INTERLEAVED) >= 0) &&
+      (snd_pcm_hw_params_set_channels(pcm, params, config.output_channels) >= 0) &&
+      (snd_pcm_hw_params_set_format(pcm, params, fr[format].alsa_code) >= 0) &&
+      (snd_pcm_hw_params_set_rate_near(pcm, params, &rate, NULL) >= 0) &&
+      (snd_pcm_hw_params(pcm, params) >= 0))
+    describe_pcm_stages(pcm, stages, sizeof(stages), &shared);
+  snd_pcm_close(pcm);
+
+  debug(1, "alsa: conversion stages in the output path of \"%s\": %s.", alsa_out_dev, stages);
+  if (card < 0) {
+    debug(1, "alsa: \"%s\" is not backed by a hardware device, so it will be used as it is.",
+          alsa_out_dev);
+    return;
+  }
+  if (shared) {
+    debug(1, "alsa: \"%s\" shares its hardware device with other applications, so it will be "
+             "used as it is.",
+          alsa_out_dev);
+    return;
+  }
+
+  char hw_device_name[64];
+  snprintf(hw_device_name, sizeof(hw_device_name), "hw:%d,%d", card, device);
+  if (snd_pcm_open(&pcm, hw_device_name, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK) < 0) {
+    debug(1, "alsa: can't open \"%s\", the hardware device beneath \"%s\".", hw_device_name,
+          alsa_out_dev);
+    return;
+  }
+
+  // Nothing in the configuration is changed here. A rate or format set explicitly must be
+  // accepted as it is; if auto is requested, one from the list must be, and actual_open_alsa_device
+  // will choose it.
+  int usable = 0;
+  if ((snd_pcm_hw_params_any(pcm, params) >= 0) &&
+      (snd_pcm_hw_params_test_channels(pcm, params, config.output_channels) == 0)) {
+    unsigned int i;
+    unsigned int native_rate = 0;
+    if (config.output_rate_auto_requested == 0) {
+      if (snd_pcm_hw_params_test_rate(pcm, params, config.output_rate, 0) == 0)
+        native_rate = config.output_rate;
+      else
+        debug(1, "alsa: \"%s\" does not accept the %u frames per second set natively.",
+              hw_device_name, config.output_rate);
+    } else {
+      for (i = 0; (native_rate == 0) &&
+                  (i < sizeof(auto_speed_output_rates) / sizeof(auto_speed_output_rates[0]));
+           i++)
+        if (snd_pcm_hw_params_test_rate(pcm, params, auto_speed_output_rates[i], 0) == 0)
+          native_rate = auto_speed_output_rates[i];
+    }
+    sps_format_t native_format = SPS_FORMAT_UNKNOWN;
+    if (config.output_format_auto_requested == 0) {
+      if ((config.output_format > SPS_FORMAT_UNKNOWN) && (config.output_format < SPS_FORMAT_AUTO) &&
+          (snd_pcm_hw_params_test_format(pcm, params, fr[config.output_format].alsa_code) == 0))
+        native_format = config.output_format;
+      else
+        debug(1, "alsa: \"%s\" does not accept the \"%s\" format set natively.", hw_device_name,
+              sps_format_description_string(config.output_format));
+    } else {
+      for (i = 0; (native_format == SPS_FORMAT_UNKNOWN) &&
+                  (i < sizeof(auto_format_check_sequence) / sizeof(auto_format_check_sequence[0]));
+           i++)
+        if (snd_pcm_hw_params_test_format(pcm, params,
+                                          fr[auto_format_check_sequence[i]].alsa_code) == 0)
+          native_format = auto_format_check_sequence[i];
+    }
+    if ((native_rate != 0) && (native_format != SPS_FORMAT_UNKNOWN)) {
+      debug(1, "alsa: \"%s\" accepts %u frames per second in the \"%s\" format natively.",
+            hw_device_name, native_rate, sps_format_description_string(native_format));
+      usable = 1;
+    }
+  }
+  snd_pcm_close(pcm);
+
+  if (usable) {
+    strncpy(direct_hw_device, hw_device_name, sizeof(direct_hw_device) - 1);
+    direct_hw_device_status = YNDK_YES;
+    inform("alsa: using \"%s\" directly instead of \"%s\", bypassing: %s.", direct_hw_device,
+           alsa_out_dev, stages);
+  } else {
+    debug(1, "alsa: \"%s\" has no native %d-channel format and rate that can be used, so \"%s\" "
+             "will be used as it is.",
+          hw_device_name, config.output_channels, alsa_out_dev);
+  }
+}
+
 // assuming pthread cancellation is disabled
 // if do_auto_setting is true and auto format or auto speed has been requested,
 // select the settings as appropriate and store them
@@ -431,15 +700,23 @@ int actual_open_alsa_device(int do_auto_setup) {
   if (config.no_sync != 0)
     audio_alsa.delay = NULL;
 
-  ret = snd_pcm_open(&alsa_handle, alsa_out_dev, SND_PCM_STREAM_PLAYBACK, 0);
+  // if the hw: device beneath the output device is being used directly, open it instead
+  const char *device_name = alsa_out_dev;
+  if (direct_hw_device_status == YNDK_YES)
+    device_name = direct_hw_device;
+
+  int open_mode = 0;
+  if (config.alsa_disable_period_wakeups != 0)
+    open_mode = SND_PCM_NO_PERIOD_WAKEUP; // it's only a request -- see below
+  ret = snd_pcm_open(&alsa_handle, device_name, SND_PCM_STREAM_PLAYBACK, open_mode);
   if (ret < 0) {
     if (ret == -ENOENT) {
-      warn("the alsa output_device \"%s\" can not be found.", alsa_out_dev);
+      warn("the alsa output_device \"%s\" can not be found.", device_name);
     } else {
       char errorstring[1024];
       strerror_r(-ret, (char *)errorstring, sizeof(errorstring));
       warn("alsa: error %d (\"%s\") opening alsa device \"%s\".", ret, (char *)errorstring,
-           alsa_out_dev);
+           device_name);
     }
     return ret;
   }
@@ -451,7 +728,7 @@ int actual_open_alsa_device(int do_auto_setup) {
   if (ret < 0) {
     die("audio_alsa: Broken configuration for device \"%s\": no configurations "
         "available",
-        alsa_out_dev);
+        device_name);
     return ret;
   }
 
@@ -475,34 +752,48 @@ int actual_open_alsa_device(int do_auto_setup) {
 
   ret = snd_pcm_hw_params_set_access(alsa_handle, alsa_params, access);
   if (ret < 0) {
-    warn("audio_alsa: Access type not available for device \"%s\": %s", alsa_out_dev,
+    warn("audio_alsa: Access type not available for device \"%s\": %s", device_name,
          snd_strerror(ret));
     return ret;
   }
 
-  ret = snd_pcm_hw_params_set_channels(alsa_handle, alsa_params, 2);
+  ret = snd_pcm_hw_params_set_channels(alsa_handle, alsa_params, config.output_channels);
   if (ret < 0) {
-    warn("audio_alsa: Channels count (2) not available for device \"%s\": %s", alsa_out_dev,
-         snd_strerror(ret));
+    warn("audio_alsa: Channels count (%d) not available for device \"%s\": %s",
+         config.output_channels, device_name, snd_strerror(ret));
     return ret;
   }
 
+  period_wakeups_disabled = 0;
+  if (config.alsa_disable_period_wakeups != 0) {
+    if (snd_pcm_hw_params_can_disable_period_wakeup(alsa_params)) {
+      ret = snd_pcm_hw_params_set_period_wakeup(alsa_handle, alsa_params, 0);
+      if (ret == 0)
+        period_wakeups_disabled = 1;
+      else
+        debug(1, "alsa: error %d (\"%s\") disabling period wakeups on device \"%s\".", ret,
+              snd_strerror(ret), device_name);
+    } else {
+      debug(2, "alsa: device \"%s\" can not disable period wakeups.", device_name);
+    }
+  }
+
   snd_pcm_format_t sf;
 
   if ((do_auto_setup == 0) || (config.output_format_auto_requested == 0)) { // no auto format
     if ((config.output_format > SPS_FORMAT_UNKNOWN) && (config.output_format < SPS_FORMAT_AUTO)) {
       sf = fr[config.output_format].alsa_code;
-      frame_size = fr[config.output_format].frame_size;
+      frame_size = fr[config.output_format].frame_size * config.output_channels / 2;
     } else {
       warn("alsa: unexpected output format %d. Set to S16_LE.", config.output_format);
       config.output_format = SPS_FORMAT_S16_LE;
       sf = fr[config.output_format].alsa_code;
-      frame_size = fr[config.output_format].frame_size;
+      frame_size = fr[config.output_format].frame_size * config.output_channels / 2;
     }
     ret = snd_pcm_hw_params_set_format(alsa_handle, alsa_params, sf);
     if (ret < 0) {
       warn("audio_alsa: Alsa sample format %d not available for device \"%s\": %s", sf,
-           alsa_out_dev, snd_strerror(ret));
+           device_name, snd_strerror(ret));
       return ret;
     }
   } else { // auto format
@@ -516,7 +807,7 @@ int actual_open_alsa_device(int do_auto_setup) {
     while ((i < number_of_formats_to_try) && (format_found == 0)) {
       trial_format = formats[i];
       sf = fr[trial_format].alsa_code;
-      frame_size = fr[trial_format].frame_size;
+      frame_size = fr[trial_format].frame_size * config.output_channels / 2;
       ret = snd_pcm_hw_params_set_format(alsa_handle, alsa_params, sf);
       if (ret == 0)
         format_found = 1;
@@ -529,7 +820,7 @@ int actual_open_alsa_device(int do_auto_setup) {
             sps_format_description_string(config.output_format));
     } else {
       warn("audio_alsa: Could not automatically set the output format for device \"%s\": %s",
-           alsa_out_dev, snd_strerror(ret));
+           device_name, snd_strerror(ret));
       return ret;
     }
   }
@@ -569,7 +860,7 @@ int actual_open_alsa_device(int do_auto_setup) {
       debug(1, "alsa: output speed chosen is %d.", config.output_rate);
     } else {
       warn("audio_alsa: Could not automatically set the output rate for device \"%s\": %s",
-           alsa_out_dev, snd_strerror(ret));
+           device_name, snd_strerror(ret));
       return ret;
     }
   }
@@ -613,7 +904,7 @@ int actual_open_alsa_device(int do_auto_setup) {
 
   ret = snd_pcm_hw_params(alsa_handle, alsa_params);
   if (ret < 0) {
-    warn("audio_alsa: Unable to set hw parameters for device \"%s\": %s.", alsa_out_dev,
+    warn("audio_alsa: Unable to set hw parameters for device \"%s\": %s.", device_name,
          snd_strerror(ret));
     return ret;
   }
@@ -647,9 +938,17 @@ int actual_open_alsa_device(int do_auto_setup) {
 
   use_monotonic_clock = snd_pcm_hw_params_is_monotonic(alsa_params);
 
+  snd_pcm_hw_params_get_period_size(alsa_params, &period_size_in_use, &dir);
+  open_time = get_absolute_time_in_ns();
+  frames_written_since_open = 0;
+  timer_wakeups_since_open = 0;
+  if (period_wakeups_disabled)
+    debug(2, "alsa: period wakeups disabled on device \"%s\" -- output will be timer-driven.",
+          device_name);
+
   ret = snd_pcm_hw_params_get_buffer_size(alsa_params, &actual_buffer_length);
   if (ret < 0) {
-    warn("audio_alsa: Unable to get hw buffer length for device \"%s\": %s.", alsa_out_dev,
+    warn("audio_alsa: Unable to get hw buffer length for device \"%s\": %s.", device_name,
          snd_strerror(ret));
     return ret;
   }
@@ -658,13 +957,13 @@ int actual_open_alsa_device(int do_auto_setup) {
   if (ret < 0) {
     warn("audio_alsa: Unable to get current sw parameters for device \"%s\": "
          "%s.",
-         alsa_out_dev, snd_strerror(ret));
+         device_name, snd_strerror(ret));
     return ret;
   }
 
   ret = snd_pcm_sw_params_set_tstamp_mode(alsa_handle, alsa_swparams, SND_PCM_TSTAMP_ENABLE);
   if (ret < 0) {
-    warn("audio_alsa: Can't enable timestamp mode of device: \"%s\": %s.", alsa_out_dev,
+    warn("audio_alsa: Can't enable timestamp mode of device: \"%s\": %s.", device_name,
          snd_strerror(ret));
     return ret;
   }
@@ -672,14 +971,14 @@ int actual_open_alsa_device(int do_auto_setup) {
   /* write the sw parameters */
   ret = snd_pcm_sw_params(alsa_handle, alsa_swparams);
   if (ret < 0) {
-    warn("audio_alsa: Unable to set software parameters of device: \"%s\": %s.", alsa_out_dev,
+    warn("audio_alsa: Unable to set software parameters of device: \"%s\": %s.", device_name,
          snd_strerror(ret));
     return ret;
   }
 
   ret = snd_pcm_prepare(alsa_handle);
   if (ret < 0) {
-    warn("audio_alsa: Unable to prepare the device: \"%s\": %s.", alsa_out_dev, snd_strerror(ret));
+    warn("audio_alsa: Unable to prepare the device: \"%s\": %s.", device_name, snd_strerror(ret));
     return ret;
   }
 
@@ -695,13 +994,13 @@ int actual_open_alsa_device(int do_auto_setup) {
           "%s.",
           config.audio_backend_buffer_desired_length +
               requested_buffer_headroom,
-          alsa_out_dev, snd_strerror(ret));
+          device_name, snd_strerror(ret));
     if (config.audio_backend_buffer_desired_length + minimal_buffer_headroom >
         buffer_size) {
       die("audio_alsa: Can't set hw buffer size to %lu or more for device "
           "\"%s\". Requested size: %lu, granted size: %lu.",
           config.audio_backend_buffer_desired_length + minimal_buffer_headroom,
-          alsa_out_dev, config.audio_backend_buffer_desired_length +
+          device_name, config.audio_backend_buffer_desired_length +
                             requested_buffer_headroom,
           buffer_size);
     }
@@ -737,6 +1036,10 @@ int actual_open_alsa_device(int do_auto_setup) {
 
     debug(log_level, "PCM handle name = '%s'", snd_pcm_name(alsa_handle));
 
+    char stages[512];
+    describe_pcm_stages(alsa_handle, stages, sizeof(stages), NULL);
+    debug(1, "alsa: conversion stages between Shairport Sync and the hardware: %s.", stages);
+
     //      ret = snd_pcm_hw_params_any(alsa_handle, alsa_params);
     //      if (ret < 0) {
     //        die("audio_alsa: Cannpot get configuration for
@@ -746,7 +1049,7 @@ int actual_open_alsa_device(int do_auto_setup) {
     // configurations
     //"
     //            "available",
-    //            alsa_out_dev);
+    //            device_name);
     //      }
 
     debug(log_level, "alsa device parameters:");
@@ -859,7 +1162,27 @@ int open_alsa_device(int do_auto_setup) {
   int result;
   int oldState;
   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState); // make this un-cancellable
+  if ((config.alsa_direct_hw_access != 0) && (direct_hw_device_status == YNDK_DONT_KNOW))
+    find_direct_hw_device();
+  // the attempt on the hardware device may choose an auto rate or format that doesn't suit the
+  // device as specified, so keep them to go back to
+  unsigned int original_output_rate = config.output_rate;
+  sps_format_t original_output_format = config.output_format;
   result = actual_open_alsa_device(do_auto_setup);
+  if ((result != 0) && (direct_hw_device_status == YNDK_YES)) {
+    config.output_rate = original_output_rate;
+    config.output_format = original_output_format;
+    // fall back to the output device as specified, conversions and all
+    if (alsa_handle) {
+      snd_pcm_close(alsa_handle);
+      alsa_handle = NULL;
+    }
+    warn("alsa: could not open \"%s\" directly -- using \"%s\" instead.", direct_hw_device,
+         alsa_out_dev);
+    direct_hw_device_status = YNDK_NO;
+    alsa_characteristics_already_listed = 0;
+    result = actual_open_alsa_device(do_auto_setup);
+  }
   pthread_setcancelstate(oldState, NULL);
   return result;
 }
@@ -999,6 +1322,8 @@ static int init(int argc, char **argv) {
   set_period_size_request = 0;
   set_buffer_size_request = 0;
   config.alsa_use_hardware_mute = 0; // don't use it by default
+  config.alsa_direct_hw_access = 0;  // use the output device as given by default
+  config.alsa_disable_period_wakeups = 0;
 
   config.audio_backend_latency_offset = 0;
   config.audio_backend_buffer_desired_length = 0.200;
@@ -1098,6 +1423,36 @@ static int init(int argc, char **argv) {
       }
     }
 
+    /* Get the disable_period_wakeups setting. */
+    if (config_lookup_string(config.cfg, "alsa.disable_period_wakeups", &str)) {
+      if (strcasecmp(str, "no") == 0)
+        config.alsa_disable_period_wakeups = 0;
+      else if (strcasecmp(str, "yes") == 0)
+        config.alsa_disable_period_wakeups = 1;
+      else {
+        warn("Invalid disable_period_wakeups option choice \"%s\". It "
+             "should be \"yes\" or "
+             "\"no\". It is set to \"no\".",
+             str);
+        config.alsa_disable_period_wakeups = 0;
+      }
+    }
+
+    /* Get the use_hw_device_directly setting. */
+    if (config_lookup_string(config.cfg, "alsa.use_hw_device_directly", &str)) {
+      if (strcasecmp(str, "no") == 0)
+        config.alsa_direct_hw_access = 0;
+      else if (strcasecmp(str, "yes") == 0)
+        config.alsa_direct_hw_access = 1;
+      else {
+        warn("Invalid use_hw_device_directly option choice \"%s\". It "
+             "should be \"yes\" or "
+             "\"no\". It is set to \"no\".",
+             str);
+        config.alsa_direct_hw_access = 0;
+      }
+    }
+
     /* Get the output format, using the same names as aplay does*/
     if (config_lookup_string(config.cfg, "alsa.output_format", &str)) {
       int temp_output_format_auto_requested = config.output_format_auto_requested;
@@ -1149,34 +1504,42 @@ static int init(int argc, char **argv) {
         config.output_rate_auto_requested = 1;
       } else {
         if (config.output_rate_auto_requested == 1)
-          warn("Invalid output rate \"%s\". It should be \"auto\", 44100, 88200, 176400 or 352800. "
+          warn("Invalid output rate \"%s\". It should be \"auto\", 44100, 48000, 88200, 96000, "
+               "176400, 192000 or 352800. "
                "It remains set to \"auto\". Note: numbers should not be placed in quotes.",
                str);
         else
-          warn("Invalid output rate \"%s\". It should be \"auto\", 44100, 88200, 176400 or 352800. "
+          warn("Invalid output rate \"%s\". It should be \"auto\", 44100, 48000, 88200, 96000, "
+               "176400, 192000 or 352800. "
                "It remains set to %d. Note: numbers should not be placed in quotes.",
                str, config.output_rate);
       }
     }
 
-    /* Get the output rate, which must be a multiple of 44,100*/
+    /* Get the output rate, which must be a multiple of 44,100 or of 48,000 -- the latter will be
+     * resampled */
     if (config_lookup_int(config.cfg, "alsa.output_rate", &value)) {
       debug(1, "alsa output rate is %d frames per second", value);
       switch (value) {
       case 44100:
+      case 48000:
       case 88200:
+      case 96000:
       case 176400:
+      case 192000:
       case 352800:
         config.output_rate = value;
         config.output_rate_auto_requested = 0;
         break;
       default:
         if (config.output_rate_auto_requested == 1)
-          warn("Invalid output rate \"%d\". It should be \"auto\", 44100, 88200, 176400 or 352800. "
+          warn("Invalid output rate \"%d\". It should be \"auto\", 44100, 48000, 88200, 96000, "
+               "176400, 192000 or 352800. "
                "It remains set to \"auto\".",
                value);
         else
-          warn("Invalid output rate \"%d\".It should be \"auto\", 44100, 88200, 176400 or 352800. "
+          warn("Invalid output rate \"%d\".It should be \"auto\", 44100, 48000, 88200, 96000, "
+               "176400, 192000 or 352800. "
                "It remains set to %d.",
                value, config.output_rate);
       }
@@ -1276,6 +1639,28 @@ static int init(int argc, char **argv) {
       }
     }
 
+    /* Get the output channel map, if any. */
+    if (config_lookup_string(config.cfg, "alsa.output_channel_map", &str)) {
+      if (parse_channel_map(str) != 0) {
+        config.output_channels = 2;
+        config.channel_map_in_use = 0;
+        warn("Invalid alsa output_channel_map \"%s\". It should list up to %d output channels, "
+             "each L, R, M or -, optionally followed by \":gain\" in dB and then by "
+             "\":delay\" in milliseconds. The output remains stereo.",
+             str, MAX_OUTPUT_CHANNELS);
+      } else if (config.channel_map_in_use) {
+        int c;
+        for (c = 0; c < config.output_channels; c++)
+          debug(1, "alsa: output channel %d is %s, gain %.1f dB, delay %.1f ms.", c,
+                config.channel_map[c].source == CM_left
+                    ? "left"
+                    : config.channel_map[c].source == CM_right
+                          ? "right"
+                          : config.channel_map[c].source == CM_mono ? "mono" : "silent",
+                config.channel_map[c].gain_db, config.channel_map[c].delay * 1000);
+      }
+    }
+
     if (config_lookup_string(config.cfg, "alsa.use_precision_timing", &str)) {
       if ((strcasecmp(str, "no") == 0) || (strcasecmp(str, "off") == 0) ||
           (strcasecmp(str, "never") == 0))
@@ -1363,6 +1748,19 @@ static void deinit(void) {
   pthread_cancel(alsa_buffer_monitor_thread);
   debug(3, "Join buffer monitor thread.");
   pthread_join(alsa_buffer_monitor_thread, NULL);
+  if (hotplug_thread_started) {
+    debug(2, "Cancel hot-plug thread.");
+    pthread_cancel(alsa_hotplug_thread);
+    debug(3, "Join hot-plug thread.");
+    pthread_join(alsa_hotplug_thread, NULL);
+    hotplug_thread_started = 0;
+  }
+  if (hotplug_pipe[0] >= 0) {
+    close(hotplug_pipe[0]);
+    close(hotplug_pipe[1]);
+    hotplug_pipe[0] = -1;
+    hotplug_pipe[1] = -1;
+  }
   pthread_setcancelstate(oldState, NULL);
 }
 
@@ -1612,13 +2010,19 @@ int delay(long *the_delay) {
   snd_pcm_state_t state;
   snd_pcm_sframes_t my_delay = 0; // this initialisation is to silence a clang warning
 
+  if (output_device_gone)
+    return ENODEV;
+
   pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState); // make this un-cancellable
   pthread_cleanup_debug_mutex_lock(&alsa_mutex, 10000, 0);
 
-  if (alsa_handle == NULL)
+  if (alsa_handle == NULL) {
     ret = ENODEV;
-  else
+  } else {
     ret = delay_and_status(&state, &my_delay, NULL);
+    if (ret == -ENODEV)
+      output_device_lost();
+  }
 
   debug_mutex_unlock(&alsa_mutex, 0);
   pthread_cleanup_pop(0);
@@ -1643,6 +2047,43 @@ int get_rate_information(uint64_t *elapsed_time, uint64_t *frames_played) {
   return response;
 }
 
+// With period wakeups disabled, no interrupt comes to wake a blocked write when space becomes
+// available. So if there's no room for the frames, we calculate from the hardware position
+// when there will be and sleep until then, instead of letting the write block.
+// The alsa_mutex is let go while sleeping, so that delay(), the volume control and the rest aren't
+// held up. Returns -1 if the device was closed, reopened or flushed meanwhile, in which case the
+// frames should be dropped.
+// assuming the alsa_mutex has been acquired and pthread cancellation is disabled
+static int wait_for_space_in_output_buffer(snd_pcm_uframes_t frames) {
+  int tries = 0;
+  uint64_t open_time_on_entry = open_time;
+  int state_on_entry = alsa_backend_state;
+  snd_pcm_sframes_t avail = snd_pcm_avail(alsa_handle); // this synchronises with the hardware
+  while ((avail >= 0) && ((snd_pcm_uframes_t)avail < frames) && (tries < 10) &&
+         (snd_pcm_state(alsa_handle) == SND_PCM_STATE_RUNNING)) {
+    uint64_t wait_time_ns = ((frames - avail) * (uint64_t)1000000000) / config.output_rate;
+    wait_time_ns += 500000; // add half a millisecond to be sure the space is there
+    uint64_t wakeup_time_ns = get_absolute_time_in_ns() + wait_time_ns;
+    struct timespec wakeup_time;
+    wakeup_time.tv_sec = wakeup_time_ns / 1000000000;
+    wakeup_time.tv_nsec = wakeup_time_ns % 1000000000;
+    debug_mutex_unlock(&alsa_mutex, 0);
+    int rc;
+    do {
+      rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup_time, NULL);
+    } while (rc == EINTR);
+    debug_mutex_lock(&alsa_mutex, 50000, 0);
+    if (rc == 0)
+      timer_wakeups_since_open++; // the timer expired and woke the thread
+    if ((alsa_handle == NULL) || (open_time != open_time_on_entry) ||
+        ((int)alsa_backend_state != state_on_entry) || (output_device_gone != 0))
+      return -1;
+    tries++;
+    avail = snd_pcm_avail(alsa_handle);
+  }
+  return 0;
+}
+
 int do_play(void *buf, int samples) {
   // assuming the alsa_mutex has been acquired
   // debug(3,"audio_alsa play called.");
@@ -1664,10 +2105,17 @@ int do_play(void *buf, int samples) {
         debug(1, "alsa: DAC in odd SND_PCM_STATE_* %d prior to writing.", state);
       }
 
+      if ((period_wakeups_disabled) && (wait_for_space_in_output_buffer(samples) != 0)) {
+        // the device changed while we waited, so the frames are out of date
+        pthread_setcancelstate(oldState, NULL);
+        return 0;
+      }
+
       // debug(3, "write %d frames.", samples);
       ret = alsa_pcm_write(alsa_handle, buf, samples);
       if (ret == samples) {
         stall_monitor_frame_count += samples;
+        frames_written_since_open += samples;
 
         if (frame_index == 0) {
           frames_sent_for_playing = samples;
@@ -1731,6 +2179,9 @@ int do_play(void *buf, int samples) {
     measurement_data_is_valid = 0;
   }
 
+  if (ret == -ENODEV)
+    output_device_lost();
+
   pthread_setcancelstate(oldState, NULL);
   return ret;
 }
@@ -1769,6 +2220,19 @@ int do_close() {
   int derr = 0;
   if (alsa_handle) {
     // debug(1,"alsa: do_close() -- closing the output device");
+    uint64_t time_open_ns = get_absolute_time_in_ns() - open_time;
+    if ((time_open_ns > 1000000000) && (period_size_in_use != 0)) {
+      double seconds_open = time_open_ns * 0.000000001;
+      if (period_wakeups_disabled)
+        debug(2,
+              "alsa: %.1f timer wakeups per second were needed for output, instead of %.1f period "
+              "interrupts per second.",
+              timer_wakeups_since_open / seconds_open,
+              (1.0 * frames_written_since_open) / period_size_in_use / seconds_open);
+      else
+        debug(2, "alsa: output caused %.1f period interrupts per second.",
+              (1.0 * frames_written_since_open) / period_size_in_use / seconds_open);
+    }
     if ((derr = snd_pcm_drop(alsa_handle)))
       debug(1, "Error %d (\"%s\") dropping output device.", derr, snd_strerror(derr));
     usleep(5000);
@@ -1787,6 +2251,51 @@ int do_close() {
   return derr;
 }
 
+// the alsa_mutex must be held
+static void wake_hotplug_thread(void) {
+  char c = 0;
+  if ((hotplug_pipe[1] >= 0) && (write(hotplug_pipe[1], &c, 1) != 1))
+    debug(1, "alsa: error waking the hot-plug thread.");
+}
+
+// the alsa_mutex must be held
+static void output_device_lost(void) {
+  if (output_device_gone == 0) {
+    if (hotplug_thread_started == 0) {
+      if ((hotplug_pipe[0] < 0) && (pipe(hotplug_pipe) == 0)) {
+        fcntl(hotplug_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(hotplug_pipe[1], F_SETFL, O_NONBLOCK);
+      }
+      if ((hotplug_pipe[0] >= 0) &&
+          (pthread_create(&alsa_hotplug_thread, NULL, &alsa_hotplug_thread_code, NULL) == 0)) {
+        hotplug_thread_started = 1;
+      } else {
+        warn("alsa: can not start the hot-plug thread -- the output device \"%s\" has gone and "
+             "will not be reopened.",
+             alsa_out_dev);
+        if (alsa_handle != NULL)
+          do_close();
+        return;
+      }
+    }
+    warn("alsa: the output device \"%s\" has gone -- it will be reopened when it comes back.",
+         alsa_out_dev);
+    if (alsa_handle != NULL)
+      do_close();
+    stall_monitor_start_time = 0;
+    frame_index = 0;
+    measurement_data_is_valid = 0;
+    output_device_gone_time = get_absolute_time_in_ns();
+    output_device_gone = 1;
+    wake_hotplug_thread();
+  }
+}
+
+// true if do_open() failed because the device isn't there
+static int output_device_missing(int open_result) {
+  return ((open_result == -ENODEV) || (open_result == -ENOENT));
+}
+
 int play(void *buf, int samples) {
 
   // play() will change the state of the alsa_backend_mode to abm_playing
@@ -1797,15 +2306,23 @@ int play(void *buf, int samples) {
   // debug(3,"audio_alsa play called.");
   int ret = 0;
 
+  output_device_wanted = 1;
+  if (output_device_gone)
+    return 0; // discard the frames until the hot-plug thread has it back
+
   pthread_cleanup_debug_mutex_lock(&alsa_mutex, 50000, 0);
 
   if (alsa_backend_state == abm_disconnected) {
     ret = do_open(0); // don't try to auto setup
-    if (ret == 0)
+    if (ret == 0) {
       debug(2, "alsa: play() -- opened output device");
+    } else if (output_device_missing(ret)) {
+      output_device_lost();
+      ret = 0;
+    }
   }
 
-  if (ret == 0) {
+  if ((ret == 0) && (alsa_handle != NULL)) {
     if (alsa_backend_state != abm_playing) {
       debug(2, "alsa: play() -- alsa_backend_state => abm_playing");
       alsa_backend_state = abm_playing;
@@ -1828,6 +2345,10 @@ int prepare(void) {
   // this will leave the DAC open / connected.
   int ret = 0;
 
+  output_device_wanted = 1;
+  if (output_device_gone)
+    return 0; // the hot-plug thread will reopen it
+
   pthread_cleanup_debug_mutex_lock(&alsa_mutex, 50000, 0);
 
   if (alsa_backend_state == abm_disconnected) {
@@ -1837,8 +2358,12 @@ int prepare(void) {
       alsa_device_initialised = 1;
     }
     ret = do_open(1); // do auto setup
-    if (ret == 0)
+    if (ret == 0) {
       debug(2, "alsa: prepare() -- opened output device");
+    } else if (output_device_missing(ret)) {
+      output_device_lost();
+      ret = 0;
+    }
   }
 
   debug_mutex_unlock(&alsa_mutex, 0);
@@ -1853,7 +2378,10 @@ static void flush(void) {
   // debug(2, "flush() set_mute_state");
   // set_mute_state();
   // do_mute(1); // mute for backend's own reasons
-  if (alsa_backend_state != abm_disconnected) { // must be playing or connected...
+  output_device_wanted = 0;
+  if ((output_device_gone) && (config.keep_dac_busy == 0))
+    wake_hotplug_thread(); // so that it stops trying to reopen it
+  if ((alsa_backend_state != abm_disconnected) && (output_device_gone == 0)) {
     if (config.keep_dac_busy != 0) {
       debug(2, "alsa: flush() -- alsa_backend_state => abm_connected.");
       alsa_backend_state = abm_connected;
@@ -1977,7 +2505,8 @@ void *alsa_buffer_monitor_thread_code(__attribute__((unused)) void *arg) {
     int sleep_time_us = (int)(config.disable_standby_mode_silence_scan_interval * 1000000);
     pthread_cleanup_debug_mutex_lock(&alsa_mutex, 200000, 0);
     // check possible state transitions here
-    if ((alsa_backend_state == abm_disconnected) && (config.keep_dac_busy != 0)) {
+    if ((alsa_backend_state == abm_disconnected) && (config.keep_dac_busy != 0) &&
+        (output_device_gone == 0)) {
       // open the dac and move to abm_connected mode
       if (do_open(1) == 0) // no automatic setup of rate and speed if necessary
         debug(2, "alsa: alsa_buffer_monitor_thread_code() -- output device opened; "
@@ -2059,3 +2588,113 @@ void *alsa_buffer_monitor_thread_code(__attribute__((unused)) void *arg) {
   }
   pthread_exit(NULL);
 }
+
+static void hotplug_inotify_cleanup(void *arg) {
+  int fd = *(int *)arg;
+  if (fd >= 0)
+    close(fd);
+}
+
+void *alsa_hotplug_thread_code(__attribute__((unused)) void *arg) {
+  // On Linux, a sound card's device nodes appearing in /dev/snd, or udev setting their
+  // permissions, prompts an attempt to reopen the output device. Otherwise, or if /dev/snd can't
+  // be watched, an attempt is made every couple of seconds while the device is gone, and every
+  // ten seconds in any case, in case it comes back without a new node appearing.
+  int inotify_fd = -1;
+#ifdef __linux__
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if ((inotify_fd >= 0) && (inotify_add_watch(inotify_fd, "/dev/snd", IN_CREATE | IN_ATTRIB) < 0)) {
+    debug(1, "alsa: can not watch /dev/snd for hot-plug events: \"%s\".", strerror(errno));
+    close(inotify_fd);
+    inotify_fd = -1;
+  }
+#endif
+  pthread_cleanup_push(hotplug_inotify_cleanup, (void *)&inotify_fd);
+  uint64_t event_time = 0; // when the latest hot-plug event arrived while the device was gone
+  while (1) {
+    struct pollfd fds[2];
+    int nfds = 0;
+    fds[nfds].fd = hotplug_pipe[0];
+    fds[nfds++].events = POLLIN;
+    if (inotify_fd >= 0) {
+      fds[nfds].fd = inotify_fd;
+      fds[nfds++].events = POLLIN;
+    }
+    int timeout_ms = -1;
+    if (output_device_gone) {
+      if (event_time != 0)
+        timeout_ms = 500; // let udev finish with the new nodes before trying them
+      else if (inotify_fd >= 0)
+        timeout_ms = 10000; // in case it comes back without a node appearing
+      else
+        timeout_ms = 2000;
+    }
+    int ret = poll(fds, nfds, timeout_ms); // has a cancellation point in it
+    if (ret < 0) {
+      if (errno != EINTR) {
+        debug(1, "alsa: hot-plug thread poll error: \"%s\".", strerror(errno));
+        usleep(1000000);
+      }
+      continue;
+    }
+    char buf[1024];
+    int i;
+    for (i = 0; i < nfds; i++)
+      if (fds[i].revents & POLLIN) {
+        while (read(fds[i].fd, buf, sizeof(buf)) > 0)
+          ;
+        if ((fds[i].fd == inotify_fd) && (output_device_gone) && (event_time == 0)) {
+          event_time = get_absolute_time_in_ns();
+          debug(2, "alsa: hot-plug event while the output device is gone.");
+        }
+      }
+    if ((output_device_gone) && (output_device_wanted == 0) && (config.keep_dac_busy == 0)) {
+      // nothing wants it now, so don't hold it open -- the next play() or prepare() will open it
+      int oldState;
+      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState); // make this un-cancellable
+      pthread_cleanup_debug_mutex_lock(&alsa_mutex, 50000, 0);
+      if ((output_device_gone) && (output_device_wanted == 0) && (config.keep_dac_busy == 0)) {
+        debug(2, "alsa: the output device \"%s\" is not needed now, so it will not be reopened "
+                 "until it is.",
+              alsa_out_dev);
+        output_device_gone = 0;
+        event_time = 0;
+      }
+      debug_mutex_unlock(&alsa_mutex, 0);
+      pthread_cleanup_pop(0); // release the mutex
+      pthread_setcancelstate(oldState, NULL);
+    } else if ((output_device_gone) && ((ret == 0) || (inotify_fd < 0))) {
+      int oldState;
+      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState); // make this un-cancellable
+      pthread_cleanup_debug_mutex_lock(&alsa_mutex, 50000, 0);
+      // reopen it using the format and rate it had, so the player doesn't have to know
+      if (do_open(0) == 0) {
+        if ((has_softvol) && (ctl)) {
+          snd_ctl_close(ctl);
+          if (snd_ctl_open(&ctl, alsa_mix_dev, 0) < 0) {
+            warn("Cannot reopen control \"%s\"", alsa_mix_dev);
+            ctl = NULL;
+          }
+        }
+        uint64_t time_now = get_absolute_time_in_ns();
+        if (event_time != 0)
+          inform("alsa: the output device \"%s\" is back, %.3f seconds after it was lost and "
+                 "%.3f seconds after it was plugged in.",
+                 alsa_out_dev, 0.000000001 * (time_now - output_device_gone_time),
+                 0.000000001 * (time_now - event_time));
+        else
+          inform("alsa: the output device \"%s\" is back, %.3f seconds after it was lost.",
+                 alsa_out_dev, 0.000000001 * (time_now - output_device_gone_time));
+        output_device_gone = 0;
+      } else {
+        debug(2, "alsa: the output device \"%s\" can not be reopened yet.", alsa_out_dev);
+      }
+      event_time = 0;
+      debug_mutex_unlock(&alsa_mutex, 0);
+      pthread_cleanup_pop(0); // release the mutex
+      pthread_setcancelstate(oldState, NULL);
+    }
+  }
+  pthread_cleanup_pop(1);
+  pthread_exit(NULL);
+}
@@ -0,0 +1,462 @@
+/*
+ * timestamped chunk output driver. This file is part of Shairport Sync.
+ *
+ * Based on the pipe output driver.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// This backend is for distribution servers such as Snapcast that do their own timing. Rather than
+// raw PCM, it sends the audio in chunks over a Unix or TCP socket, each with a header giving the
+// local time at which its first frame should be heard, so the server doesn't have to guess it from
+// when the audio arrives.
+
+// Each chunk is a 32-byte header followed by the frames, PCM 16 bit little endian, interleaved
+// stereo. All header fields are little endian:
+//   0  "SPSC"
+//   4  uint16_t version, 1
+//   6  uint16_t header length, 32
+//   8  uint64_t stream position of the first frame -- frames sent since the backend started
+//  16  uint32_t number of frames in the chunk -- zero for a flush
+//  20  uint32_t frames per second
+//  24  uint64_t when the first frame should be heard -- CLOCK_MONOTONIC, in nanoseconds
+// A chunk with no frames is a flush: the receiver should drop everything it hasn't yet played.
+
+// The receiver may send back 24-byte acknowledgements, again little endian:
+//   0  "SPSA"
+//   4  uint32_t version, 1
+//   8  uint64_t the stream position of a frame...
+//  16  uint64_t ...and when it was heard -- CLOCK_MONOTONIC, in nanoseconds
+// From these, the backend works out how many frames are waiting to be heard, so that Shairport Sync
+// can keep the receiver's output in step with the source. Without them, the delay is taken from
+// the chunks' own times, and keeping in step is left to the receiver.
+
+// The times are on this machine's clock, so the receiver must be on the same machine. A TCP address
+// must therefore be numeric -- "127.0.0.1:4953", say -- so it's never looked up. The connection is
+// made without blocking, as it's made by the player thread, and is completed by a later call.
+
+#include "audio.h"
+#include "common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define CHUNK_HEADER_LENGTH 32
+#define CHUNK_ACK_LENGTH 24
+
+static int fd = -1;
+static int connecting = 0; // fd is a connection still being made
+static char *chunk_address = NULL;
+static char *default_chunk_address = "/tmp/shairport-sync-chunks";
+static struct sockaddr_storage receiver_address; // worked out from chunk_address by init()
+static socklen_t receiver_address_length;
+static uint64_t time_of_last_connection_attempt = 0;
+
+static int output_rate;
+static uint64_t stream_position = 0;       // the position of the next frame to be sent
+static uint64_t next_presentation_time = 0; // when the next frame will be heard, if known
+static uint64_t flush_position = 0;         // acknowledgements of earlier positions are stale
+
+static uint64_t acknowledged_position = 0;
+static uint64_t acknowledged_time = 0; // zero if there's no current acknowledgement
+
+// the unsent remainder of a chunk that couldn't be written all at once
+static uint8_t *unsent = NULL;
+static size_t unsent_length = 0;
+static size_t unsent_capacity = 0;
+
+static uint64_t chunks_dropped = 0;
+
+static void put_le16(uint8_t *p, uint16_t v) {
+  p[0] = v & 0xff;
+  p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+  int i;
+  for (i = 0; i < 4; i++)
+    p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static void put_le64(uint8_t *p, uint64_t v) {
+  int i;
+  for (i = 0; i < 8; i++)
+    p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+  uint64_t v = 0;
+  int i;
+  for (i = 7; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static void disconnect(void) {
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+  connecting = 0;
+  unsent_length = 0;
+  acknowledged_time = 0;
+}
+
+// An address that starts with a '/' is a Unix socket; otherwise it's "host:port" for TCP, with a
+// numeric host and an IPv6 host in square brackets. Returns 0 if it can't be used.
+static int set_receiver_address(const char *address) {
+  memset(&receiver_address, 0, sizeof(receiver_address));
+  if (address[0] == '/') {
+    struct sockaddr_un *sa = (struct sockaddr_un *)&receiver_address;
+    if (strlen(address) >= sizeof(sa->sun_path))
+      return 0;
+    sa->sun_family = AF_UNIX;
+    strncpy(sa->sun_path, address, sizeof(sa->sun_path) - 1);
+    receiver_address_length = sizeof(struct sockaddr_un);
+    return 1;
+  }
+  char host[256];
+  const char *port = strrchr(address, ':');
+  if ((port == NULL) || ((size_t)(port - address) >= sizeof(host)))
+    return 0;
+  memcpy(host, address, port - address);
+  host[port - address] = '\0';
+  port++;
+  char *h = host;
+  if ((h[0] == '[') && (h[strlen(h) - 1] == ']')) {
+    h[strlen(h) - 1] = '\0';
+    h++;
+  }
+  struct addrinfo hints, *info;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+  if (getaddrinfo(h, port, &hints, &info) != 0)
+    return 0;
+  memcpy(&receiver_address, info->ai_addr, info->ai_addrlen);
+  receiver_address_length = info->ai_addrlen;
+  freeaddrinfo(info);
+  return 1;
+}
+
+// Start connecting to the receiver. Returns the socket, with connecting set if the connection is
+// still being made, or -1.
+static int connect_to_receiver(void) {
+  int s = socket(receiver_address.ss_family, SOCK_STREAM, 0);
+  if (s < 0)
+    return -1;
+  // never let the player thread wait for the receiver
+  int flags = fcntl(s, F_GETFL, 0);
+  fcntl(s, F_SETFL, flags | O_NONBLOCK);
+  if (connect(s, (struct sockaddr *)&receiver_address, receiver_address_length) == 0) {
+    debug(1, "chunk backend connected to \"%s\".", chunk_address);
+  } else if (errno == EINPROGRESS) {
+    connecting = 1;
+  } else {
+    close(s);
+    s = -1;
+  }
+  return s;
+}
+
+// see if a connection being made has been made -- returns 1 if so, 0 if not yet, -1 if it failed
+static int check_connection(void) {
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+  if (poll(&pfd, 1, 0) == 0)
+    return 0;
+  int error = 0;
+  socklen_t error_length = sizeof(error);
+  if ((getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length) != 0) || (error != 0))
+    return -1;
+  connecting = 0;
+  debug(1, "chunk backend connected to \"%s\".", chunk_address);
+  return 1;
+}
+
+// Try to connect if there's no connection, but not more than once a second. A connection still
+// being made is given up, to be tried again, if it hasn't been made in that time.
+static int have_connection(void) {
+  uint64_t time_now = get_absolute_time_in_ns();
+  if ((fd >= 0) && (connecting)) {
+    int rc = check_connection();
+    if ((rc < 0) || ((rc == 0) && (time_now - time_of_last_connection_attempt >= 1000000000)))
+      disconnect();
+  }
+  if (fd < 0) {
+    if ((time_of_last_connection_attempt == 0) ||
+        (time_now - time_of_last_connection_attempt >= 1000000000)) {
+      time_of_last_connection_attempt = time_now;
+      fd = connect_to_receiver();
+    }
+  }
+  return ((fd >= 0) && (connecting == 0));
+}
+
+// returns 1 if everything has been sent, 0 if some of it is still to go, -1 if the connection
+// has gone
+static int send_unsent(void) {
+  while (unsent_length != 0) {
+    ssize_t rc = write(fd, unsent, unsent_length);
+    if (rc < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        return 0;
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    memmove(unsent, unsent + rc, unsent_length - rc);
+    unsent_length -= rc;
+  }
+  return 1;
+}
+
+// keep data to be sent after whatever is already waiting
+static void keep_unsent(const uint8_t *data, size_t length) {
+  if (unsent_capacity < unsent_length + length) {
+    uint8_t *b = realloc(unsent, unsent_length + length);
+    if (b == NULL)
+      die("chunk backend: can not allocate %zu bytes for a chunk.", unsent_length + length);
+    unsent = b;
+    unsent_capacity = unsent_length + length;
+  }
+  memcpy(unsent + unsent_length, data, length);
+  unsent_length += length;
+}
+
+static void make_header(uint8_t *header, int samples) {
+  memcpy(header, "SPSC", 4);
+  put_le16(header + 4, 1);
+  put_le16(header + 6, CHUNK_HEADER_LENGTH);
+  put_le64(header + 8, stream_position);
+  put_le32(header + 16, samples);
+  put_le32(header + 20, output_rate);
+  put_le64(header + 24, next_presentation_time);
+}
+
+// Send a header and its frames, if any. Whatever can't be written at once is kept to go first next
+// time; if there's still something waiting from last time, the chunk is dropped -- unless it's a
+// flush, which is never dropped, but queued to follow what's waiting.
+static void send_chunk(void *buf, int samples) {
+  if (have_connection() == 0)
+    return;
+  uint8_t header[CHUNK_HEADER_LENGTH];
+  make_header(header, samples);
+  int rc = send_unsent();
+  if ((rc == 0) && (samples == 0)) {
+    keep_unsent(header, CHUNK_HEADER_LENGTH);
+    rc = send_unsent();
+    if (rc >= 0)
+      return;
+  } else if (rc == 0) {
+    chunks_dropped++;
+    if ((chunks_dropped % 100) == 1)
+      debug(1, "chunk backend: the receiver isn't keeping up -- %" PRIu64 " chunks dropped.",
+            chunks_dropped);
+    return;
+  } else if (rc == 1) {
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = CHUNK_HEADER_LENGTH;
+    iov[1].iov_base = buf;
+    iov[1].iov_len = samples * 4;
+    size_t length = iov[0].iov_len + iov[1].iov_len;
+    ssize_t written;
+    do {
+      written = writev(fd, iov, samples == 0 ? 1 : 2);
+    } while ((written < 0) && (errno == EINTR));
+    if ((written < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+      written = 0;
+    if (written >= 0) {
+      if ((size_t)written < length) {
+        // keep the rest to be sent first next time, so that the stream stays framed
+        size_t header_remaining = written < CHUNK_HEADER_LENGTH ? CHUNK_HEADER_LENGTH - written : 0;
+        keep_unsent(header + CHUNK_HEADER_LENGTH - header_remaining, header_remaining);
+        if (length - written > header_remaining)
+          keep_unsent((uint8_t *)buf +
+                          (written > CHUNK_HEADER_LENGTH ? written - CHUNK_HEADER_LENGTH : 0),
+                      length - written - header_remaining);
+      }
+      return;
+    }
+  }
+  if (fd >= 0) {
+    char errorstring[1024];
+    strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+    debug(1, "chunk backend: error %d (\"%s\") sending to \"%s\" -- disconnecting.", errno,
+          (char *)errorstring, chunk_address);
+  }
+  disconnect();
+}
+
+static void read_acknowledgements(void) {
+  uint8_t ack[CHUNK_ACK_LENGTH * 16];
+  ssize_t nread;
+  // a stream socket needn't keep the acknowledgements whole, so read only whole ones
+  while ((fd >= 0) && ((nread = recv(fd, ack, sizeof(ack), MSG_PEEK)) >= CHUNK_ACK_LENGTH)) {
+    size_t whole = (nread / CHUNK_ACK_LENGTH) * CHUNK_ACK_LENGTH;
+    if (recv(fd, ack, whole, 0) != (ssize_t)whole)
+      break;
+    size_t i;
+    for (i = 0; i < whole; i += CHUNK_ACK_LENGTH) {
+      if (memcmp(ack + i, "SPSA", 4) == 0) {
+        uint64_t position = get_le64(ack + i + 8);
+        if (position >= flush_position) {
+          acknowledged_position = position;
+          acknowledged_time = get_le64(ack + i + 16);
+        }
+      }
+    }
+  }
+  if (nread == 0) { // the receiver has closed the connection
+    debug(1, "chunk backend: \"%s\" has closed the connection.", chunk_address);
+    disconnect();
+  }
+}
+
+static void presentation_time(uint64_t time_to_play) { next_presentation_time = time_to_play; }
+
+static int play(void *buf, int samples) {
+  // if the player hasn't said when the frames are to be heard, they follow on from the last ones
+  if (next_presentation_time == 0)
+    next_presentation_time = get_absolute_time_in_ns();
+  send_chunk(buf, samples);
+  stream_position += samples;
+  next_presentation_time += ((uint64_t)samples * 1000000000) / output_rate;
+  return 0;
+}
+
+static int delay(long *the_delay) {
+  uint64_t time_now = get_absolute_time_in_ns();
+  int64_t frames_waiting;
+  // get anything waiting, such as a flush, on its way without waiting for the next chunk
+  if ((fd >= 0) && (connecting == 0) && (unsent_length != 0) && (send_unsent() < 0))
+    disconnect();
+  if ((fd >= 0) && (connecting == 0))
+    read_acknowledgements();
+  if ((acknowledged_time != 0) && (time_now >= acknowledged_time)) {
+    // the receiver was hearing acknowledged_position at acknowledged_time; it has heard more since
+    uint64_t frames_heard_since = ((time_now - acknowledged_time) * output_rate) / 1000000000;
+    frames_waiting = stream_position - (acknowledged_position + frames_heard_since);
+  } else if (next_presentation_time > time_now) {
+    frames_waiting = ((next_presentation_time - time_now) * output_rate) / 1000000000;
+  } else {
+    frames_waiting = 0;
+  }
+  if (frames_waiting < 0)
+    frames_waiting = 0;
+  *the_delay = frames_waiting;
+  return 0;
+}
+
+static void flush(void) {
+  // tell the receiver to drop what it hasn't played
+  send_chunk(NULL, 0);
+  flush_position = stream_position;
+  acknowledged_time = 0;
+  next_presentation_time = 0;
+}
+
+static void start(int sample_rate, __attribute__((unused)) int sample_format) {
+  output_rate = sample_rate;
+  next_presentation_time = 0;
+  have_connection();
+}
+
+static void stop(void) {
+  // Don't disconnect just because a play session has stopped.
+  next_presentation_time = 0;
+}
+
+static int init(int argc, char **argv) {
+  // set up default values first
+
+  config.audio_backend_buffer_desired_length = 0.5;
+  config.audio_backend_latency_offset = 0;
+
+  // do the "general" audio  options. Note, these options are in the "general" stanza!
+  parse_general_audio_options();
+
+  if (config.cfg != NULL) {
+    /* Get the address of the receiver. */
+    const char *str;
+    if (config_lookup_string(config.cfg, "chunk.address", &str)) {
+      chunk_address = (char *)str;
+    }
+  }
+
+  if (argc > 1)
+    die("too many command-line arguments to chunk");
+
+  if (argc == 1)
+    chunk_address = argv[0]; // command line argument has priority
+
+  if (chunk_address == NULL)
+    chunk_address = default_chunk_address; // if none specified
+  if (set_receiver_address(chunk_address) == 0)
+    die("chunk backend: \"%s\" is neither the path of a Unix socket nor a numeric \"host:port\".",
+        chunk_address);
+
+  output_rate = config.output_rate;
+  debug(1, "chunk backend receiver address is \"%s\".", chunk_address);
+  return 0;
+}
+
+static void deinit(void) {
+  disconnect();
+  free(unsent);
+  unsent = NULL;
+  unsent_capacity = 0;
+}
+
+static void help(void) {
+  printf("    specify the path of a Unix socket, or a numeric host:port for TCP, to send the "
+         "chunks to.\n");
+}
+
+audio_output audio_chunk = {.name = "chunk",
+                            .help = &help,
+                            .init = &init,
+                            .deinit = &deinit,
+                            .prepare = NULL,
+                            .start = &start,
+                            .stop = &stop,
+                            .is_running = NULL,
+                            .flush = &flush,
+                            .delay = &delay,
+                            .presentation_time = &presentation_time,
+                            .play = &play,
+                            .volume = NULL,
+                            .parameters = NULL,
+                            .mute = NULL};
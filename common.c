@@ -32,12 +32,14 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <memory.h>
+#include <netinet/in.h>
 #include <poll.h>
 #include <popt.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -266,6 +268,135 @@ uint16_t nextFreeUDPPort() {
   return UDPPortIndex;
 }
 
+const char *socket_class_name_array[] = {"audio", "control", "timing", "rtsp", "dacp"};
+
+const char *socket_class_name(socket_class_type socket_class) {
+  if (socket_class < SC_number_of_socket_classes)
+    return socket_class_name_array[socket_class];
+  else
+    return "unknown";
+}
+
+void set_socket_traffic_class(int fd, int ip_family, socket_class_type socket_class) {
+  // failures are not fatal -- the packets will simply go out unmarked or at the default priority
+  char errorstring[1024];
+  int dscp = config.socket_dscp[socket_class];
+  if (dscp >= 0) {
+    int tos = dscp << 2; // the DSCP is the upper six bits of the TOS / Traffic Class octet
+    int ret = -1;
+#ifdef AF_INET6
+    if (ip_family == AF_INET6) {
+#ifdef IPV6_TCLASS
+      ret = setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos));
+#else
+      errno = ENOPROTOOPT;
+#endif
+    } else
+#endif
+      ret = setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+    if (ret < 0) {
+      strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+      debug(1, "error %d: \"%s\" setting DSCP %d on the %s socket.", errno, errorstring, dscp,
+            socket_class_name(socket_class));
+    } else {
+      debug(3, "%s socket marked with DSCP %d.", socket_class_name(socket_class), dscp);
+    }
+  }
+  int priority = config.socket_priority[socket_class];
+  if (priority >= 0) {
+#ifdef SO_PRIORITY
+    if (setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(priority)) < 0) {
+      strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+      debug(1, "error %d: \"%s\" setting SO_PRIORITY %d on the %s socket.", errno, errorstring,
+            priority, socket_class_name(socket_class));
+    } else {
+      debug(3, "%s socket given SO_PRIORITY %d.", socket_class_name(socket_class), priority);
+    }
+#else
+    debug(1, "SO_PRIORITY is not available on this system -- the %s socket priority is ignored.",
+          socket_class_name(socket_class));
+#endif
+  }
+}
+
+int cpu_latency_request(int latency_us) {
+  // the request stays in force for as long as the file is held open
+  int fd = -1;
+  if (latency_us >= 0) {
+    char errorstring[1024];
+    fd = open("/dev/cpu_dma_latency", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+      strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+      warn("error %d: \"%s\" opening /dev/cpu_dma_latency -- the CPU latency bound of %d "
+           "microseconds will not be applied.",
+           errno, errorstring, latency_us);
+    } else {
+      int32_t value = latency_us;
+      if (write(fd, &value, sizeof(value)) != sizeof(value)) {
+        strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+        warn("error %d: \"%s\" requesting a CPU latency bound of %d microseconds.", errno,
+             errorstring, latency_us);
+        close(fd);
+        fd = -1;
+      } else {
+        debug(2, "CPU latency bound of %d microseconds requested.", latency_us);
+      }
+    }
+  }
+  return fd;
+}
+
+void cpu_latency_release(int fd) {
+  if (fd >= 0) {
+    close(fd);
+    debug(2, "CPU latency bound released.");
+  }
+}
+
+#if defined(__linux__) && defined(SYS_sched_setattr)
+// glibc doesn't declare sched_setattr, so use the system call with the kernel's structure
+struct sched_attr_with_utilisation_clamp {
+  uint32_t size;
+  uint32_t sched_policy;
+  uint64_t sched_flags;
+  int32_t sched_nice;
+  uint32_t sched_priority;
+  uint64_t sched_runtime;
+  uint64_t sched_deadline;
+  uint64_t sched_period;
+  uint32_t sched_util_min;
+  uint32_t sched_util_max;
+};
+#define SPS_SCHED_FLAG_KEEP_POLICY 0x08
+#define SPS_SCHED_FLAG_KEEP_PARAMS 0x10
+#define SPS_SCHED_FLAG_UTIL_CLAMP_MIN 0x20
+#endif
+
+void set_thread_minimum_utilisation(int percent) {
+  if (percent >= 0) {
+#if defined(__linux__) && defined(SYS_sched_setattr)
+    struct sched_attr_with_utilisation_clamp attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    // leave the scheduling policy and priority alone -- just clamp the utilisation from below
+    attr.sched_flags =
+        SPS_SCHED_FLAG_KEEP_POLICY | SPS_SCHED_FLAG_KEEP_PARAMS | SPS_SCHED_FLAG_UTIL_CLAMP_MIN;
+    attr.sched_util_min = (percent * 1024) / 100;
+    if (syscall(SYS_sched_setattr, 0, &attr, 0) != 0) {
+      char errorstring[1024];
+      strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+      debug(1, "error %d: \"%s\" setting a minimum utilisation of %d%% on the thread.", errno,
+            errorstring, percent);
+    } else {
+      debug(2, "thread minimum utilisation set to %d%%.", percent);
+    }
+#else
+    debug(1, "utilisation clamping is not available on this system -- the minimum utilisation "
+             "setting is ignored.");
+#endif
+  }
+}
+
 int get_requested_connection_state_to_output() { return requested_connection_state_to_output; }
 
 void set_requested_connection_state_to_output(int v) { requested_connection_state_to_output = v; }
@@ -1486,12 +1617,21 @@ char *get_version_string() {
 #ifdef CONFIG_PIPE
     strcat(version_string, "-pipe");
 #endif
+#ifdef CONFIG_CHUNK
+    strcat(version_string, "-chunk");
+#endif
 #ifdef CONFIG_SOXR
     strcat(version_string, "-soxr");
 #endif
 #ifdef CONFIG_CONVOLUTION
     strcat(version_string, "-convolution");
 #endif
+#ifdef CONFIG_FIXED_POINT
+    strcat(version_string, "-fixed-point");
+#endif
+#ifdef CONFIG_USDT
+    strcat(version_string, "-usdt");
+#endif
 #ifdef CONFIG_METADATA
     strcat(version_string, "-metadata");
 #endif
@@ -1568,7 +1708,8 @@ int64_t generate_zero_frames(char *outp, size_t number_of_frames, sps_format_t f
   char *p = outp;
   size_t sample_number;
   r64_lock; // the random number generator is not thread safe, so we need to lock it while using it
-  for (sample_number = 0; sample_number < number_of_frames * 2; sample_number++) {
+  for (sample_number = 0; sample_number < number_of_frames * config.output_channels;
+       sample_number++) {
 
     int64_t hyper_sample = 0;
     int64_t r = r64i();
@@ -13,6 +13,7 @@
 #include "config.h"
 #include "definitions.h"
 #include "mdns.h"
+#include "resampler.h"
 
 // struct sockaddr_in6 is bigger than struct sockaddr. derp
 #ifdef AF_INET6
@@ -46,7 +47,7 @@ typedef enum {
 } endian_type;
 
 typedef enum {
-  ST_basic = 0, // straight deletion or insertion of a frame in a 352-frame packet
+  ST_basic = 0, // deletion or insertion of a frame by a short crossfade in a 352-frame packet
   ST_soxr,      // use libsoxr to make a 352 frame packet one frame longer or shorter
   ST_auto,      // use soxr if compiled for it and if the soxr_index is low enough
 } stuffing_type;
@@ -59,6 +60,25 @@ typedef enum {
   ST_right_only,
 } playback_mode_type;
 
+typedef enum {
+  CM_silent = 0,
+  CM_left,
+  CM_right,
+  CM_mono, // the average of left and right
+} channel_map_source_type;
+
+typedef struct {
+  channel_map_source_type source;
+  double gain_db;
+  double delay; // seconds
+} channel_map_entry;
+
+typedef enum {
+  SG_none = 0, // not in a sync group
+  SG_leader,   // announce our timing model to the group
+  SG_follower, // use the leader's timing model when playing from the same source
+} syncgroup_role_type;
+
 typedef enum {
   VCP_standard = 0,
   VCP_flat,
@@ -99,6 +119,19 @@ typedef enum {
 
 const char *sps_format_description_string(sps_format_t format);
 
+// the sockets that can be given their own DSCP marking and SO_PRIORITY
+
+typedef enum {
+  SC_audio = 0, // RTP audio data, incoming
+  SC_control,   // RTP control -- sync packets, resend requests and resent packets
+  SC_timing,    // RTP timing requests and replies
+  SC_rtsp,      // the RTSP conversation
+  SC_dacp,      // DACP remote control commands to the source
+  SC_number_of_socket_classes,
+} socket_class_type;
+
+const char *socket_class_name(socket_class_type socket_class);
+
 typedef struct {
   double missing_port_dacp_scan_interval_seconds; // if no DACP port number can be found, check at
                                                   // these intervals
@@ -152,6 +185,19 @@ typedef struct {
   int port;
   int udp_port_base;
   int udp_port_range;
+  int socket_dscp[SC_number_of_socket_classes];     // DSCP (0 to 63) to mark outgoing packets
+                                                    // with; -1 means leave the system default
+  int socket_priority[SC_number_of_socket_classes]; // SO_PRIORITY for the local queueing
+                                                    // discipline; -1 means leave it alone
+  int udp_receive_buffer_size; // for the audio and control sockets: 0 means size it automatically,
+                               // -1 means leave the system default, otherwise the size in bytes
+  double buffered_audio_length; // seconds of audio sent ahead over TCP to hold; 0 means don't offer
+  int adaptive_latency; // set to 1 to choose the latency from the network's behaviour
+  double adaptive_latency_minimum; // seconds
+  double adaptive_latency_maximum; // seconds
+  double adaptive_latency_late_packet_target; // the fraction of packets that may arrive too late
+  int cpu_latency_bound; // in microseconds, requested while playing; -1 means don't ask
+  int player_thread_minimum_utilisation; // percent; 0 means leave it alone
   int ignore_volume_control;
   int volume_max_db_set; // set to 1 if a maximum volume db has been set
   int volume_max_db;
@@ -165,6 +211,18 @@ typedef struct {
                // of seconds . Zero means never exit.
   int dont_check_timeout; // this is used to maintain backward compatibility with the old -t option
                           // behaviour; only set by -t 0, cleared by everything else
+  double sender_silence_timeout; // while in play mode, end the session if no packets at all come
+                                 // from the source for this many seconds. Zero means don't check.
+  double idle_session_shrink_timeout; // park the player of a session whose audio has stopped for
+                                      // this many seconds. Zero means never.
+  syncgroup_role_type syncgroup_role;
+  char *syncgroup_name;    // only instances with the same group name work together
+  char *syncgroup_address; // where the leader sends its announcements
+  int syncgroup_port;
+  int local_input_enabled;
+  char *local_input_socket_path;
+  double local_input_ducking_level;        // the level of the AirPlay audio while ducked, in dB
+  double local_input_ducking_release_time; // how long the AirPlay audio takes to recover, in s
   char *output_name;
   audio_output *output;
   char *mdns_name;
@@ -189,7 +247,11 @@ typedef struct {
   int debugger_show_relative_time; // in the debug message, display the time since the last one
   int debugger_show_file_and_line; // in the debug message, display the filename and line number
   int statistics_requested, use_negotiated_latencies;
+  int performance_counters; // report hardware performance counters with the statistics
   playback_mode_type playback_mode;
+  int output_channels;   // 2 unless a channel map is in use
+  int channel_map_in_use; // if set, each output channel is made as its channel_map entry says
+  channel_map_entry channel_map[MAX_OUTPUT_CHANNELS];
   char *cmd_start, *cmd_stop, *cmd_set_volume, *cmd_unfixable;
   char *cmd_active_start, *cmd_active_stop;
   int cmd_blocking, cmd_start_returns_output;
@@ -198,9 +260,13 @@ typedef struct {
   int soxr_delay_index;
   int soxr_delay_threshold; // the soxr delay must be less or equal to this for soxr interpolation
                             // to be enabled under the auto setting
+  resampler_quality_type resampler_quality; // used if the output rate is not a multiple of the
+                                            // input rate
   int decoders_supported;
   int use_apple_decoder; // set to 1 if you want to use the apple decoder instead of the original by
                          // David Hammerton
+  int alac_decoder_auto; // set to 1 to measure both decoders and use the faster one
+  char *alac_decoder_choice_file; // where the measured choice is kept; "" means it isn't kept
   // char *logfile;
   // char *errfile;
   char *configfile;
@@ -250,6 +316,10 @@ typedef struct {
   int loudness;
   float loudness_reference_volume_db;
   int alsa_use_hardware_mute;
+  int alsa_direct_hw_access; // if the output device is a plugin chain over a hw: device that can
+                             // take the output natively, open the hw: device instead
+  int alsa_disable_period_wakeups; // if the device can, run it without period interrupts and
+                                   // time the writes from the hardware position instead
   double alsa_maximum_stall_time;
   disable_standby_mode_type disable_standby_mode;
   volatile int keep_dac_busy;
@@ -336,6 +406,18 @@ int64_t r64i();
 void resetFreeUDPPort();
 uint16_t nextFreeUDPPort();
 
+// apply any DSCP marking and SO_PRIORITY configured for the class of socket
+void set_socket_traffic_class(int fd, int ip_family, socket_class_type socket_class);
+
+// ask for the CPUs' wakeup latency to be bounded while the file descriptor returned is held open
+// (Linux only); returns -1 if latency_us is negative or if the request can't be made
+int cpu_latency_request(int latency_us);
+void cpu_latency_release(int fd);
+
+// set a utilisation clamp on the calling thread so that the frequency governor doesn't run the
+// CPU slowly while it's busy (Linux 5.3 and later); 0 removes it
+void set_thread_minimum_utilisation(int percent);
+
 extern volatile int debuglev;
 
 void _die(const char *filename, const int linenumber, const char *format, ...);
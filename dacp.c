@@ -65,6 +65,30 @@ pthread_t dacp_monitor_thread;
 dacp_server_record dacp_server;
 void *mdns_dacp_monitor_private_storage_pointer;
 
+// A model of the source's volumes -- its overall volume and its speakers, each with a volume
+// relative to the overall volume -- so that getting or setting our speaker's volume doesn't take
+// two HTTP round trips each time. The DACP monitor refreshes it on every scan, but it only asks for
+// the speaker list again if the overall volume has changed or the model has been invalidated -- as
+// it is when the source's status revision changes, when the source sets our volume, when we set a
+// volume and when the DACP server changes.
+// The lock is only held to copy the model in or out, never across an HTTP request, so that a slow
+// or vanished source can't hold up anything else. Invalidation just bumps the generation count,
+// without taking the lock; a model is only valid for the generation in which its fetch began.
+#define DACP_SPEAKER_LIMIT 50
+typedef struct {
+  int valid;
+  uint32_t generation; // the volume_model_generation when it was fetched
+  int32_t overall_volume;
+  int speaker_count;
+  int our_speaker; // the index of our speaker in the list, or -1 if it's not there
+  dacp_spkr_stuff speakers[DACP_SPEAKER_LIMIT];
+} dacp_volume_model_record;
+
+static dacp_volume_model_record volume_model;
+static pthread_mutex_t volume_model_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t volume_model_generation = 0; // accessed atomically
+static int64_t our_machine_number; // our speaker number, from config.hw_addr
+
 // HTTP Response data/funcs (See the tinyhttp example.cpp file for more on this.)
 struct HttpResponse {
   void *body;            // this will be a malloc'ed pointer
@@ -222,6 +246,8 @@ int dacp_send_command(const char *command, char **body, ssize_t *bodysize) {
           pthread_cleanup_push(connect_cleanup, (void *)&sockfd);
           // debug(2, "dacp_send_command: open socket %d.",sockfd);
 
+          set_socket_traffic_class(sockfd, res->ai_family, SC_dacp);
+
           // This is for limiting the time to be spent waiting for a response.
 
           struct timeval tv;
@@ -403,6 +429,7 @@ void set_dacp_server_information(rtsp_conn_info *conn) {
       dacp_server.dacp_id[0] = '\0';
     dacp_server.port = 0;
     dacp_server.scan_enable = 0;
+    dacp_volume_model_invalidate(); // it's a different source
     dacp_server.connection_family = conn->connection_ip_family;
     dacp_server.scope_id = conn->self_scope_id;
     strncpy(dacp_server.ip_string, conn->client_ip_string, INET6_ADDRSTRLEN);
@@ -498,6 +525,7 @@ void *dacp_monitor_thread_code(__attribute__((unused)) void *na) {
   // debug(1, "DACP monitor thread started.");
   // wait until we get a valid port number to begin monitoring it
   int32_t revision_number = 1;
+  int32_t last_revision_number = 0; // the last one received, even if it's not asked for again
   int bad_result_count = 0;
   int idle_scan_count = 0;
   while (1) {
@@ -564,7 +592,7 @@ void *dacp_monitor_thread_code(__attribute__((unused)) void *na) {
     always_use_revision_number_1 =
         dacp_server.always_use_revision_number_1; // set this while access is locked
 
-    result = dacp_get_volume(&the_volume); // just want the http code
+    result = dacp_scan_volume(&the_volume); // the http code, and the volume model is refreshed
     pthread_cleanup_pop(1);
 
     if (result == 490) { // 490 means no port was specified
@@ -697,6 +725,11 @@ void *dacp_monitor_thread_code(__attribute__((unused)) void *na) {
                 case 'cmsr': // revision number
                   t = sp - item_size;
                   revision_number = ntohl(*(uint32_t *)(t));
+                  if (revision_number != last_revision_number) {
+                    // something has changed -- maybe the speakers
+                    dacp_volume_model_invalidate();
+                    last_revision_number = revision_number;
+                  }
                   // debug(1,"New revision number received: %d", revision_number);
                   break;
                 case 'caps': // play status
@@ -995,6 +1028,13 @@ void dacp_monitor_start() {
 
   memset(&dacp_server, 0, sizeof(dacp_server_record));
 
+  // get our machine number
+  uint16_t *hn = (uint16_t *)config.hw_addr;
+  uint32_t *ln = (uint32_t *)(config.hw_addr + 2);
+  uint64_t t1 = ntohs(*hn);
+  uint64_t t2 = ntohl(*ln);
+  our_machine_number = (t1 << 32) + t2; // this form is useful
+
   pthread_create(&dacp_monitor_thread, NULL, dacp_monitor_thread_code, NULL);
   dacp_monitor_initialised = 1;
 }
@@ -1216,164 +1256,174 @@ int dacp_get_speaker_list(dacp_spkr_stuff *speaker_info, int max_size_of_array,
   return response;
 }
 
-int dacp_get_volume(int32_t *the_actual_volume) {
-  // get the speaker volume information from the DACP source and store it in the metadata_hub
-  // A volume command has been sent from the client
-  // let's get the master volume from the DACP remote control
-  struct dacp_speaker_stuff speaker_info[50];
-  // we need the overall volume and the speakers information to get this device's relative volume to
-  // calculate the real volume
+// copy the volume model into *model, returning true if it's valid
+static int get_volume_model(dacp_volume_model_record *model) {
+  pthread_mutex_lock(&volume_model_lock);
+  *model = volume_model;
+  pthread_mutex_unlock(&volume_model_lock);
+  return (model->valid != 0) &&
+         (model->generation == __atomic_load_n(&volume_model_generation, __ATOMIC_ACQUIRE));
+}
 
+// get the overall volume and, if it has changed or the model isn't valid, the speaker list, into
+// *model and the volume model. Call without the volume_model_lock held.
+static int refresh_volume_model(dacp_volume_model_record *model) {
+  // an invalidation during the requests leaves what they get invalid
+  uint32_t generation = __atomic_load_n(&volume_model_generation, __ATOMIC_ACQUIRE);
+  int model_valid = get_volume_model(model);
   int32_t overall_volume = 0;
-  int32_t actual_volume = 0;
   int http_response = dacp_get_client_volume(&overall_volume);
   if (http_response == 200) {
-    // debug(1,"Overall volume is: %u.",overall_volume);
-    int speaker_count = 0;
-    http_response = dacp_get_speaker_list((dacp_spkr_stuff *)&speaker_info, 50, &speaker_count);
-    if (http_response == 200) {
-      // get our machine number
-      uint16_t *hn = (uint16_t *)config.hw_addr;
-      uint32_t *ln = (uint32_t *)(config.hw_addr + 2);
-      uint64_t t1 = ntohs(*hn);
-      uint64_t t2 = ntohl(*ln);
-      int64_t machine_number = (t1 << 32) + t2; // this form is useful
-
-      // Let's find our own speaker in the array and pick up its relative volume
-      int i;
-      int32_t relative_volume = 0;
-      for (i = 0; i < speaker_count; i++) {
-        if (speaker_info[i].speaker_number == machine_number) {
-          relative_volume = speaker_info[i].volume;
-          /*
-          debug(1,"Our speaker was found with a relative volume of: %u.",relative_volume);
-
-          if (speaker_info[i].active)
-            debug(1,"Our speaker is active.");
-          else
-            debug(1,"Our speaker is inactive.");
-          */
-        }
+    if ((model_valid == 0) || (overall_volume != model->overall_volume)) {
+      int speaker_count = 0;
+      http_response = dacp_get_speaker_list(model->speakers, DACP_SPEAKER_LIMIT, &speaker_count);
+      if (http_response == 200) {
+        model->speaker_count = speaker_count;
+        // Let's find our own speaker in the array
+        model->our_speaker = -1;
+        int i;
+        for (i = 0; i < speaker_count; i++)
+          if (model->speakers[i].speaker_number == our_machine_number)
+            model->our_speaker = i;
+      } else {
+        debug(2, "Unexpected return code %d from dacp_get_speaker_list.", http_response);
       }
-      actual_volume = (overall_volume * relative_volume + 50) / 100;
-      // debug(1,"Overall volume: %d, relative volume: %d%, actual volume:
-      // %d.",overall_volume,relative_volume,actual_volume);
-      // debug(1,"Our actual speaker volume is %d.",actual_volume);
-      // metadata_hub_modify_prolog();
-      // metadata_store.speaker_volume = actual_volume;
-      // metadata_hub_modify_epilog(1);
-    } else {
-      debug(2, "Unexpected return code %d from dacp_get_speaker_list.", http_response);
     }
   } else if ((http_response != 400) && (http_response != 490)) {
     debug(3, "Unexpected return code %d from dacp_get_client_volume.", http_response);
   }
-  if (the_actual_volume) {
-    // debug(1,"dacp_get_volume returns %d.",actual_volume);
-    *the_actual_volume = actual_volume;
+  pthread_mutex_lock(&volume_model_lock);
+  if (http_response == 200) {
+    model->overall_volume = overall_volume;
+    model->generation = generation;
+    model->valid = 1;
+    volume_model = *model;
+  } else {
+    volume_model.valid = 0;
   }
+  pthread_mutex_unlock(&volume_model_lock);
+  return http_response;
+}
+
+static int32_t our_volume_in_model(dacp_volume_model_record *model) {
+  int32_t relative_volume = 0;
+  if (model->our_speaker >= 0)
+    relative_volume = model->speakers[model->our_speaker].volume;
+  return (model->overall_volume * relative_volume + 50) / 100;
+}
+
+void dacp_volume_model_invalidate(void) {
+  __atomic_add_fetch(&volume_model_generation, 1, __ATOMIC_RELEASE);
+}
+
+int dacp_scan_volume(int32_t *the_actual_volume) {
+  int32_t actual_volume = 0;
+  dacp_volume_model_record model;
+  int http_response = refresh_volume_model(&model);
+  if (http_response == 200)
+    actual_volume = our_volume_in_model(&model);
+  if (the_actual_volume)
+    *the_actual_volume = actual_volume;
+  return http_response;
+}
+
+int dacp_get_volume(int32_t *the_actual_volume) {
+  // served from the volume model, which is only refreshed from the source if it isn't valid
+  int32_t actual_volume = 0;
+  int http_response = 200;
+  dacp_volume_model_record model;
+  if (get_volume_model(&model) == 0)
+    http_response = refresh_volume_model(&model);
+  if (http_response == 200)
+    actual_volume = our_volume_in_model(&model);
+  if (the_actual_volume)
+    *the_actual_volume = actual_volume;
   return http_response;
 }
 
 int dacp_set_volume(int32_t vo) {
   int http_response = 492; // argument out of range
   if ((vo >= 0) && (vo <= 100)) {
-    // get the information we need -- the absolute volume, the speaker list, our ID
-    struct dacp_speaker_stuff speaker_info[50];
-    int32_t overall_volume;
-    http_response = dacp_get_client_volume(&overall_volume);
+    // the information we need -- the absolute volume, the speaker list, our ID -- is in the volume
+    // model, so only the setting itself goes to the source, unless the model has to be refreshed
+    dacp_volume_model_record model;
+    http_response = 200;
+    if (get_volume_model(&model) == 0)
+      http_response = refresh_volume_model(&model);
     if (http_response == 200) {
-      int speaker_count;
-      http_response = dacp_get_speaker_list((dacp_spkr_stuff *)&speaker_info, 50, &speaker_count);
-      if (http_response == 200) {
-        // get our machine number
-        uint16_t *hn = (uint16_t *)config.hw_addr;
-        uint32_t *ln = (uint32_t *)(config.hw_addr + 2);
-        uint64_t t1 = ntohs(*hn);
-        uint64_t t2 = ntohl(*ln);
-        int64_t machine_number = (t1 << 32) + t2; // this form is useful
-
-        // Let's find our own speaker in the array and pick up its relative volume
-        int i;
-        int32_t active_speakers = 0;
-        for (i = 0; i < speaker_count; i++) {
-          if (speaker_info[i].speaker_number == machine_number) {
-            debug(2, "Our speaker number found: %ld with relative volume.", machine_number,
-                  speaker_info[i].volume);
-          }
-          if (speaker_info[i].active == 1) {
-            active_speakers++;
-          }
+      int32_t overall_volume = model.overall_volume;
+      int speaker_count = model.speaker_count;
+      dacp_spkr_stuff *speaker_info = model.speakers;
+      int64_t machine_number = our_machine_number;
+      int i;
+      int32_t active_speakers = 0;
+      for (i = 0; i < speaker_count; i++) {
+        if (speaker_info[i].active == 1) {
+          active_speakers++;
         }
-
-        if (active_speakers == 1) {
-          // must be just this speaker
-          debug(2, "Remote-setting volume to %d on just one speaker.", vo);
+      }
+      if (model.our_speaker >= 0)
+        debug(2, "Our speaker number found: %" PRId64 " with relative volume %" PRId32 ".",
+              machine_number, speaker_info[model.our_speaker].volume);
+
+      if (active_speakers == 1) {
+        // must be just this speaker
+        debug(2, "Remote-setting volume to %d on just one speaker.", vo);
+        http_response = dacp_set_include_speaker_volume(machine_number, vo);
+      } else if (active_speakers == 0) {
+        debug(2, "No speakers!");
+      } else {
+        debug(2, "Speakers: %d, active: %d", speaker_count, active_speakers);
+        if (vo >= overall_volume) {
+          debug(2, "Multiple speakers active, but desired new volume is highest");
           http_response = dacp_set_include_speaker_volume(machine_number, vo);
-        } else if (active_speakers == 0) {
-          debug(2, "No speakers!");
         } else {
-          debug(2, "Speakers: %d, active: %d", speaker_count, active_speakers);
-          if (vo >= overall_volume) {
-            debug(2, "Multiple speakers active, but desired new volume is highest");
+          // the desired volume is less than the current overall volume and there is more than
+          // one speaker
+          // we must find out the highest other speaker volume.
+          // If the desired volume is less than it, we must set the current_overall volume to
+          // that highest volume and set our volume relative to it.
+          // If the desired volume is greater than the highest current volume, then we can just
+          // go ahead with dacp_set_include_speaker_volume, setting the new current overall
+          // volume to the desired new level with the speaker at 100%
+
+          int32_t highest_other_volume = 0;
+          for (i = 0; i < speaker_count; i++) {
+            if ((speaker_info[i].speaker_number != machine_number) &&
+                (speaker_info[i].active == 1) && (speaker_info[i].volume > highest_other_volume)) {
+              highest_other_volume = speaker_info[i].volume;
+            }
+          }
+          highest_other_volume = (highest_other_volume * overall_volume + 50) / 100;
+          if (highest_other_volume <= vo) {
+            debug(2, "Highest other volume %d is less than or equal to the desired new volume %d.",
+                  highest_other_volume, vo);
             http_response = dacp_set_include_speaker_volume(machine_number, vo);
           } else {
-            // the desired volume is less than the current overall volume and there is more than
-            // one
-            // speaker
-            // we must find out the highest other speaker volume.
-            // If the desired volume is less than it, we must set the current_overall volume to
-            // that
-            // highest volume
-            // and set our volume relative to it.
-            // If the desired volume is greater than the highest current volume, then we can just
-            // go
-            // ahead
-            // with dacp_set_include_speaker_volume, setting the new current overall volume to the
-            // desired new level
-            // with the speaker at 100%
-
-            int32_t highest_other_volume = 0;
-            for (i = 0; i < speaker_count; i++) {
-              if ((speaker_info[i].speaker_number != machine_number) &&
-                  (speaker_info[i].active == 1) &&
-                  (speaker_info[i].volume > highest_other_volume)) {
-                highest_other_volume = speaker_info[i].volume;
-              }
-            }
-            highest_other_volume = (highest_other_volume * overall_volume + 50) / 100;
-            if (highest_other_volume <= vo) {
-              debug(2,
-                    "Highest other volume %d is less than or equal to the desired new volume %d.",
-                    highest_other_volume, vo);
-              http_response = dacp_set_include_speaker_volume(machine_number, vo);
-            } else {
-              debug(2, "Highest other volume %d is greater than the desired new volume %d.",
-                    highest_other_volume, vo);
-              // if the present overall volume is higher than the highest other volume at present,
-              // then bring it down to it.
-              if (overall_volume > highest_other_volume) {
-                debug(2, "Lower overall volume to new highest volume.");
-                http_response = dacp_set_include_speaker_volume(
-                    machine_number,
-                    highest_other_volume); // set the overall volume to the highest one
-              }
-              int32_t desired_relative_volume =
-                  (vo * 100 + (highest_other_volume / 2)) / highest_other_volume;
-              debug(2, "Set our speaker volume relative to the highest volume.");
-              http_response = dacp_set_speaker_volume(
+            debug(2, "Highest other volume %d is greater than the desired new volume %d.",
+                  highest_other_volume, vo);
+            // if the present overall volume is higher than the highest other volume at present,
+            // then bring it down to it.
+            if (overall_volume > highest_other_volume) {
+              debug(2, "Lower overall volume to new highest volume.");
+              http_response = dacp_set_include_speaker_volume(
                   machine_number,
-                  desired_relative_volume); // set the overall volume to the highest one
+                  highest_other_volume); // set the overall volume to the highest one
             }
+            int32_t desired_relative_volume =
+                (vo * 100 + (highest_other_volume / 2)) / highest_other_volume;
+            debug(2, "Set our speaker volume relative to the highest volume.");
+            http_response = dacp_set_speaker_volume(
+                machine_number,
+                desired_relative_volume); // set the overall volume to the highest one
           }
         }
-      } else {
-        debug(2, "Can't get speakers list");
       }
+      // the volumes have changed, so the model has to be refreshed before it's used again
+      dacp_volume_model_invalidate();
     } else {
-      debug(2, "Can't get client volume");
+      debug(2, "Can't get the volume information from the source");
     }
-
   } else {
     debug(2, "Invalid volume: %d -- ignored.", vo);
   }
@@ -41,3 +41,5 @@ int dacp_get_client_volume(int32_t *result);
 int dacp_get_volume(
     int32_t *the_actual_volume); // get the speaker volume information from the DACP source
 int dacp_set_volume(int32_t vo); // set the volume of our speaker
+int dacp_scan_volume(int32_t *the_actual_volume); // like dacp_get_volume, but always asks the source
+void dacp_volume_model_invalidate(void); // the source's volumes may have changed
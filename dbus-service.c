@@ -603,11 +603,13 @@ gboolean notify_alacdecoder_callback(ShairportSync *skeleton,
                                      __attribute__((unused)) gpointer user_data) {
   char *th = (char *)shairport_sync_get_alacdecoder(skeleton);
 #ifdef CONFIG_APPLE_ALAC
-  if (strcasecmp(th, "hammerton") == 0)
+  if (strcasecmp(th, "hammerton") == 0) {
     config.use_apple_decoder = 0;
-  else if (strcasecmp(th, "apple") == 0)
+    config.alac_decoder_auto = 0;
+  } else if (strcasecmp(th, "apple") == 0) {
     config.use_apple_decoder = 1;
-  else {
+    config.alac_decoder_auto = 0;
+  } else {
     warn("An unrecognised ALAC decoder: \"%s\" was requested via D-Bus interface.", th);
     if (config.use_apple_decoder == 0)
       shairport_sync_set_alacdecoder(skeleton, "hammerton");
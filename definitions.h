@@ -32,4 +32,7 @@
 #define SAFAMILY sa_family
 #endif
 
+// the most output channels a channel map can make
+#define MAX_OUTPUT_CHANNELS 8
+
 #endif // _DEFINITIONS_H
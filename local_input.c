@@ -0,0 +1,249 @@
+/*
+ * Local input. This file is part of Shairport Sync.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// The local input lets another program on this machine -- one playing announcements or a doorbell
+// chime, say -- have its audio mixed into what Shairport Sync is playing, so that the output
+// device doesn't have to be shared through dmix or a sound server.
+
+// The program connects to a Unix stream socket and writes 16-bit signed little-endian interleaved
+// stereo at the output rate. The audio is held in a short ring buffer; when that's full, the
+// socket isn't read, so the writer is held back to the rate the audio is being played at -- though
+// a writer that gets ahead has its audio delayed by as much as the socket holds, so it should
+// write in real time. While local audio is being played, the AirPlay audio is ducked, recovering
+// over the release time when the local audio stops.
+
+// Nothing is played unless Shairport Sync is playing, so if no one has taken anything from the
+// buffer for a while, its contents are discarded rather than being held for the next session --
+// whether or not the buffer is full, and whether or not the client is still writing.
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "local_input.h"
+
+#define LOCAL_INPUT_BUFFER_FRAMES 4096 // about 90 milliseconds at 44,100 frames per second
+
+static const uint64_t local_input_stale_time = 250000000; // 250 milliseconds
+static const double local_input_attack_time = 0.01;       // how long ducking takes to come in
+
+static pthread_mutex_t local_input_mutex = PTHREAD_MUTEX_INITIALIZER;
+// everything from here to ducking_gain is protected by local_input_mutex
+static int16_t ring[LOCAL_INPUT_BUFFER_FRAMES * 2];
+static uint64_t frames_written; // the ring is indexed by these, modulo its size
+static uint64_t frames_read;
+static uint64_t time_of_last_mix;
+static uint64_t time_of_first_unread_frame; // when the oldest frame in the ring was written
+static int32_t ducking_gain = 65536; // the gain applied to the AirPlay audio, 65536 being unity
+
+static pthread_t local_input_thread;
+static int local_input_running = 0;
+static int local_input_listener = -1;
+static int local_input_client = -1;
+
+int local_input_is_idle(void) {
+  pthread_mutex_lock(&local_input_mutex);
+  int response = (frames_written == frames_read) && (ducking_gain == 65536);
+  pthread_mutex_unlock(&local_input_mutex);
+  return response;
+}
+
+// If nothing has been mixed for a while and the audio in the ring has been waiting as long, discard
+// it, and forget any ducking. Call with the local_input_mutex held.
+static void discard_stale_audio(uint64_t time_now) {
+  if (time_now - time_of_last_mix > local_input_stale_time) {
+    if ((frames_written != frames_read) &&
+        (time_now - time_of_first_unread_frame > local_input_stale_time))
+      frames_read = frames_written;
+    ducking_gain = 65536;
+  }
+}
+
+static inline int32_t saturate_32(int64_t sample) {
+  if (sample > INT32_MAX)
+    return INT32_MAX;
+  if (sample < INT32_MIN)
+    return INT32_MIN;
+  return sample;
+}
+
+void local_input_mix(int32_t *frames, int frame_count) {
+  int32_t ducked_gain = (int32_t)(65536.0 * pow(10.0, config.local_input_ducking_level / 20.0));
+  int32_t attack_step = (65536 - ducked_gain) / (local_input_attack_time * config.output_rate) + 1;
+  int32_t release_step =
+      (65536 - ducked_gain) / (config.local_input_ducking_release_time * config.output_rate) + 1;
+
+  pthread_mutex_lock(&local_input_mutex);
+  uint64_t time_now = get_absolute_time_in_ns();
+  discard_stale_audio(time_now); // left from before this session
+  time_of_last_mix = time_now;
+  uint64_t available = frames_written - frames_read;
+  int local_frames = available < (uint64_t)frame_count ? (int)available : frame_count;
+  int i;
+  for (i = 0; i < frame_count; i++) {
+    // duck while there's local audio, release when it stops
+    if (i < local_frames) {
+      ducking_gain -= attack_step;
+      if (ducking_gain < ducked_gain)
+        ducking_gain = ducked_gain;
+    } else if (ducking_gain < 65536) {
+      ducking_gain += release_step;
+      if (ducking_gain > 65536)
+        ducking_gain = 65536;
+    }
+    int64_t left = ((int64_t)frames[2 * i] * ducking_gain) >> 16;
+    int64_t right = ((int64_t)frames[2 * i + 1] * ducking_gain) >> 16;
+    if (i < local_frames) {
+      int16_t *local = &ring[2 * ((frames_read + i) % LOCAL_INPUT_BUFFER_FRAMES)];
+      left += (int64_t)local[0] << 16;
+      right += (int64_t)local[1] << 16;
+    }
+    frames[2 * i] = saturate_32(left);
+    frames[2 * i + 1] = saturate_32(right);
+  }
+  frames_read += local_frames;
+  pthread_mutex_unlock(&local_input_mutex);
+}
+
+// read from the client into the ring until it closes the connection
+static void local_input_read_from_client(int fd) {
+  uint8_t buffer[4096];
+  size_t bytes_held = 0; // a partial frame may be left over from one read to the next
+  while (1) {
+    pthread_mutex_lock(&local_input_mutex);
+    discard_stale_audio(get_absolute_time_in_ns());
+    uint64_t space = LOCAL_INPUT_BUFFER_FRAMES - (frames_written - frames_read);
+    pthread_mutex_unlock(&local_input_mutex);
+    if (space == 0) {
+      usleep(5000); // wait for some of it to be played
+      continue;
+    }
+    // wait for the client, but not so long that stale audio isn't discarded in good time
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int rc = poll(&pfd, 1, local_input_stale_time / 1000000);
+    if ((rc == 0) || ((rc < 0) && (errno == EINTR)))
+      continue;
+    size_t bytes_wanted = space * 4; // always more than a partial frame
+    if (bytes_wanted > sizeof(buffer))
+      bytes_wanted = sizeof(buffer);
+    ssize_t nread = read(fd, buffer + bytes_held, bytes_wanted - bytes_held);
+    if (nread <= 0) {
+      if (nread < 0)
+        debug(1, "Local input: error reading from the client: %s.", strerror(errno));
+      return;
+    }
+    bytes_held += nread;
+    size_t frame_count = bytes_held / 4;
+    pthread_mutex_lock(&local_input_mutex);
+    if ((frame_count != 0) && (frames_written == frames_read))
+      time_of_first_unread_frame = get_absolute_time_in_ns();
+    size_t i;
+    for (i = 0; i < frame_count; i++) {
+      int16_t *local = &ring[2 * ((frames_written + i) % LOCAL_INPUT_BUFFER_FRAMES)];
+      local[0] = (int16_t)(buffer[4 * i] | (buffer[4 * i + 1] << 8));
+      local[1] = (int16_t)(buffer[4 * i + 2] | (buffer[4 * i + 3] << 8));
+    }
+    frames_written += frame_count;
+    pthread_mutex_unlock(&local_input_mutex);
+    memmove(buffer, buffer + frame_count * 4, bytes_held - frame_count * 4);
+    bytes_held -= frame_count * 4;
+  }
+}
+
+static void local_input_thread_cleanup_handler(__attribute__((unused)) void *arg) {
+  if (local_input_client >= 0)
+    close(local_input_client);
+  local_input_client = -1;
+  if (local_input_listener >= 0) {
+    close(local_input_listener);
+    unlink(config.local_input_socket_path);
+  }
+  local_input_listener = -1;
+}
+
+static void *local_input_thread_code(__attribute__((unused)) void *arg) {
+  pthread_cleanup_push(local_input_thread_cleanup_handler, NULL);
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(config.local_input_socket_path) >= sizeof(address.sun_path)) {
+    warn("Local input: the socket path \"%s\" is too long.", config.local_input_socket_path);
+  } else {
+    strcpy(address.sun_path, config.local_input_socket_path);
+    unlink(config.local_input_socket_path); // it may have been left behind last time
+    local_input_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (local_input_listener < 0) {
+      warn("Local input: can not open a socket: %s.", strerror(errno));
+    } else if ((bind(local_input_listener, (struct sockaddr *)&address, sizeof(address)) < 0) ||
+               (listen(local_input_listener, 4) < 0)) {
+      warn("Local input: can not listen on \"%s\": %s.", config.local_input_socket_path,
+           strerror(errno));
+    } else {
+      debug(1, "Local input: listening on \"%s\".", config.local_input_socket_path);
+      while (1) {
+        local_input_client = accept(local_input_listener, NULL, NULL);
+        if (local_input_client < 0) {
+          debug(1, "Local input: error accepting a connection: %s.", strerror(errno));
+          usleep(100000);
+        } else {
+          debug(2, "Local input: client connected.");
+          local_input_read_from_client(local_input_client);
+          close(local_input_client);
+          local_input_client = -1;
+          debug(2, "Local input: client disconnected.");
+        }
+      }
+    }
+  }
+  pthread_cleanup_pop(1);
+  pthread_exit(NULL);
+}
+
+void local_input_start(void) {
+  if (config.local_input_enabled) {
+    if (pthread_create(&local_input_thread, NULL, local_input_thread_code, NULL) == 0)
+      local_input_running = 1;
+    else
+      debug(1, "Failed to create the local input thread!");
+  }
+}
+
+void local_input_stop(void) {
+  if (local_input_running) {
+    debug(2, "Stopping the local input thread.");
+    pthread_cancel(local_input_thread);
+    pthread_join(local_input_thread, NULL);
+    local_input_running = 0;
+  }
+}
@@ -0,0 +1,15 @@
+#ifndef _LOCAL_INPUT_H
+#define _LOCAL_INPUT_H
+
+#include <stdint.h>
+
+void local_input_start(void);
+void local_input_stop(void);
+
+// true if there is no local audio to mix in and the AirPlay audio isn't ducked
+int local_input_is_idle(void);
+
+// duck the interleaved stereo frames, which are at the output rate, and mix in any local audio
+void local_input_mix(int32_t *frames, int frame_count);
+
+#endif // _LOCAL_INPUT_H
@@ -5,6 +5,18 @@
 loudness_processor loudness_r;
 loudness_processor loudness_l;
 
+#ifdef CONFIG_FIXED_POINT
+// For CPUs without floating point hardware, the filter can be run in integer arithmetic.
+// The coefficients are all between -2 and +2, so in Q28 they fit comfortably in an int32_t.
+// Samples are shifted down by eight bits before filtering, leaving 24 significant bits --
+// more than enough for 16-bit audio -- so that a sum of five products can't overflow an int64_t
+// even when the filter is boosting the signal.
+// The poles are very close to DC, so the truncation error of each output would be greatly
+// amplified by the feedback path. To avoid that, the remainder is carried into the next output.
+#define LOUDNESS_COEFFICIENT_BITS 28
+#define LOUDNESS_HEADROOM_BITS 8
+#endif
+
 void _loudness_set_volume(loudness_processor *p, float volume) {
   float gain = -(volume - config.loudness_reference_volume_db) * 0.5;
   if (gain < 0)
@@ -25,6 +37,14 @@ void _loudness_set_volume(loudness_processor *p, float volume) {
   p->a2 = (1 - V / Q * K + K * K) * norm;
   p->b1 = p->a1;
   p->b2 = (1 - 1 / Q * K + K * K) * norm;
+#ifdef CONFIG_FIXED_POINT
+  // only done when the volume changes, so the floating point arithmetic above doesn't matter
+  p->fa0 = lrintf(p->a0 * (1 << LOUDNESS_COEFFICIENT_BITS));
+  p->fa1 = lrintf(p->a1 * (1 << LOUDNESS_COEFFICIENT_BITS));
+  p->fa2 = lrintf(p->a2 * (1 << LOUDNESS_COEFFICIENT_BITS));
+  p->fb1 = lrintf(p->b1 * (1 << LOUDNESS_COEFFICIENT_BITS));
+  p->fb2 = lrintf(p->b2 * (1 << LOUDNESS_COEFFICIENT_BITS));
+#endif
 }
 
 float loudness_process(loudness_processor *p, float i0) {
@@ -48,3 +68,27 @@ void loudness_set_volume(float volume) {
   _loudness_set_volume(&loudness_l, volume);
   _loudness_set_volume(&loudness_r, volume);
 }
+
+#ifdef CONFIG_FIXED_POINT
+int32_t loudness_process_fixed(loudness_processor *p, int32_t sample) {
+  int32_t i0 = sample >> LOUDNESS_HEADROOM_BITS;
+  int64_t acc = (int64_t)p->fa0 * i0 + (int64_t)p->fa1 * p->fi1 + (int64_t)p->fa2 * p->fi2 -
+                (int64_t)p->fb1 * p->fo1 - (int64_t)p->fb2 * p->fo2 + p->error;
+  int64_t o0 = acc >> LOUDNESS_COEFFICIENT_BITS; // an arithmetic shift, i.e. rounding down...
+  p->error = acc - (o0 << LOUDNESS_COEFFICIENT_BITS); // ...so this is always positive
+
+  // saturate -- the boost can take the output outside the range of the input
+  if (o0 > (INT32_MAX >> LOUDNESS_HEADROOM_BITS))
+    o0 = INT32_MAX >> LOUDNESS_HEADROOM_BITS;
+  else if (o0 < (INT32_MIN >> LOUDNESS_HEADROOM_BITS))
+    o0 = INT32_MIN >> LOUDNESS_HEADROOM_BITS;
+
+  p->fo2 = p->fo1;
+  p->fo1 = o0;
+
+  p->fi2 = p->fi1;
+  p->fi1 = i0;
+
+  return (int32_t)(o0 * (1 << LOUDNESS_HEADROOM_BITS));
+}
+#endif
@@ -1,10 +1,19 @@
 #pragma once
 
+#include <stdint.h>
 #include <stdio.h>
 
+#include "config.h"
+
 typedef struct {
   float a0, a1, a2, b1, b2;
   float i1, i2, o1, o2;
+#ifdef CONFIG_FIXED_POINT
+  // coefficients in Q28; the history is kept as samples shifted down by LOUDNESS_HEADROOM_BITS
+  int32_t fa0, fa1, fa2, fb1, fb2;
+  int32_t fi1, fi2, fo1, fo2;
+  int64_t error; // the remainder lost when the last output was truncated -- fed back in
+#endif
 } loudness_processor;
 
 extern loudness_processor loudness_r;
@@ -12,3 +21,6 @@ extern loudness_processor loudness_l;
 
 void loudness_set_volume(float volume);
 float loudness_process(loudness_processor *p, float sample);
+#ifdef CONFIG_FIXED_POINT
+int32_t loudness_process_fixed(loudness_processor *p, int32_t sample);
+#endif
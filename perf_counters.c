@@ -0,0 +1,271 @@
+/*
+ * Hardware performance counters. This file is part of Shairport Sync.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Wall-clock times don't say whether a stage of the pipeline is slow because it has a lot to do or
+// because it's waiting for memory. On Linux, perf_event_open can count, for the calling thread
+// only, the CPU cycles, instructions and cache misses, and the context switches, between two
+// points. The counters are opened as a group on each thread that runs a stage, so they are
+// scheduled together and their ratios hold even if the kernel has to multiplex them. Each stage is
+// bracketed by two reads of the group, and the differences are added to the stage's totals, which
+// are reported with the statistics.
+
+// If the kernel has more counters to schedule than the processor has, it multiplexes them, and the
+// group only counts for part of the time it is enabled. Each read includes how long the group was
+// enabled and how long it was running, so the differences are scaled up by their ratio, as perf
+// does, and the measurements that had to be scaled, or during which the group wasn't running at
+// all, are reported.
+
+// Where the kernel doesn't allow kernel-mode counting (perf_event_paranoid is 2 or more, say),
+// only user-space events are counted, which leaves out, for example, the kernel's share of
+// snd_pcm_writei. Where counters aren't allowed at all, as in many containers, or the processor
+// has none, whatever can't be opened is left out, and if nothing can be, nothing is reported.
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+#include "common.h"
+#include "perf_counters.h"
+
+#if defined(__linux__) && defined(SYS_perf_event_open)
+#define PERF_COUNTERS_AVAILABLE
+#endif
+
+enum { PC_cycles = 0, PC_instructions, PC_cache_misses, PC_context_switches };
+
+static const char *stage_names[PS_stage_count] = {
+    "decode", "conversion", "resampling", "dsp", "sample processing", "output"};
+
+typedef struct {
+  int leader; // the group is read through this
+  int fds[PERF_COUNTER_COUNT];
+  int slot[PERF_COUNTER_COUNT]; // where each counter comes in a read of the group, or -1
+  int group_size;
+} perf_thread_counters;
+
+typedef struct {
+  uint64_t values[PERF_COUNTER_COUNT];
+  uint64_t measurements;
+  uint64_t multiplexed_measurements; // scaled up, since the group wasn't running all the time
+  uint64_t unscheduled_measurements; // left out, since the group wasn't running at all
+} perf_stage_counts;
+
+static pthread_mutex_t perf_counters_mutex = PTHREAD_MUTEX_INITIALIZER;
+// everything from here to counters_seen is protected by perf_counters_mutex
+static perf_stage_counts stage_counts[PS_stage_count];
+static int counters_seen[PERF_COUNTER_COUNT]; // true if any thread has been able to open it
+
+static pthread_key_t perf_counters_key;
+static pthread_once_t perf_counters_key_once = PTHREAD_ONCE_INIT;
+static int perf_counters_key_created = 0;
+
+static void perf_counters_thread_stop(void *arg) {
+  perf_thread_counters *t = (perf_thread_counters *)arg;
+  int i;
+  for (i = 0; i < PERF_COUNTER_COUNT; i++)
+    if (t->fds[i] >= 0)
+      close(t->fds[i]);
+  free(t);
+}
+
+static void perf_counters_create_key(void) {
+  if (pthread_key_create(&perf_counters_key, perf_counters_thread_stop) == 0)
+    perf_counters_key_created = 1;
+}
+
+#ifdef PERF_COUNTERS_AVAILABLE
+static int open_counter(uint32_t type, uint64_t event, int group_fd, int exclude_kernel) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = event;
+  attr.read_format =
+      PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.exclude_kernel = exclude_kernel;
+  attr.exclude_hv = 1;
+  // this thread, on any CPU
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+#endif
+
+void perf_counters_thread_start(const char *thread_name) {
+  // they are only reported with the statistics
+  if ((config.performance_counters == 0) || (config.statistics_requested == 0))
+    return;
+#ifdef PERF_COUNTERS_AVAILABLE
+  static const struct {
+    uint32_t type;
+    uint64_t event;
+    const char *name;
+  } events[PERF_COUNTER_COUNT] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache misses"},
+      {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context switches"}};
+
+  pthread_once(&perf_counters_key_once, perf_counters_create_key);
+  if (perf_counters_key_created == 0)
+    return;
+  perf_thread_counters *t = malloc(sizeof(perf_thread_counters));
+  if (t == NULL)
+    return;
+  t->leader = -1;
+  t->group_size = 0;
+  int exclude_kernel = 0;
+  int i;
+  for (i = 0; i < PERF_COUNTER_COUNT; i++) {
+    t->fds[i] = open_counter(events[i].type, events[i].event, t->leader, exclude_kernel);
+    if ((t->fds[i] < 0) && (t->leader < 0) && (exclude_kernel == 0) &&
+        ((errno == EACCES) || (errno == EPERM))) {
+      exclude_kernel = 1; // try again, counting user space only
+      t->fds[i] = open_counter(events[i].type, events[i].event, t->leader, exclude_kernel);
+    }
+    if (t->fds[i] >= 0) {
+      if (t->leader < 0)
+        t->leader = t->fds[i];
+      t->slot[i] = t->group_size++;
+    } else {
+      t->slot[i] = -1;
+      debug(2, "Performance counters: %s can not be counted on the %s thread: %s.", events[i].name,
+            thread_name, strerror(errno));
+    }
+  }
+  if (t->group_size == 0) {
+    debug(1, "Performance counters are not available on the %s thread.", thread_name);
+    free(t);
+    return;
+  }
+  pthread_mutex_lock(&perf_counters_mutex);
+  for (i = 0; i < PERF_COUNTER_COUNT; i++)
+    if (t->slot[i] >= 0)
+      counters_seen[i] = 1;
+  pthread_mutex_unlock(&perf_counters_mutex);
+  pthread_setspecific(perf_counters_key, t);
+  debug(2, "Performance counters opened on the %s thread%s.", thread_name,
+        exclude_kernel ? ", counting user space only" : "");
+#else
+  debug(1, "Performance counters are not available on the %s thread on this system.",
+        thread_name);
+#endif
+}
+
+void perf_counters_read(perf_snapshot *snapshot) {
+  snapshot->valid = 0;
+  if ((config.performance_counters == 0) || (perf_counters_key_created == 0))
+    return;
+  perf_thread_counters *t = pthread_getspecific(perf_counters_key);
+  if (t == NULL)
+    return;
+  // the number of counters, the times enabled and running, and then the counters' values
+  uint64_t group[3 + PERF_COUNTER_COUNT];
+  if (read(t->leader, group, sizeof(group)) < (ssize_t)((3 + t->group_size) * sizeof(uint64_t)))
+    return;
+  snapshot->time_enabled = group[1];
+  snapshot->time_running = group[2];
+  int i;
+  for (i = 0; i < PERF_COUNTER_COUNT; i++)
+    snapshot->values[i] = t->slot[i] >= 0 ? group[3 + t->slot[i]] : 0;
+  snapshot->valid = 1;
+}
+
+void perf_counters_add(perf_stage_type stage, perf_snapshot *start) {
+  if (start->valid == 0)
+    return;
+  perf_snapshot now;
+  perf_counters_read(&now);
+  if (now.valid == 0)
+    return;
+  uint64_t time_enabled = now.time_enabled - start->time_enabled;
+  uint64_t time_running = now.time_running - start->time_running;
+  pthread_mutex_lock(&perf_counters_mutex);
+  perf_stage_counts *s = &stage_counts[stage];
+  if (time_running == 0) {
+    // nothing was counted, so this measurement can't be used
+    s->unscheduled_measurements++;
+  } else {
+    int i;
+    if (time_running < time_enabled) {
+      double scale = (1.0 * time_enabled) / time_running;
+      for (i = 0; i < PERF_COUNTER_COUNT; i++)
+        s->values[i] += (uint64_t)((now.values[i] - start->values[i]) * scale + 0.5);
+      s->multiplexed_measurements++;
+    } else {
+      for (i = 0; i < PERF_COUNTER_COUNT; i++)
+        s->values[i] += now.values[i] - start->values[i];
+    }
+    s->measurements++;
+  }
+  pthread_mutex_unlock(&perf_counters_mutex);
+}
+
+void perf_counters_report(void) {
+  pthread_mutex_lock(&perf_counters_mutex);
+  int stage;
+  for (stage = 0; stage < PS_stage_count; stage++) {
+    perf_stage_counts *s = &stage_counts[stage];
+    if (s->unscheduled_measurements != 0)
+      inform("performance counters -- %s: %" PRIu64
+             " measurements left out, as the counters were multiplexed and not running.",
+             stage_names[stage], s->unscheduled_measurements);
+    if (s->measurements == 0) {
+      memset(s, 0, sizeof(perf_stage_counts));
+      continue;
+    }
+    char line[512];
+    size_t length =
+        snprintf(line, sizeof(line), "performance counters -- %s: %" PRIu64 " measurements",
+                 stage_names[stage], s->measurements);
+    if (s->multiplexed_measurements)
+      length += snprintf(line + length, sizeof(line) - length,
+                         " (%" PRIu64 " multiplexed and scaled)", s->multiplexed_measurements);
+    if (counters_seen[PC_cycles])
+      length += snprintf(line + length, sizeof(line) - length, ", %.1f kilocycles each",
+                         0.001 * s->values[PC_cycles] / s->measurements);
+    if ((counters_seen[PC_cycles]) && (counters_seen[PC_instructions]) && (s->values[PC_cycles]))
+      length += snprintf(line + length, sizeof(line) - length, ", %.2f instructions per cycle",
+                         (1.0 * s->values[PC_instructions]) / s->values[PC_cycles]);
+    if ((counters_seen[PC_instructions]) && (counters_seen[PC_cache_misses]) &&
+        (s->values[PC_instructions]))
+      length += snprintf(line + length, sizeof(line) - length,
+                         ", %.2f cache misses per 1000 instructions",
+                         (1000.0 * s->values[PC_cache_misses]) / s->values[PC_instructions]);
+    if (counters_seen[PC_context_switches])
+      snprintf(line + length, sizeof(line) - length, ", %.3f context switches each",
+               (1.0 * s->values[PC_context_switches]) / s->measurements);
+    inform("%s.", line);
+    memset(s, 0, sizeof(perf_stage_counts));
+  }
+  pthread_mutex_unlock(&perf_counters_mutex);
+}
@@ -0,0 +1,35 @@
+#ifndef _PERF_COUNTERS_H
+#define _PERF_COUNTERS_H
+
+#include <stdint.h>
+
+typedef enum {
+  PS_decode = 0,        // decrypting and decoding an incoming packet
+  PS_conversion,        // converting the input to 32-bit frames
+  PS_resampling,        // changing the rate to the output rate
+  PS_dsp,               // loudness and convolution
+  PS_sample_processing, // inserting or removing a frame, volume, dither and output formatting
+  PS_output,            // handing the frames to the backend, e.g. snd_pcm_writei
+  PS_stage_count
+} perf_stage_type;
+
+#define PERF_COUNTER_COUNT 4 // cycles, instructions, cache misses and context switches
+
+typedef struct {
+  int valid; // false if the counters aren't open on this thread
+  uint64_t values[PERF_COUNTER_COUNT];
+  uint64_t time_enabled; // nanoseconds the group has been enabled
+  uint64_t time_running; // and actually counting, which is less if it has been multiplexed
+} perf_snapshot;
+
+// open the counters for the calling thread; they are closed when it exits
+void perf_counters_thread_start(const char *thread_name);
+
+void perf_counters_read(perf_snapshot *snapshot);
+// add the counts since the start snapshot, taken on the same thread, to the stage
+void perf_counters_add(perf_stage_type stage, perf_snapshot *start);
+
+// report the counts for each stage since the last report
+void perf_counters_report(void);
+
+#endif // _PERF_COUNTERS_H
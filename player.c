@@ -90,6 +90,9 @@
 #include "loudness.h"
 
 #include "activity_monitor.h"
+#include "local_input.h"
+#include "perf_counters.h"
+#include "probes.h"
 
 // make the first audio packet deliberately early to bias the sync error of
 // the very first packet, making the error more likely to be too early
@@ -141,6 +144,12 @@ static void ab_resync(rtsp_conn_info *conn) {
   conn->ab_synced = 0;
   conn->last_seqno_read = -1;
   conn->ab_buffering = 1;
+  SPS_PROBE1(buffer_resync, conn->connection_number);
+  conn->sequence_number_offset = 0;
+  conn->sequence_jump_point_is_valid = 0;
+  conn->next_timestamp_is_valid = 0;
+  conn->restart_candidate_is_valid = 0;
+  conn->resampler_reset_needed = 1;
 }
 
 // given starting and ending points as unsigned 16-bit integers running modulo 2^16, returns the
@@ -229,11 +238,199 @@ void reset_input_flow_metrics(rtsp_conn_info *conn) {
   conn->initial_reference_timestamp = 0;
 }
 
+// Which ALAC decoder is faster depends on the processor and the compiler. With alac_decoder set to
+// "auto", the first decoder_benchmark_packets ALAC packets to arrive, in whichever session comes
+// first, are decoded by both decoders, alternating which goes first. Their outputs are compared
+// and their times added up, and then the faster one is used from then on -- or the Apple one, if
+// they disagreed. The choice, and the times, are saved in config.alac_decoder_choice_file by the
+// player thread when play ends, so later runs of this version use it from the start.
+// Packets are decoded by the audio and control receiver threads of every session, so the totals
+// are guarded by decoder_choice_mutex, which is only held to add to them, not while decoding. Once
+// the choice is known, decoder_choice_known is set, with an atomic store after
+// config.use_apple_decoder, so that decoding needn't take the mutex from then.
+static pthread_mutex_t decoder_choice_mutex = PTHREAD_MUTEX_INITIALIZER;
+static double decoder_cost[2]; // microseconds per packet, indexed by decoder type; zero if not known
+#ifdef CONFIG_APPLE_ALAC
+static const int decoder_benchmark_packets = 256;
+static int decoder_benchmark_count = 0;      // packets decoded by both so far
+static int decoder_benchmark_mismatches = 0; // packets the decoders didn't agree on
+static uint64_t decoder_benchmark_time[2];   // nanoseconds, indexed by decoder type
+static int decoder_choice_known = 0;         // made or loaded; accessed atomically
+static int decoder_choice_file_read = 0;
+static int decoder_choice_to_be_saved = 0; // made, but not yet saved
+
+// call with the decoder_choice_mutex held
+static void read_alac_decoder_choice(void) {
+  decoder_choice_file_read = 1;
+  if ((config.alac_decoder_choice_file == NULL) || (config.alac_decoder_choice_file[0] == '\0'))
+    return;
+  int fd = open(config.alac_decoder_choice_file, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  FILE *f = fdopen(fd, "r");
+  if (f == NULL) {
+    close(fd);
+    return;
+  }
+  char decoder[16], version[64];
+  double hammerton_cost, apple_cost;
+  if ((fscanf(f, "%15s %lf %lf %63s", decoder, &hammerton_cost, &apple_cost, version) == 4) &&
+      (strcmp(version, PACKAGE_VERSION) == 0) &&
+      ((strcmp(decoder, "hammerton") == 0) || (strcmp(decoder, "apple") == 0))) {
+    config.use_apple_decoder = (strcmp(decoder, "apple") == 0);
+    decoder_cost[decoder_hammerton] = hammerton_cost;
+    decoder_cost[decoder_apple_alac] = apple_cost;
+    __atomic_store_n(&decoder_choice_known, 1, __ATOMIC_RELEASE);
+    debug(1, "The %s ALAC decoder was chosen earlier, taking %.1f microseconds per packet to the "
+             "%s decoder's %.1f.",
+          decoder, config.use_apple_decoder ? apple_cost : hammerton_cost,
+          config.use_apple_decoder ? "Hammerton" : "Apple",
+          config.use_apple_decoder ? hammerton_cost : apple_cost);
+  }
+  fclose(f);
+}
+
+// The choice is written to a new file, created exclusively so that nothing already there -- a
+// symbolic link, say -- is followed, and then renamed into place.
+// call with the decoder_choice_mutex held
+static void write_alac_decoder_choice(void) {
+  if ((config.alac_decoder_choice_file == NULL) || (config.alac_decoder_choice_file[0] == '\0'))
+    return;
+  char *dir = strdup(config.alac_decoder_choice_file);
+  if (dir) {
+    char *slash = strrchr(dir, '/');
+    if ((slash) && (slash != dir)) {
+      *slash = '\0';
+      if (mkpath(dir, 0755) != 0)
+        debug(1, "Could not create the directory \"%s\" for the ALAC decoder choice.", dir);
+    }
+    free(dir);
+  }
+  char temporary_file[PATH_MAX];
+  snprintf(temporary_file, sizeof(temporary_file), "%s.%d", config.alac_decoder_choice_file,
+           getpid());
+  unlink(temporary_file); // left behind by an earlier run with the same process id, if any
+  int fd = open(temporary_file, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+  FILE *f = NULL;
+  if (fd >= 0) {
+    f = fdopen(fd, "w");
+    if (f == NULL)
+      close(fd);
+  }
+  int result = -1;
+  if (f) {
+    fprintf(f, "%s %.3f %.3f %s\n", config.use_apple_decoder ? "apple" : "hammerton",
+            decoder_cost[decoder_hammerton], decoder_cost[decoder_apple_alac], PACKAGE_VERSION);
+    result = fclose(f);
+    if (result == 0)
+      result = rename(temporary_file, config.alac_decoder_choice_file);
+    if (result != 0)
+      unlink(temporary_file);
+  }
+  if (result != 0)
+    warn("Could not save the ALAC decoder choice in \"%s\": %s -- the decoders will be measured "
+         "again the next time Shairport Sync starts.",
+         config.alac_decoder_choice_file, strerror(errno));
+}
+
+// Decode the packet with both decoders, leaving the Hammerton decoder's output in dest, and add
+// to the totals, unless the choice has been made in the meantime.
+static void benchmark_alac_decoders(unsigned char *packet, int length, short *dest, int *outsize,
+                                   int size_limit, rtsp_conn_info *conn) {
+  unsigned char *apple_output = malloc(size_limit); // for the Apple decoder's output
+  if (apple_output == NULL) {
+    alac_decode_frame(conn->decoder_info, packet, (unsigned char *)dest, outsize);
+    return;
+  }
+  int apple_outsize = 0;
+  uint64_t hammerton_time, apple_time;
+  if ((conn->packet_count % 2) == 0) {
+    uint64_t t0 = get_absolute_time_in_ns();
+    alac_decode_frame(conn->decoder_info, packet, (unsigned char *)dest, outsize);
+    uint64_t t1 = get_absolute_time_in_ns();
+    apple_alac_decode_frame(packet, length, apple_output, &apple_outsize);
+    uint64_t t2 = get_absolute_time_in_ns();
+    hammerton_time = t1 - t0;
+    apple_time = t2 - t1;
+  } else {
+    uint64_t t0 = get_absolute_time_in_ns();
+    apple_alac_decode_frame(packet, length, apple_output, &apple_outsize);
+    uint64_t t1 = get_absolute_time_in_ns();
+    alac_decode_frame(conn->decoder_info, packet, (unsigned char *)dest, outsize);
+    uint64_t t2 = get_absolute_time_in_ns();
+    apple_time = t1 - t0;
+    hammerton_time = t2 - t1;
+  }
+  apple_outsize = apple_outsize * 4; // bring the size to bytes
+  int mismatch = ((apple_outsize != *outsize) || (*outsize > size_limit) ||
+                  (memcmp(dest, apple_output, *outsize) != 0));
+  free(apple_output);
+
+  pthread_mutex_lock(&decoder_choice_mutex);
+  if (decoder_choice_known == 0) {
+    decoder_benchmark_mismatches += mismatch;
+    decoder_benchmark_time[decoder_hammerton] += hammerton_time;
+    decoder_benchmark_time[decoder_apple_alac] += apple_time;
+    decoder_benchmark_count++;
+    if (decoder_benchmark_count == decoder_benchmark_packets) {
+      decoder_cost[decoder_hammerton] =
+          0.001 * decoder_benchmark_time[decoder_hammerton] / decoder_benchmark_count;
+      decoder_cost[decoder_apple_alac] =
+          0.001 * decoder_benchmark_time[decoder_apple_alac] / decoder_benchmark_count;
+      if (decoder_benchmark_mismatches != 0) {
+        // Apple's is the reference implementation
+        warn("The Hammerton and Apple ALAC decoders disagreed on %d of %d packets, so the Apple "
+             "decoder will be used.",
+             decoder_benchmark_mismatches, decoder_benchmark_count);
+        config.use_apple_decoder = 1;
+      } else {
+        config.use_apple_decoder =
+            (decoder_cost[decoder_apple_alac] < decoder_cost[decoder_hammerton]);
+      }
+      inform("ALAC decoders measured over %d packets -- Hammerton: %.1f, Apple: %.1f "
+             "microseconds per packet. The %s decoder will be used.",
+             decoder_benchmark_count, decoder_cost[decoder_hammerton],
+             decoder_cost[decoder_apple_alac], config.use_apple_decoder ? "Apple" : "Hammerton");
+      decoder_choice_to_be_saved = 1;
+      __atomic_store_n(&decoder_choice_known, 1, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&decoder_choice_mutex);
+}
+
+// returns 1 if the choice hasn't been made yet, so the packet was decoded by both decoders
+static int benchmark_alac_decoders_if_undecided(unsigned char *packet, int length, short *dest,
+                                                int *outsize, int size_limit,
+                                                rtsp_conn_info *conn) {
+  if (__atomic_load_n(&decoder_choice_known, __ATOMIC_ACQUIRE) != 0)
+    return 0;
+  if (conn->decoder_in_use != ((1 << decoder_apple_alac) | (1 << decoder_hammerton))) {
+    debug(2, "Both ALAC decoders used, to see which is faster.");
+    conn->decoder_in_use = (1 << decoder_apple_alac) | (1 << decoder_hammerton);
+  }
+  benchmark_alac_decoders(packet, length, dest, outsize, size_limit, conn);
+  return 1;
+}
+
+// save the choice, if it has been made but not yet saved -- called by the player thread
+static void save_alac_decoder_choice(void) {
+  pthread_mutex_lock(&decoder_choice_mutex);
+  if (decoder_choice_to_be_saved) {
+    write_alac_decoder_choice();
+    decoder_choice_to_be_saved = 0;
+  }
+  pthread_mutex_unlock(&decoder_choice_mutex);
+}
+#endif
+
 void unencrypted_packet_decode(unsigned char *packet, int length, short *dest, int *outsize,
                                int size_limit, rtsp_conn_info *conn) {
   if (conn->stream.type == ast_apple_lossless) {
 #ifdef CONFIG_APPLE_ALAC
-    if (config.use_apple_decoder) {
+    if ((config.alac_decoder_auto) &&
+        (benchmark_alac_decoders_if_undecided(packet, length, dest, outsize, size_limit, conn))) {
+      // decoded by both, the Hammerton decoder's output is in dest
+    } else if (config.use_apple_decoder) {
       if (conn->decoder_in_use != 1 << decoder_apple_alac) {
         debug(2, "Apple ALAC Decoder used on encrypted audio.");
         conn->decoder_in_use = 1 << decoder_apple_alac;
@@ -424,6 +621,12 @@ static int init_alac_decoder(int32_t fmtp[12], rtsp_conn_info *conn) {
 
 #ifdef CONFIG_APPLE_ALAC
   apple_alac_init(fmtp); // no pthread cancellation point in here
+  if (config.alac_decoder_auto) {
+    pthread_mutex_lock(&decoder_choice_mutex);
+    if (decoder_choice_file_read == 0)
+      read_alac_decoder_choice();
+    pthread_mutex_unlock(&decoder_choice_mutex);
+  }
 #endif
 
   return 0;
@@ -440,27 +643,326 @@ static void init_buffer(rtsp_conn_info *conn) {
   int i;
   for (i = 0; i < BUFFER_FRAMES; i++)
     conn->audio_buffer[i].data = malloc(conn->input_bytes_per_frame * conn->max_frames_per_packet);
+  session_profile_add_memory(&conn->profile, (int64_t)BUFFER_FRAMES * conn->input_bytes_per_frame *
+                                                 conn->max_frames_per_packet);
   ab_resync(conn);
 }
 
 static void free_audio_buffers(rtsp_conn_info *conn) {
+  if (conn->audio_buffer[0].data == NULL)
+    return; // the player was parked
   int i;
-  for (i = 0; i < BUFFER_FRAMES; i++)
+  for (i = 0; i < BUFFER_FRAMES; i++) {
     free(conn->audio_buffer[i].data);
+    conn->audio_buffer[i].data = NULL;
+  }
+  session_profile_add_memory(&conn->profile, -(int64_t)BUFFER_FRAMES *
+                                                 conn->input_bytes_per_frame *
+                                                 conn->max_frames_per_packet);
+}
+
+// If the audio has stopped for config.idle_session_shrink_timeout, the player gives up its audio
+// buffers and waits for the audio to resume, or for a RECORD, waking only once a second instead of
+// every packet time. The buffers are empty by then, so nothing is lost. Call with the ab_mutex held.
+static void park_player(rtsp_conn_info *conn) {
+  debug(2, "Connection %d: the audio has stopped for %.1f seconds -- parking the player.",
+        conn->connection_number, config.idle_session_shrink_timeout);
+  free_audio_buffers(conn);
+  ab_resync(conn);
+  conn->player_parked = 1;
+}
+
+// While the audio flows, keep the CPUs out of deep idle states and the player thread's CPU from
+// being clocked down, if asked, so that the thread wakes up promptly. They're let go while the
+// audio is paused or the player is parked, and at the end. Call from the player thread.
+static const uint64_t performance_hints_idle_time = 1000000000; // let go after a second's silence
+
+static void hold_performance_hints(rtsp_conn_info *conn) {
+  if (conn->performance_hints_held == 0) {
+    conn->cpu_latency_fd = cpu_latency_request(config.cpu_latency_bound);
+    if (config.player_thread_minimum_utilisation > 0)
+      set_thread_minimum_utilisation(config.player_thread_minimum_utilisation);
+    conn->performance_hints_held = 1;
+  }
+}
+
+static void release_performance_hints(rtsp_conn_info *conn) {
+  if (conn->performance_hints_held) {
+    cpu_latency_release(conn->cpu_latency_fd);
+    conn->cpu_latency_fd = -1;
+    if (config.player_thread_minimum_utilisation > 0)
+      set_thread_minimum_utilisation(0);
+    conn->performance_hints_held = 0;
+  }
+}
+
+// call with the ab_mutex held
+static void unpark_player(rtsp_conn_info *conn) {
+  if (conn->player_parked) {
+    debug(2, "Connection %d: unparking the player.", conn->connection_number);
+    init_buffer(conn);
+    conn->player_parked = 0;
+    pthread_cond_broadcast(&conn->flowcontrol);
+  }
+}
+
+void player_unpark(rtsp_conn_info *conn) {
+  debug_mutex_lock(&conn->ab_mutex, 30000, 0);
+  unpark_player(conn);
+  debug_mutex_unlock(&conn->ab_mutex, 0);
+}
+
+static const char *discontinuity_class_description(discontinuity_class_type dc) {
+  switch (dc) {
+  case DC_sequence_jump:
+    return "sequence number jump";
+  case DC_timestamp_jump:
+    return "timestamp jump";
+  case DC_stream_restart:
+    return "stream restart";
+  case DC_sync_error:
+    return "large sync error";
+  default:
+    return "no discontinuity";
+  }
+}
+
+// A sequence number gap bigger than this, with timestamps that don't match it, is taken to mean
+// that the sender has started a new stream. Packets that are merely missing or late have
+// timestamps that match their sequence numbers, so they never count.
+// A packet behind the write point whose timestamp doesn't match is never put in the ring, as its
+// slot may hold audio already. On its own it is a straggler, and is dropped, but if the next packet
+// follows on from it in both sequence number and timestamp, the sender has started a new stream
+// numbered below the old one, and that packet is renumbered like any other restart.
+static const int16_t discontinuity_sequence_gap_limit = BUFFER_FRAMES / 4;
+
+// Translate the sender's sequence number into the ring's numbering. After a jump, only packets
+// from the jump on take the new offset -- a late packet or a resend from before it keeps the
+// offset in force when it was sent, so it goes back where it belongs. Call with the ab_mutex held.
+static seq_t ring_sequence_number(seq_t seqno, rtsp_conn_info *conn) {
+  if (conn->sequence_jump_point_is_valid) {
+    int16_t after_jump =
+        seq_diff(seqno + conn->sequence_number_offset, conn->sequence_jump_point);
+    int16_t before_jump =
+        seq_diff(seqno + conn->previous_sequence_number_offset, conn->sequence_jump_point);
+    if (((after_jump < 0) || (after_jump >= BUFFER_FRAMES)) && (before_jump < 0) &&
+        (before_jump >= -BUFFER_FRAMES))
+      return seqno + conn->previous_sequence_number_offset;
+  }
+  return seqno + conn->sequence_number_offset;
+}
+
+// and back again, to ask the sender to resend a packet by its own number
+static seq_t sender_sequence_number(seq_t seqno, rtsp_conn_info *conn) {
+  if ((conn->sequence_jump_point_is_valid) && (seq_diff(seqno, conn->sequence_jump_point) < 0))
+    return seqno - conn->previous_sequence_number_offset;
+  return seqno - conn->sequence_number_offset;
+}
+
+// classify the packet with the given sequence number and timestamp, given their gaps from the
+// sequence number and timestamp expected next. Call with the ab_mutex held.
+static discontinuity_class_type classify_discontinuity(seq_t seqno, uint32_t timestamp,
+                                                       int16_t sequence_gap, int32_t timestamp_gap,
+                                                       rtsp_conn_info *conn) {
+  if (timestamp_gap == sequence_gap * (int32_t)conn->max_frames_per_packet)
+    return DC_none; // consistent -- packets are just missing or late
+  if ((sequence_gap != 0) && (timestamp_gap == 0))
+    return DC_sequence_jump;
+  if (sequence_gap > discontinuity_sequence_gap_limit)
+    return DC_stream_restart;
+  if (sequence_gap >= 0)
+    return DC_timestamp_jump;
+  if ((conn->restart_candidate_is_valid) &&
+      (seq_diff(seqno, conn->restart_candidate_sequence_number) == 1) &&
+      (timestamp - conn->restart_candidate_timestamp == conn->max_frames_per_packet))
+    return DC_stream_restart; // following on from the last one -- a new stream, numbered lower
+  return DC_none; // a straggler, or the first packet of a new stream, numbered lower
+}
+
+// Note a discontinuity starting with the packet with the given sequence number, so that the time
+// taken to recover from it can be measured. Call with the ab_mutex held.
+static void note_discontinuity(discontinuity_class_type dc, seq_t seqno, rtsp_conn_info *conn) {
+  debug(2, "Connection %d: %s detected at packet %u.", conn->connection_number,
+        discontinuity_class_description(dc), seqno);
+  conn->discontinuity_count[dc]++;
+  if (conn->discontinuity_pending == DC_none) {
+    conn->discontinuity_pending = dc;
+    conn->discontinuity_sequence_number = seqno;
+    conn->discontinuity_disruption_time = 0;
+  }
+}
+
+// Once the packet after a discontinuity has been played, check the sync error: the time from when
+// it first went out of tolerance to when it comes back in is the recovery time, zero if it never
+// went out. Called by the player thread.
+static void check_discontinuity_recovery(abuf_t *inframe, int64_t abs_sync_error,
+                                         int64_t tolerance_in_frames, rtsp_conn_info *conn) {
+  debug_mutex_lock(&conn->ab_mutex, 30000, 0);
+  if ((conn->discontinuity_pending != DC_none) && (inframe->given_timestamp != 0) &&
+      (seq_diff(inframe->sequence_number, conn->discontinuity_sequence_number) >= 0)) {
+    uint64_t time_now = get_absolute_time_in_ns();
+    if (abs_sync_error > tolerance_in_frames) {
+      if (conn->discontinuity_disruption_time == 0)
+        conn->discontinuity_disruption_time = time_now;
+    } else {
+      discontinuity_class_type dc = conn->discontinuity_pending;
+      uint64_t recovery_time = 0;
+      if (conn->discontinuity_disruption_time != 0)
+        recovery_time = time_now - conn->discontinuity_disruption_time;
+      conn->discontinuity_recoveries[dc]++;
+      conn->discontinuity_recovery_time_total[dc] += recovery_time;
+      if (recovery_time > conn->discontinuity_recovery_time_maximum[dc])
+        conn->discontinuity_recovery_time_maximum[dc] = recovery_time;
+      conn->discontinuity_pending = DC_none;
+      debug(2, "Connection %d: recovered from a %s in %.1f milliseconds.", conn->connection_number,
+            discontinuity_class_description(dc), 0.000001 * recovery_time);
+    }
+  }
+  debug_mutex_unlock(&conn->ab_mutex, 0);
+}
+
+// Drop this many frames from the front of the buffer, i.e. just after the frame being played,
+// trimming the first packet kept if necessary, so that what follows plays on without a flush and
+// rebuffer. Returns 0, having dropped nothing, if the buffer doesn't hold enough frames.
+static int skip_frames_in_place(int64_t frames_to_skip, rtsp_conn_info *conn) {
+  int response = 0;
+  debug_mutex_lock(&conn->ab_mutex, 30000, 0);
+  int64_t frames_buffered = 0;
+  seq_t x;
+  for (x = conn->ab_read; (x != conn->ab_write) && (frames_buffered <= frames_to_skip); x++) {
+    abuf_t *abuf = conn->audio_buffer + BUFIDX(x);
+    frames_buffered += abuf->ready ? abuf->length : (int)conn->max_frames_per_packet;
+  }
+  if (frames_buffered > frames_to_skip) {
+    while (frames_to_skip > 0) {
+      abuf_t *abuf = conn->audio_buffer + BUFIDX(conn->ab_read);
+      int64_t length = abuf->ready ? abuf->length : (int)conn->max_frames_per_packet;
+      if (frames_to_skip >= length) {
+        abuf->ready = 0;
+        conn->ab_read = SUCCESSOR(conn->ab_read);
+        frames_to_skip -= length;
+      } else {
+        if (abuf->ready) {
+          memmove(abuf->data, (char *)abuf->data + frames_to_skip * conn->input_bytes_per_frame,
+                  (length - frames_to_skip) * conn->input_bytes_per_frame);
+          abuf->length -= frames_to_skip;
+          abuf->given_timestamp += frames_to_skip;
+        }
+        frames_to_skip = 0;
+      }
+    }
+    response = 1;
+  }
+  debug_mutex_unlock(&conn->ab_mutex, 0);
+  return response;
 }
 
 int first_possibly_missing_frame = -1;
 
+// With adaptive_latency on, the receiver chooses the latency rather than taking the sender's. The
+// delay with which each packet arrives, after the time the sender's timeline says it was sent, is
+// noted in a histogram -- a resent packet arrives with the delay of its resend, and a packet that
+// never arrives in time is noted in the last bin. At a flush, when the sender pauses, skips or
+// seeks and the buffer is emptied anyway, the latency is set so that the fraction of packets
+// noted that would have been late stays under the target, within the bounds set. The histogram
+// is kept from session to session, as it describes the network rather than the session, and is
+// halved now and then so that it follows changes.
+#define ARRIVAL_DELAY_BIN_WIDTH_NS 5000000 // 5 ms
+#define ARRIVAL_DELAY_BINS 1200            // six seconds, the last bin holding anything later
+static const uint32_t arrival_delay_minimum_count = 2000; // about 16 seconds of audio
+static const uint32_t arrival_delay_decay_count = 40000;  // about five minutes of audio
+static pthread_mutex_t arrival_delay_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t arrival_delay_histogram[ARRIVAL_DELAY_BINS];
+static uint32_t arrival_delay_count = 0;
+static double adaptive_latency_choice = 0.0; // seconds; zero until enough has been noted
+
+static void note_arrival_delay(int64_t delay_ns) {
+  int bin;
+  if (delay_ns < 0)
+    bin = 0; // it came ahead of time, as happens in a burst
+  else if (delay_ns >= (int64_t)ARRIVAL_DELAY_BIN_WIDTH_NS * (ARRIVAL_DELAY_BINS - 1))
+    bin = ARRIVAL_DELAY_BINS - 1;
+  else
+    bin = delay_ns / ARRIVAL_DELAY_BIN_WIDTH_NS;
+  pthread_mutex_lock(&arrival_delay_mutex);
+  arrival_delay_histogram[bin]++;
+  arrival_delay_count++;
+  if (arrival_delay_count >= arrival_delay_decay_count) {
+    int i;
+    arrival_delay_count = 0;
+    for (i = 0; i < ARRIVAL_DELAY_BINS; i++) {
+      arrival_delay_histogram[i] = (arrival_delay_histogram[i] + 1) / 2; // keep rare events
+      arrival_delay_count += arrival_delay_histogram[i];
+    }
+  }
+  pthread_mutex_unlock(&arrival_delay_mutex);
+}
+
+// returns the adaptive latency in frames, or zero if not enough has been noted yet
+static uint32_t choose_adaptive_latency(rtsp_conn_info *conn) {
+  pthread_mutex_lock(&arrival_delay_mutex);
+  if (arrival_delay_count >= arrival_delay_minimum_count) {
+    uint32_t allowed_late =
+        (uint32_t)(arrival_delay_count * config.adaptive_latency_late_packet_target);
+    uint32_t later = arrival_delay_count; // the number of packets noted after the current bin
+    int bin = 0;
+    while (bin < ARRIVAL_DELAY_BINS - 1) {
+      later -= arrival_delay_histogram[bin];
+      if (later <= allowed_late)
+        break;
+      bin++;
+    }
+    double latency;
+    if (bin == ARRIVAL_DELAY_BINS - 1) {
+      latency = config.adaptive_latency_maximum;
+    } else {
+      // a packet must arrive before the player takes it, which is about a back end buffer's
+      // worth of audio before it is due to be heard
+      latency = (bin + 1) * ARRIVAL_DELAY_BIN_WIDTH_NS * 0.000000001 +
+                config.audio_backend_buffer_desired_length - config.audio_backend_latency_offset;
+      if (latency < config.adaptive_latency_minimum)
+        latency = config.adaptive_latency_minimum;
+      if (latency > config.adaptive_latency_maximum)
+        latency = config.adaptive_latency_maximum;
+    }
+    if (latency != adaptive_latency_choice)
+      debug(1,
+            "Adaptive latency of %.0f ms chosen -- %u of the last %u packets arrived %.0f ms or "
+            "more after they were sent, or not at all.",
+            latency * 1000, later, arrival_delay_count,
+            (bin + 1) * ARRIVAL_DELAY_BIN_WIDTH_NS * 0.000001);
+    adaptive_latency_choice = latency;
+  }
+  uint32_t response = (uint32_t)(adaptive_latency_choice * conn->input_rate);
+  pthread_mutex_unlock(&arrival_delay_mutex);
+  return response;
+}
+
+int player_buffer_space(rtsp_conn_info *conn) {
+  debug_mutex_lock(&conn->ab_mutex, 30000, 0);
+  int space = BUFFER_FRAMES - config.minimum_free_buffer_headroom;
+  if (conn->ab_synced)
+    space -= seq_diff(conn->ab_write, conn->ab_read);
+  debug_mutex_unlock(&conn->ab_mutex, 0);
+  return space;
+}
+
 void player_put_packet(seq_t seqno, uint32_t actual_timestamp, uint8_t *data, int len,
                        rtsp_conn_info *conn) {
 
   debug_mutex_lock(&conn->ab_mutex, 30000, 0);
+  unpark_player(conn);
   uint64_t time_now = get_absolute_time_in_ns();
   conn->packet_count++;
   conn->packet_count_since_flush++;
   conn->time_of_last_audio_packet = time_now;
   if (conn->connection_state_to_output) { // if we are supposed to be processing these packets
     abuf_t *abuf = 0;
+    // once the ring has moved well past the last jump, nothing from before it can turn up
+    if ((conn->sequence_jump_point_is_valid) &&
+        (seq_diff(conn->ab_read, conn->sequence_jump_point) >= BUFFER_FRAMES))
+      conn->sequence_jump_point_is_valid = 0;
+    seqno = ring_sequence_number(seqno, conn); // unchanged unless the sender's numbering has jumped
     if (!conn->ab_synced) {
       // if this is the first packet...
       debug(3, "syncing to seqno %u.", seqno);
@@ -470,6 +972,38 @@ void player_put_packet(seq_t seqno, uint32_t actual_timestamp, uint8_t *data, in
     }
     int16_t write_point_gap = seq_diff(seqno, conn->ab_write); // this is the difference between
     // the incoming packet number and the packet number that was expected.
+    SPS_PROBE4(put_packet, conn->connection_number, seqno, actual_timestamp, write_point_gap);
+
+    // deal with a discontinuity in place, if possible, keeping what's already buffered -- unless
+    // a flush is pending, as the sender will have moved on deliberately
+    int straggler = 0;
+    if ((conn->next_timestamp_is_valid) && (conn->flush_requested == 0) &&
+        (conn->flush_rtp_timestamp == 0)) {
+      int32_t timestamp_gap = actual_timestamp - conn->next_timestamp;
+      discontinuity_class_type dc =
+          classify_discontinuity(seqno, actual_timestamp, write_point_gap, timestamp_gap, conn);
+      conn->restart_candidate_is_valid = 0;
+      if ((dc == DC_sequence_jump) || (dc == DC_stream_restart)) {
+        // renumber this and later packets to follow on in the ring after what's buffered, which
+        // plays out as it would have. After a restart the timestamps jump too, and the sync loop
+        // re-anchors on them when the new stream's first packet comes to be played.
+        conn->previous_sequence_number_offset = conn->sequence_number_offset;
+        conn->sequence_number_offset = conn->sequence_number_offset - write_point_gap;
+        conn->sequence_jump_point = conn->ab_write;
+        conn->sequence_jump_point_is_valid = 1;
+        seqno = conn->ab_write;
+        write_point_gap = 0;
+      } else if ((write_point_gap < 0) &&
+                 (timestamp_gap != write_point_gap * (int32_t)conn->max_frames_per_packet)) {
+        // don't let it overwrite what's buffered, but remember it in case a new stream follows
+        straggler = 1;
+        conn->restart_candidate_sequence_number = seqno;
+        conn->restart_candidate_timestamp = actual_timestamp;
+        conn->restart_candidate_is_valid = 1;
+      }
+      if (dc != DC_none)
+        note_discontinuity(dc, seqno, conn);
+    }
     if (write_point_gap ==
         0) { // if this is the expected packet (which could be the first packet...)
       if (conn->input_frame_rate_starting_point_is_valid == 0) {
@@ -499,7 +1033,8 @@ void player_put_packet(seq_t seqno, uint32_t actual_timestamp, uint8_t *data, in
       }
       abuf = conn->audio_buffer + BUFIDX(seqno);
       conn->ab_write = SUCCESSOR(seqno);
-    } else if (seq_diff(seqno, conn->ab_read) > 0) { // older than expected but still not too late
+    } else if ((straggler == 0) &&
+               (seq_diff(seqno, conn->ab_read) > 0)) { // older than expected but not too late
       conn->late_packets++;
       abuf = conn->audio_buffer + BUFIDX(seqno);
     } else { // too late.
@@ -510,12 +1045,26 @@ void player_put_packet(seq_t seqno, uint32_t actual_timestamp, uint8_t *data, in
       int datalen = conn->max_frames_per_packet;
       abuf->initialisation_time = time_now;
       abuf->resend_time = 0;
-      if (audio_packet_decode(abuf->data, &datalen, data, len, conn) == 0) {
+      perf_snapshot decode_start;
+      perf_counters_read(&decode_start);
+      int decode_result = audio_packet_decode(abuf->data, &datalen, data, len, conn);
+      perf_counters_add(PS_decode, &decode_start);
+      if (decode_result == 0) {
         abuf->ready = 1;
         abuf->status = 0; // signifying that it was received
         abuf->length = datalen;
         abuf->given_timestamp = actual_timestamp;
         abuf->sequence_number = seqno;
+        if ((config.adaptive_latency) && (conn->audio_over_tcp == 0) &&
+            (have_timestamp_timing_information(conn))) {
+          uint64_t time_sent;
+          frame_to_local_time(actual_timestamp, &time_sent, conn);
+          note_arrival_delay((int64_t)(time_now - time_sent));
+        }
+        if (write_point_gap >= 0) { // the newest packet so far
+          conn->next_timestamp = actual_timestamp + datalen;
+          conn->next_timestamp_is_valid = 1;
+        }
       } else {
         debug(1, "Bad audio packet detected and discarded.");
         abuf->ready = 0;
@@ -609,14 +1158,21 @@ void player_put_packet(seq_t seqno, uint32_t actual_timestamp, uint8_t *data, in
         //  debug(1,"check with x = %u, ab_read = %u, ab_write = %u, first_possibly_missing_frame
         //  = %d.", x, conn->ab_read, conn->ab_write, first_possibly_missing_frame);
         x = (x + 1) & 0xffff;
-        if (((check_buf->ready) || (x == conn->ab_write)) && (missing_frame_run_count > 0)) {
+        // a run can't cross a jump in the sender's numbering
+        if (((check_buf->ready) || (x == conn->ab_write) ||
+             ((conn->sequence_jump_point_is_valid) && (x == conn->sequence_jump_point))) &&
+            (missing_frame_run_count > 0)) {
           // send a resend request
           if (missing_frame_run_count > 1)
             debug(3, "request resend of %d packets starting at seqno %u.", missing_frame_run_count,
                   start_of_missing_frame_run);
           if (config.disable_resend_requests == 0) {
+            SPS_PROBE3(resend_request, conn->connection_number, start_of_missing_frame_run,
+                       missing_frame_run_count);
+            // ask for them by the sender's numbers
+            seq_t first_to_resend = sender_sequence_number(start_of_missing_frame_run, conn);
             debug_mutex_unlock(&conn->ab_mutex, 3);
-            rtp_request_resend(start_of_missing_frame_run, missing_frame_run_count, conn);
+            rtp_request_resend(first_to_resend, missing_frame_run_count, conn);
             debug_mutex_lock(&conn->ab_mutex, 20000, 1);
             conn->resend_requests++;
           }
@@ -666,6 +1222,21 @@ int get_and_check_effective_latency(rtsp_conn_info *conn, uint32_t *effective_la
   return result;
 }
 
+// if the backend wants to know, tell it when the first frame of the packet should be heard
+static void tell_output_when_to_play(abuf_t *inframe, rtsp_conn_info *conn) {
+  if ((config.output->presentation_time) && (inframe->given_timestamp != 0) &&
+      (have_timestamp_timing_information(conn))) {
+    uint32_t effective_latency = conn->latency;
+    if (get_and_check_effective_latency(conn, &effective_latency,
+                                        config.audio_backend_latency_offset) == 0) {
+      uint64_t time_to_play;
+      frame_to_local_time(inframe->given_timestamp + effective_latency, // this will go modulo 2^32
+                          &time_to_play, conn);
+      config.output->presentation_time(time_to_play);
+    }
+  }
+}
+
 static inline void process_sample(int32_t sample, char **outp, sps_format_t format, int volume,
                                   int dither, rtsp_conn_info *conn) {
   /*
@@ -959,11 +1530,15 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
         abuf_t *firstPacket = conn->audio_buffer + BUFIDX(conn->ab_read);
         abuf_t *lastPacket = conn->audio_buffer + BUFIDX(conn->ab_write - 1);
         if ((firstPacket != NULL) && (firstPacket->ready)) {
-          // discard flushes more than 10 seconds into the future -- they are probably bogus
+          // discard flushes more than 10 seconds into the future -- they are probably bogus --
+          // allowing for buffered audio that has arrived but isn't in the buffer yet
           uint32_t first_frame_in_buffer = firstPacket->given_timestamp;
           int32_t offset_from_first_frame =
               (int32_t)(conn->flush_rtp_timestamp - first_frame_in_buffer);
-          if (offset_from_first_frame > (int)conn->input_rate * 10) {
+          int32_t flush_limit = conn->input_rate * 10;
+          if (conn->audio_over_tcp)
+            flush_limit += (int32_t)(config.buffered_audio_length * conn->input_rate);
+          if (offset_from_first_frame > flush_limit) {
             debug(1,
                   "flush request: sanity check -- flush frame %u is too far into the future from "
                   "the first frame %u -- discarded.",
@@ -1018,7 +1593,15 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
     }
     if (flush_needed) {
       debug(2, "flush request: flush done.");
+      SPS_PROBE1(flush_done, conn->connection_number);
       ab_resync(conn); // no cancellation points
+      // with the buffer empty, this is a safe point to change the latency
+      if ((config.adaptive_latency) && (config.userSuppliedLatency == 0) &&
+          (conn->audio_over_tcp == 0)) {
+        uint32_t adaptive_latency = choose_adaptive_latency(conn);
+        if (adaptive_latency != 0)
+          conn->adaptive_latency = adaptive_latency; // used from the next sync packet
+      }
       conn->first_packet_timestamp = 0;
       conn->first_packet_time_to_play = 0;
       conn->time_since_play_started = 0;
@@ -1376,7 +1959,8 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
         }
         do_wait = 1;
       }
-    wait = (conn->ab_buffering || (do_wait != 0) || (!conn->ab_synced));
+    wait = (conn->ab_buffering || (do_wait != 0) || (!conn->ab_synced)) &&
+           (conn->player_thread_please_stop == 0); // don't wait if the session is ending
 
     if (wait) {
       uint64_t time_to_wait_for_wakeup_ns =
@@ -1384,6 +1968,19 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
       time_to_wait_for_wakeup_ns *= 2 * 352; // two full 352-frame packets
       time_to_wait_for_wakeup_ns /= 3;       // two thirds of a packet time
 
+      if ((config.idle_session_shrink_timeout != 0.0) && (conn->player_parked == 0) &&
+          (conn->time_of_last_audio_packet != 0) &&
+          ((conn->ab_synced == 0) || (conn->ab_read == conn->ab_write)) &&
+          (local_time_now - conn->time_of_last_audio_packet >=
+           (uint64_t)(config.idle_session_shrink_timeout * 1000000000)))
+        park_player(conn);
+      if (conn->player_parked)
+        time_to_wait_for_wakeup_ns = 1000000000;
+      if ((conn->player_parked) ||
+          (((conn->ab_synced == 0) || (conn->ab_read == conn->ab_write)) &&
+           (local_time_now - conn->time_of_last_audio_packet >= performance_hints_idle_time)))
+        release_performance_hints(conn); // the audio has stopped
+
 #ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
       uint64_t time_of_wakeup_ns = local_time_now + time_to_wait_for_wakeup_ns;
       uint64_t sec = time_of_wakeup_ns / 1000000000;
@@ -1395,8 +1992,19 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
       //      pthread_cond_timedwait(&conn->flowcontrol, &conn->ab_mutex, &time_of_wakeup);
       int rc = pthread_cond_timedwait(&conn->flowcontrol, &conn->ab_mutex,
                                       &time_of_wakeup); // this is a pthread cancellation point
-      if ((rc != 0) && (rc != ETIMEDOUT))
+      if (rc == ETIMEDOUT) {
+        // how long after the wakeup time the thread actually got going again
+        uint64_t time_of_actual_wakeup_ns = get_absolute_time_in_ns();
+        if (time_of_actual_wakeup_ns > time_of_wakeup_ns) {
+          uint64_t lateness = time_of_actual_wakeup_ns - time_of_wakeup_ns;
+          conn->wakeup_lateness_total += lateness;
+          if (lateness > conn->wakeup_lateness_maximum)
+            conn->wakeup_lateness_maximum = lateness;
+        }
+        conn->wakeup_count++;
+      } else if (rc != 0) {
         debug(3, "pthread_cond_timedwait returned error code %d.", rc);
+      }
 #endif
 #ifdef COMPILE_FOR_OSX
       uint64_t sec = time_to_wait_for_wakeup_ns / 1000000000;
@@ -1409,28 +2017,177 @@ static abuf_t *buffer_get_frame(rtsp_conn_info *conn) {
     }
   } while (wait);
 
-  // seq_t read = conn->ab_read;
-  if (curframe) {
-    if (!curframe->ready) {
-      // debug(1, "Supplying a silent frame for frame %u", read);
-      conn->missing_packets++;
-      curframe->given_timestamp = 0; // indicate a silent frame should be substituted
+  if (conn->player_thread_please_stop) {
+    curframe = NULL; // the session is ending, so there's nothing more to play
+  } else {
+    // seq_t read = conn->ab_read;
+    if (curframe) {
+      SPS_PROBE4(get_frame, conn->connection_number, conn->ab_read, curframe->ready,
+                 seq_diff(conn->ab_write, conn->ab_read));
+      if (!curframe->ready) {
+        // debug(1, "Supplying a silent frame for frame %u", read);
+        SPS_PROBE2(frame_missing, conn->connection_number, conn->ab_read);
+        conn->missing_packets++;
+        if ((config.adaptive_latency) && (conn->audio_over_tcp == 0))
+          note_arrival_delay(INT64_MAX); // it didn't come in time, however long it was given
+        curframe->given_timestamp = 0; // indicate a silent frame should be substituted
+      }
+      curframe->ready = 0;
+      hold_performance_hints(conn); // the audio is flowing
     }
-    curframe->ready = 0;
+    conn->ab_read = SUCCESSOR(conn->ab_read);
+  }
+  // after a flush or resync, the resampler's history and phase belong to audio that's gone
+  if (conn->resampler_reset_needed) {
+    if (conn->resampler)
+      resampler_reset(conn->resampler);
+    conn->resampler_reset_needed = 0;
   }
-  conn->ab_read = SUCCESSOR(conn->ab_read);
   pthread_cleanup_pop(1);
   return curframe;
 }
 
-static inline int32_t mean_32(int32_t a, int32_t b) {
-  int64_t al = a;
-  int64_t bl = b;
-  int64_t mean = (al + bl) / 2;
-  int32_t r = (int32_t)mean;
-  if (r != mean)
-    debug(1, "Error calculating average of two int32_ts");
-  return r;
+// A frame is inserted or removed by crossfading, over a short window, between the audio and a copy
+// of it delayed or advanced by one frame -- in effect, a brief, smooth change of rate. Only the
+// frames in the window are altered; those either side are processed as usual.
+#define SPLICE_WINDOW_FRAMES 64
+#define SPLICE_GAIN_BITS 15
+static int32_t insertion_gains[SPLICE_WINDOW_FRAMES + 1]; // raised cosine ramps from 0 to 1
+static int32_t deletion_gains[SPLICE_WINDOW_FRAMES - 1];
+static int splice_gains_initialised = 0;
+
+static void init_splice_gains() {
+  if (splice_gains_initialised == 0) {
+    int k;
+    for (k = 0; k <= SPLICE_WINDOW_FRAMES; k++)
+      insertion_gains[k] = lrint((0.5 - 0.5 * cos(M_PI * k / SPLICE_WINDOW_FRAMES)) *
+                                 (1 << SPLICE_GAIN_BITS));
+    for (k = 0; k < SPLICE_WINDOW_FRAMES - 1; k++)
+      deletion_gains[k] = lrint((0.5 - 0.5 * cos(M_PI * k / (SPLICE_WINDOW_FRAMES - 2))) *
+                                (1 << SPLICE_GAIN_BITS));
+    splice_gains_initialised = 1;
+  }
+}
+
+// A xorshift generator, with its state in the connection, so that only the player thread touches
+// it. Unlike rand(), it doesn't take a lock.
+static inline uint32_t splice_random(rtsp_conn_info *conn) {
+  uint32_t x = conn->splice_random_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  conn->splice_random_state = x;
+  return x;
+}
+
+// Take the SPLICE_WINDOW_FRAMES stereo frames starting at inptr and crossfade them into
+// SPLICE_WINDOW_FRAMES + stuff frames at outptr. The frame before inptr is used when inserting.
+// The first output frame is the first input frame and the last is the last input frame, so the
+// window joins up with the frames on either side.
+static inline int32_t crossfade(int32_t from, int32_t to, int32_t gain) {
+  return from + (((to - (int64_t)from) * gain) >> SPLICE_GAIN_BITS);
+}
+
+static void splice_window(int32_t *inptr, int stuff, int32_t *outptr) {
+  int k;
+  if (stuff > 0) {
+    // slide from the audio to the audio delayed by a frame
+    for (k = 0; k <= SPLICE_WINDOW_FRAMES; k++) {
+      *outptr++ = crossfade(inptr[2 * k], inptr[2 * k - 2], insertion_gains[k]);
+      *outptr++ = crossfade(inptr[2 * k + 1], inptr[2 * k - 1], insertion_gains[k]);
+    }
+  } else {
+    // slide from the audio to the audio advanced by a frame
+    for (k = 0; k < SPLICE_WINDOW_FRAMES - 1; k++) {
+      *outptr++ = crossfade(inptr[2 * k], inptr[2 * k + 2], deletion_gains[k]);
+      *outptr++ = crossfade(inptr[2 * k + 1], inptr[2 * k + 3], deletion_gains[k]);
+    }
+  }
+}
+
+// With a channel map, each output channel is made from the left, the right or the average of the
+// stereo frame, or is silent, with its own gain and delay. The volume, dither and formatting are
+// then done by process_sample, just as for stereo, writing the N-channel frame directly into the
+// output buffer.
+static inline void process_mapped_frame(int32_t left, int32_t right, char **outp,
+                                        sps_format_t l_output_format, int dither,
+                                        rtsp_conn_info *conn) {
+  int c;
+  for (c = 0; c < config.output_channels; c++) {
+    output_channel_state *oc = &conn->output_channel[c];
+    int64_t sample;
+    switch (config.channel_map[c].source) {
+    case CM_left:
+      sample = left;
+      break;
+    case CM_right:
+      sample = right;
+      break;
+    case CM_mono:
+      sample = ((int64_t)left + right) / 2;
+      break;
+    default:
+      sample = 0;
+      break;
+    }
+    sample = (sample * oc->gain) >> 16;
+    if (sample > INT32_MAX)
+      sample = INT32_MAX;
+    else if (sample < INT32_MIN)
+      sample = INT32_MIN;
+    if (oc->delay_line) {
+      int32_t delayed_sample = oc->delay_line[oc->delay_index];
+      oc->delay_line[oc->delay_index] = (int32_t)sample;
+      oc->delay_index++;
+      if (oc->delay_index == oc->delay_length)
+        oc->delay_index = 0;
+      sample = delayed_sample;
+    }
+    process_sample((int32_t)sample, outp, l_output_format, conn->fix_volume, dither, conn);
+  }
+}
+
+static inline void process_frames(int32_t *inptr, int frames, char **outp,
+                                  sps_format_t l_output_format, int dither, rtsp_conn_info *conn) {
+  int i;
+  if (config.channel_map_in_use) {
+    for (i = 0; i < frames; i++) {
+      process_mapped_frame(inptr[0], inptr[1], outp, l_output_format, dither, conn);
+      inptr += 2;
+    }
+  } else {
+    for (i = 0; i < frames; i++) {
+      process_sample(*inptr++, outp, l_output_format, conn->fix_volume, dither, conn);
+      process_sample(*inptr++, outp, l_output_format, conn->fix_volume, dither, conn);
+    }
+  }
+}
+
+static void init_output_channels(rtsp_conn_info *conn) {
+  int c;
+  for (c = 0; c < MAX_OUTPUT_CHANNELS; c++) {
+    output_channel_state *oc = &conn->output_channel[c];
+    memset(oc, 0, sizeof(output_channel_state));
+    if ((config.channel_map_in_use) && (c < config.output_channels)) {
+      oc->gain = (int64_t)(pow(10.0, config.channel_map[c].gain_db / 20) * 65536 + 0.5);
+      oc->delay_length = (int)(config.channel_map[c].delay * config.output_rate + 0.5);
+      if (oc->delay_length > 0) {
+        oc->delay_line = calloc(oc->delay_length, sizeof(int32_t));
+        if (oc->delay_line == NULL)
+          die("Failed to allocate memory for the delay of output channel %d.", c);
+      }
+    }
+  }
+}
+
+static void free_output_channels(rtsp_conn_info *conn) {
+  int c;
+  for (c = 0; c < MAX_OUTPUT_CHANNELS; c++) {
+    if (conn->output_channel[c].delay_line) {
+      free(conn->output_channel[c].delay_line);
+      conn->output_channel[c].delay_line = NULL;
+    }
+  }
 }
 
 // this takes an array of signed 32-bit integers and (a) removes or inserts a frame as specified in
@@ -1450,40 +2207,84 @@ static int stuff_buffer_basic_32(int32_t *inptr, int length, sps_format_t l_outp
     tstuff = 0; // if any of these conditions hold, don't stuff anything/
   }
 
-  int i;
-  int stuffsamp = length;
-  if (tstuff)
-    //      stuffsamp = rand() % (length - 1);
-    stuffsamp =
-        (rand() % (length - 2)) + 1; // ensure there's always a sample before and after the item
-
-  for (i = 0; i < stuffsamp; i++) { // the whole frame, if no stuffing
-    process_sample(*inptr++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-    process_sample(*inptr++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-  };
   if (tstuff) {
-    if (tstuff == 1) {
-      // debug(3, "+++++++++");
-      // interpolate one sample
-      process_sample(mean_32(inptr[-2], inptr[0]), &l_outptr, l_output_format, conn->fix_volume,
-                     dither, conn);
-      process_sample(mean_32(inptr[-1], inptr[1]), &l_outptr, l_output_format, conn->fix_volume,
-                     dither, conn);
-    } else if (stuff == -1) {
-      // debug(3, "---------");
-      inptr++;
-      inptr++;
-    }
+    // choose where the window starts, ensuring there's always a frame before it and one after
+    int window_start =
+        (splice_random(conn) % (uint32_t)(length - SPLICE_WINDOW_FRAMES - 1)) + 1;
+    int32_t window[2 * (SPLICE_WINDOW_FRAMES + 1)];
+    splice_window(inptr + 2 * window_start, tstuff, window);
+    process_frames(inptr, window_start, &l_outptr, l_output_format, dither, conn);
+    process_frames(window, SPLICE_WINDOW_FRAMES + tstuff, &l_outptr, l_output_format, dither, conn);
+    process_frames(inptr + 2 * (window_start + SPLICE_WINDOW_FRAMES),
+                   length - window_start - SPLICE_WINDOW_FRAMES, &l_outptr, l_output_format, dither,
+                   conn);
+  } else {
+    process_frames(inptr, length, &l_outptr, l_output_format, dither, conn);
+  }
+  conn->amountStuffed = tstuff;
+  return length + tstuff;
+}
+
+// Away from a splice, samples would come out of stuff_buffer_basic_32 exactly as they went in if
+// they are 16-bit stereo in and out, in the processor's byte order, with no volume change, dither,
+// channel mixing, rate change, local input or DSP. In that case, they can be passed straight
+// through.
+static int passthrough_is_possible(rtsp_conn_info *conn) {
+  int output_is_native_s16 =
+      (config.output_format == SPS_FORMAT_S16) ||
+      ((config.output_format == SPS_FORMAT_S16_LE) && (config.endianness == SS_LITTLE_ENDIAN)) ||
+      ((config.output_format == SPS_FORMAT_S16_BE) && (config.endianness == SS_BIG_ENDIAN));
+  return output_is_native_s16 && (conn->input_bit_depth == 16) &&
+         (conn->input_num_channels == 2) && (conn->output_sample_ratio == 1) &&
+         (conn->resampler == NULL) && (conn->fix_volume == 0x10000) && (conn->enable_dither == 0) &&
+         (conn->software_mute_enabled == 0) && (config.playback_mode == ST_stereo) &&
+         (config.channel_map_in_use == 0) &&
+         (config.loudness == 0) &&
+         ((config.local_input_enabled == 0) || (local_input_is_idle()))
+#ifdef CONFIG_CONVOLUTION
+         && (config.convolution == 0)
+#endif
+         // if soxr interpolation has been asked for specifically, it changes every sample
+         && (config.packet_stuffing != ST_soxr);
+}
 
-    // if you're removing, i.e. stuff < 0, copy that much less over. If you're adding, do all the
-    // rest.
-    int remainder = length;
-    if (tstuff < 0)
-      remainder = remainder + tstuff; // don't run over the correct end of the output buffer
+// this copies 16-bit stereo frames straight to the output and inserts or removes a frame as
+// specified in stuff, so that every other frame goes out bit for bit.
+// The splice is made where the waveform changes least from one frame to the next.
 
-    for (i = stuffsamp; i < remainder; i++) {
-      process_sample(*inptr++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-      process_sample(*inptr++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
+// stuff: 1 means add 1; 0 means do nothing; -1 means remove 1
+static int stuff_buffer_passthrough(int16_t *inptr, int length, char *outptr, int stuff,
+                                    rtsp_conn_info *conn) {
+  int tstuff = stuff;
+  if ((stuff > 1) || (stuff < -1) || (length < 100))
+    tstuff = 0; // if any of these conditions hold, don't stuff anything
+
+  const size_t frame_size = 2 * sizeof(int16_t);
+  if (tstuff == 0) {
+    memcpy(outptr, inptr, length * frame_size);
+  } else {
+    // find the frame most like the one before it, keeping away from the ends
+    int splice = 1;
+    int32_t smallest_step = INT32_MAX;
+    int i;
+    for (i = 1; i < length - 1; i++) {
+      int32_t step =
+          abs(inptr[2 * i] - inptr[2 * i - 2]) + abs(inptr[2 * i + 1] - inptr[2 * i - 1]);
+      if (step < smallest_step) {
+        smallest_step = step;
+        splice = i;
+      }
+    }
+    memcpy(outptr, inptr, splice * frame_size);
+    int16_t *outp = (int16_t *)outptr + 2 * splice;
+    if (tstuff == 1) {
+      // insert the mean of the frames on either side of the splice
+      outp[0] = (inptr[2 * splice - 2] + inptr[2 * splice]) / 2;
+      outp[1] = (inptr[2 * splice - 1] + inptr[2 * splice + 1]) / 2;
+      memcpy(outp + 2, inptr + 2 * splice, (length - splice) * frame_size);
+    } else {
+      // leave out the frame at the splice
+      memcpy(outp, inptr + 2 * (splice + 1), (length - splice - 1) * frame_size);
     }
   }
   conn->amountStuffed = tstuff;
@@ -1580,24 +2381,14 @@ int stuff_buffer_soxr_32(int32_t *inptr, int32_t *scratchBuffer, int length,
     }
 
     // now, do the volume, dither and formatting processing
-    ip = scratchBuffer;
     char *l_outptr = outptr;
-    for (i = 0; i < length + tstuff; i++) {
-      process_sample(*ip++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-      process_sample(*ip++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-    };
+    process_frames(scratchBuffer, length + tstuff, &l_outptr, l_output_format, dither, conn);
 
   } else { // the whole frame, if no stuffing
 
     // now, do the volume, dither and formatting processing
-    int32_t *ip = inptr;
     char *l_outptr = outptr;
-    int i;
-
-    for (i = 0; i < length; i++) {
-      process_sample(*ip++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-      process_sample(*ip++, &l_outptr, l_output_format, conn->fix_volume, dither, conn);
-    };
+    process_frames(inptr, length, &l_outptr, l_output_format, dither, conn);
   }
 
   if (packets_processed % 1250 == 0) {
@@ -1634,6 +2425,12 @@ void player_thread_cleanup_handler(void *arg) {
   if (config.output->stop)
     config.output->stop();
 
+  release_performance_hints(conn);
+
+#ifdef CONFIG_APPLE_ALAC
+  save_alac_decoder_choice();
+#endif
+
   if (config.statistics_requested) {
     int rawSeconds = (int)difftime(time(NULL), conn->playstart);
     int elapsedHours = rawSeconds / 3600;
@@ -1646,6 +2443,37 @@ void player_thread_cleanup_handler(void *arg) {
     else
       inform("Playback Stopped. Total playing time %02d:%02d:%02d. Input: %0.2f frames per second.",
              elapsedHours, elapsedMin, elapsedSec, conn->input_frame_rate);
+    if ((conn->adaptive_latency != 0) && (conn->packet_count != 0))
+      inform("Adaptive latency -- %.0f ms in use, the sender asked for %.0f ms. Packets missing "
+             "when due to be played: %" PRIu64 " of %" PRIu64 " (%.3f%%).",
+             (1000.0 * conn->adaptive_latency) / conn->input_rate,
+             (1000.0 * conn->sender_latency) / conn->input_rate, conn->missing_packets,
+             conn->packet_count, (100.0 * conn->missing_packets) / conn->packet_count);
+    pthread_mutex_lock(&decoder_choice_mutex);
+    double hammerton_cost = decoder_cost[decoder_hammerton];
+    double apple_cost = decoder_cost[decoder_apple_alac];
+    pthread_mutex_unlock(&decoder_choice_mutex);
+    if ((conn->stream.type == ast_apple_lossless) && (hammerton_cost != 0.0))
+      inform("ALAC decoding -- the %s decoder is in use. Measured cost per packet -- Hammerton: "
+             "%.1f, Apple: %.1f microseconds.",
+             config.use_apple_decoder ? "Apple" : "Hammerton", hammerton_cost, apple_cost);
+    if ((conn->audio_socket_drops != 0) || (conn->control_socket_drops != 0))
+      inform("Packets dropped by the kernel because a receive queue was full -- audio: %u, "
+             "control: %u.",
+             conn->audio_socket_drops, conn->control_socket_drops);
+    discontinuity_class_type dc;
+    for (dc = DC_sequence_jump; dc < DC_number_of_classes; dc++) {
+      if (conn->discontinuity_count[dc] != 0)
+        inform("Discontinuities -- %s: %u, recovered from: %u, mean recovery time: %.1f "
+               "milliseconds, longest: %.1f milliseconds.",
+               discontinuity_class_description(dc), conn->discontinuity_count[dc],
+               conn->discontinuity_recoveries[dc],
+               conn->discontinuity_recoveries[dc]
+                   ? (0.000001 * conn->discontinuity_recovery_time_total[dc]) /
+                         conn->discontinuity_recoveries[dc]
+                   : 0.0,
+               0.000001 * conn->discontinuity_recovery_time_maximum[dc]);
+    }
   }
 
 #ifdef CONFIG_DACP_CLIENT
@@ -1655,23 +2483,21 @@ void player_thread_cleanup_handler(void *arg) {
   mdns_dacp_monitor_set_id(NULL); // say we're not interested in following that DACP id any more
 #endif
 
-  debug(3, "Cancelling timing, control and audio threads...");
-  debug(3, "Cancel timing thread.");
-  pthread_cancel(conn->rtp_timing_thread);
-  debug(3, "Join timing thread.");
-  pthread_join(conn->rtp_timing_thread, NULL);
-  debug(3, "Timing thread terminated.");
-  debug(3, "Cancel control thread.");
-  pthread_cancel(conn->rtp_control_thread);
-  debug(3, "Join control thread.");
-  pthread_join(conn->rtp_control_thread, NULL);
-  debug(3, "Control thread terminated.");
-  debug(3, "Cancel audio thread.");
-  pthread_cancel(conn->rtp_audio_thread);
+  debug(3, "Stopping control and timing, and audio threads...");
+  // they all wait on the shutdown pipe as well as on their sockets, so they'll stop promptly
+  char c = 0;
+  if (write(conn->rtp_shutdown_pipe[1], &c, 1) != 1)
+    debug(1, "Connection %d: error writing to the RTP shutdown pipe.", conn->connection_number);
+  debug(3, "Join control and timing thread.");
+  pthread_join(conn->rtp_control_and_timing_thread, NULL);
+  debug(3, "Control and timing thread terminated.");
   debug(3, "Join audio thread.");
   pthread_join(conn->rtp_audio_thread, NULL);
   debug(3, "Audio thread terminated.");
+  close(conn->rtp_shutdown_pipe[0]);
+  close(conn->rtp_shutdown_pipe[1]);
 
+  free_output_channels(conn);
   if (conn->outbuf) {
     free(conn->outbuf);
     conn->outbuf = NULL;
@@ -1684,6 +2510,14 @@ void player_thread_cleanup_handler(void *arg) {
     free(conn->tbuf);
     conn->tbuf = NULL;
   }
+  if (conn->rbuf) {
+    free(conn->rbuf);
+    conn->rbuf = NULL;
+  }
+  if (conn->resampler) {
+    resampler_free(conn->resampler);
+    conn->resampler = NULL;
+  }
 
   if (conn->statistics) {
     free(conn->statistics);
@@ -1695,12 +2529,22 @@ void player_thread_cleanup_handler(void *arg) {
 
   clear_reference_timestamp(conn);
   conn->rtp_running = 0;
+
+  session_profile_thread_stop(&conn->profile, SPT_player);
+
+  // let player_stop know that we're finished
+  debug_mutex_lock(&conn->ab_mutex, 30000, 0);
+  conn->player_thread_has_stopped = 1;
+  pthread_cond_broadcast(&conn->flowcontrol);
+  debug_mutex_unlock(&conn->ab_mutex, 0);
   pthread_setcancelstate(oldState, NULL);
 }
 
 void *player_thread_func(void *arg) {
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
+  session_profile_thread_start(&conn->profile, SPT_player);
   // pthread_cleanup_push(player_thread_initial_cleanup_handler, arg);
+  conn->player_parked = 0;
   conn->packet_count = 0;
   conn->packet_count_since_flush = 0;
   conn->previous_random_number = 0;
@@ -1708,6 +2552,17 @@ void *player_thread_func(void *arg) {
   conn->decoder_in_use = 0;
   conn->ab_buffering = 1;
   conn->ab_synced = 0;
+  conn->sequence_number_offset = 0;
+  conn->sequence_jump_point_is_valid = 0;
+  conn->next_timestamp_is_valid = 0;
+  conn->restart_candidate_is_valid = 0;
+  conn->discontinuity_pending = DC_none;
+  memset(conn->discontinuity_count, 0, sizeof(conn->discontinuity_count));
+  memset(conn->discontinuity_recoveries, 0, sizeof(conn->discontinuity_recoveries));
+  memset(conn->discontinuity_recovery_time_total, 0,
+         sizeof(conn->discontinuity_recovery_time_total));
+  memset(conn->discontinuity_recovery_time_maximum, 0,
+         sizeof(conn->discontinuity_recovery_time_maximum));
   conn->first_packet_timestamp = 0;
   conn->flush_requested = 0;
   conn->flush_output_flushed = 0; // only send a flush command to the output device once
@@ -1728,6 +2583,12 @@ void *player_thread_func(void *arg) {
   // This must be after init_alac_decoder
   init_buffer(conn); // will need a corresponding deallocation. No cancellation points in here
 
+  // start with the latency chosen in an earlier session, if there was one
+  conn->adaptive_latency = 0;
+  if ((config.adaptive_latency) && (config.userSuppliedLatency == 0) &&
+      (conn->audio_over_tcp == 0))
+    conn->adaptive_latency = choose_adaptive_latency(conn);
+
   if (conn->stream.encrypted) {
 #ifdef CONFIG_MBEDTLS
     memset(&conn->dctx, 0, sizeof(mbedtls_aes_context));
@@ -1750,6 +2611,30 @@ void *player_thread_func(void *arg) {
                                                             // successive rtptimes, at worst
 
   conn->output_sample_ratio = config.output_rate / conn->input_rate;
+  conn->output_frames_per_packet = conn->max_frames_per_packet * conn->output_sample_ratio;
+  unsigned int max_output_frames_per_packet = conn->output_frames_per_packet;
+
+  // if the output rate isn't an integer multiple of the input rate, e.g. 48,000 for 44,100 input,
+  // the input is converted by the resampler instead of having its frames replicated
+  if ((config.output_rate % conn->input_rate) != 0) {
+    conn->output_sample_ratio = 1;
+    conn->resampler = resampler_create(conn->input_rate, config.output_rate,
+                                       config.resampler_quality, conn->max_frames_per_packet);
+    if (conn->resampler == NULL)
+      die("Failed to create a resampler from %u to %u frames per second.", conn->input_rate,
+          config.output_rate);
+    conn->output_frames_per_packet =
+        (conn->max_frames_per_packet * config.output_rate) / conn->input_rate;
+    max_output_frames_per_packet =
+        resampler_max_output_frames(conn->resampler, conn->max_frames_per_packet);
+    conn->resampler_time = 0;
+    debug(1,
+          "Connection %d: resampling from %u to %u frames per second at \"%s\" quality, adding "
+          "a delay of %.2f milliseconds.",
+          conn->connection_number, conn->input_rate, config.output_rate,
+          resampler_quality_description(config.resampler_quality),
+          1000.0 * conn->resampler->group_delay / config.output_rate);
+  }
 
   //  debug(1, "Output sample ratio is %d.", conn->output_sample_ratio);
 
@@ -1761,24 +2646,25 @@ void *player_thread_func(void *arg) {
   switch (config.output_format) {
   case SPS_FORMAT_S24_3LE:
   case SPS_FORMAT_S24_3BE:
-    conn->output_bytes_per_frame = 6;
+    conn->output_bytes_per_frame = 3 * config.output_channels;
     break;
 
   case SPS_FORMAT_S24:
   case SPS_FORMAT_S24_LE:
   case SPS_FORMAT_S24_BE:
-    conn->output_bytes_per_frame = 8;
+    conn->output_bytes_per_frame = 4 * config.output_channels;
     break;
   case SPS_FORMAT_S32:
   case SPS_FORMAT_S32_LE:
   case SPS_FORMAT_S32_BE:
-    conn->output_bytes_per_frame = 8;
+    conn->output_bytes_per_frame = 4 * config.output_channels;
     break;
   default:
-    conn->output_bytes_per_frame = 4;
+    conn->output_bytes_per_frame = 2 * config.output_channels;
   }
 
   debug(3, "Output frame bytes is %d.", conn->output_bytes_per_frame);
+  init_output_channels(conn); // freed in the cleanup handler
 
   conn->dac_buffer_queue_minimum_length = (uint64_t)(
       config.audio_backend_buffer_interpolation_threshold_in_seconds * config.output_rate);
@@ -1809,6 +2695,10 @@ void *player_thread_func(void *arg) {
   int64_t tsum_of_sync_errors, tsum_of_corrections, tsum_of_insertions_and_deletions,
       tsum_of_drifts;
   int64_t previous_sync_error = 0, previous_correction = 0;
+  // for the standard deviation of the sync error over each statistics interval
+  int32_t sync_error_stat_n = 0;
+  double sync_error_stat_mean = 0.0;
+  double sync_error_stat_M2 = 0.0;
   uint64_t minimum_dac_queue_size = UINT64_MAX;
   int32_t minimum_buffer_occupancy = INT32_MAX;
   int32_t maximum_buffer_occupancy = INT32_MIN;
@@ -1897,25 +2787,29 @@ void *player_thread_func(void *arg) {
 
   // we need an intermediate "transition" buffer
 
-  conn->tbuf = malloc(
-      sizeof(int32_t) * 2 *
-      (conn->max_frames_per_packet * conn->output_sample_ratio + conn->max_frame_size_change));
+  conn->tbuf =
+      malloc(sizeof(int32_t) * 2 * (max_output_frames_per_packet + conn->max_frame_size_change));
   if (conn->tbuf == NULL)
     die("Failed to allocate memory for the transition buffer.");
 
+  if (conn->resampler) {
+    conn->rbuf =
+        malloc(sizeof(int32_t) * 2 * (max_output_frames_per_packet + conn->max_frame_size_change));
+    if (conn->rbuf == NULL)
+      die("Failed to allocate memory for the resampler buffer.");
+  }
+
   // initialise this, because soxr stuffing might be chosen later
 
-  conn->sbuf = malloc(
-      sizeof(int32_t) * 2 *
-      (conn->max_frames_per_packet * conn->output_sample_ratio + conn->max_frame_size_change));
+  conn->sbuf =
+      malloc(sizeof(int32_t) * 2 * (max_output_frames_per_packet + conn->max_frame_size_change));
   if (conn->sbuf == NULL)
     die("Failed to allocate memory for the sbuf buffer.");
 
   // The size of these dependents on the number of frames, the size of each frame and the maximum
   // size change
-  conn->outbuf = malloc(
-      conn->output_bytes_per_frame *
-      (conn->max_frames_per_packet * conn->output_sample_ratio + conn->max_frame_size_change));
+  conn->outbuf = malloc(conn->output_bytes_per_frame *
+                        (max_output_frames_per_packet + conn->max_frame_size_change));
   if (conn->outbuf == NULL)
     die("Failed to allocate memory for an output buffer.");
   conn->first_packet_timestamp = 0;
@@ -1923,6 +2817,13 @@ void *player_thread_func(void *arg) {
   int sync_error_out_of_bounds =
       0; // number of times in a row that there's been a serious sync error
 
+  // these are needed for every packet, so convert them to frames once rather than doing the
+  // (possibly emulated) floating point arithmetic every time
+  int64_t tolerance_in_frames = (int64_t)(config.tolerance * config.output_rate);
+  int64_t resync_threshold_in_frames = (int64_t)(config.resyncthreshold * config.output_rate);
+  int64_t latency_offset_in_frames =
+      (int64_t)(config.audio_backend_latency_offset * config.output_rate);
+
   conn->statistics = malloc(sizeof(stats_t) * trend_interval);
   if (conn->statistics == NULL)
     die("Failed to allocate a statistics buffer");
@@ -1981,11 +2882,37 @@ void *player_thread_func(void *arg) {
     }
   }
 
-  // create and start the timing, control and audio receiver threads
-  pthread_create(&conn->rtp_audio_thread, NULL, &rtp_audio_receiver, (void *)conn);
-  pthread_create(&conn->rtp_control_thread, NULL, &rtp_control_receiver, (void *)conn);
-  pthread_create(&conn->rtp_timing_thread, NULL, &rtp_timing_receiver, (void *)conn);
-
+  // start watching the flow of packets from the source afresh
+  debug_mutex_lock(&conn->watchdog_mutex, 1000, 0);
+  conn->sender_flow_state = SF_waiting;
+  conn->last_audio_packet_time = 0;
+  conn->last_sign_of_life_time = 0;
+  conn->audio_packet_interval = 0;
+  conn->timing_reply_count = 0;
+  debug_mutex_unlock(&conn->watchdog_mutex, 0);
+
+  // create and start the control and timing, and audio receiver threads
+  if (pipe(conn->rtp_shutdown_pipe) != 0)
+    die("Connection %d: can not create the RTP shutdown pipe.", conn->connection_number);
+  pthread_create(&conn->rtp_audio_thread, NULL,
+                 conn->audio_over_tcp ? &rtp_buffered_audio_receiver : &rtp_audio_receiver,
+                 (void *)conn);
+  pthread_create(&conn->rtp_control_and_timing_thread, NULL, &rtp_control_and_timing_receiver,
+                 (void *)conn);
+
+  // the performance hints are taken when the first frame is played
+  conn->cpu_latency_fd = -1;
+  conn->performance_hints_held = 0;
+  conn->wakeup_lateness_total = 0;
+  conn->wakeup_lateness_maximum = 0;
+  conn->wakeup_count = 0;
+  conn->sample_processing_time = 0;
+  conn->passthrough_packets = 0;
+  init_splice_gains();
+  conn->splice_random_state = (uint32_t)r64u() | 1; // xorshift state must never be zero
+  conn->processed_packets = 0;
+
+  perf_counters_thread_start("player");
   pthread_cleanup_push(player_thread_cleanup_handler, arg); // undo what's been done so far
 
   // stop looking elsewhere for DACP stuff
@@ -2005,7 +2932,7 @@ void *player_thread_func(void *arg) {
   player_volume(config.airplay_volume, conn); // will contain a cancellation point if asked to wait
 
   debug(2, "Play begin");
-  while (1) {
+  while (conn->player_thread_please_stop == 0) {
     pthread_testcancel();                     // allow a pthread_cancel request to take effect.
     abuf_t *inframe = buffer_get_frame(conn); // this has cancellation point(s), but it's not
                                               // guaranteed that they'll always be executed
@@ -2026,17 +2953,16 @@ void *player_thread_func(void *arg) {
           conn->last_seqno_read =
               SUCCESSOR(conn->last_seqno_read); // manage the packet out of sequence minder
 
-          void *silence = malloc(conn->output_bytes_per_frame * conn->max_frames_per_packet *
-                                 conn->output_sample_ratio);
+          void *silence = malloc(conn->output_bytes_per_frame * conn->output_frames_per_packet);
           if (silence == NULL) {
             debug(1, "Failed to allocate memory for a silent frame silence buffer.");
           } else {
             // the player may change the contents of the buffer, so it has to be zeroed each time;
             // might as well malloc and free it locally
             conn->previous_random_number = generate_zero_frames(
-                silence, conn->max_frames_per_packet * conn->output_sample_ratio,
-                config.output_format, conn->enable_dither, conn->previous_random_number);
-            config.output->play(silence, conn->max_frames_per_packet * conn->output_sample_ratio);
+                silence, conn->output_frames_per_packet, config.output_format, conn->enable_dither,
+                conn->previous_random_number);
+            config.output->play(silence, conn->output_frames_per_packet);
             free(silence);
           }
         } else if (conn->play_number_after_flush < 10) {
@@ -2048,17 +2974,16 @@ void *player_thread_func(void *arg) {
           debug(1, "Play number %d, monotonic timestamp %llx, difference
           %lld.",conn->play_number_after_flush,inframe->timestamp,difference);
           */
-          void *silence = malloc(conn->output_bytes_per_frame * conn->max_frames_per_packet *
-                                 conn->output_sample_ratio);
+          void *silence = malloc(conn->output_bytes_per_frame * conn->output_frames_per_packet);
           if (silence == NULL) {
             debug(1, "Failed to allocate memory for a flush silence buffer.");
           } else {
             // the player may change the contents of the buffer, so it has to be zeroed each time;
             // might as well malloc and free it locally
             conn->previous_random_number = generate_zero_frames(
-                silence, conn->max_frames_per_packet * conn->output_sample_ratio,
-                config.output_format, conn->enable_dither, conn->previous_random_number);
-            config.output->play(silence, conn->max_frames_per_packet * conn->output_sample_ratio);
+                silence, conn->output_frames_per_packet, config.output_format, conn->enable_dither,
+                conn->previous_random_number);
+            config.output->play(silence, conn->output_frames_per_packet);
             free(silence);
           }
         } else {
@@ -2070,69 +2995,83 @@ void *player_thread_func(void *arg) {
           else
             conn->enable_dither = 0;
 
+          // if the samples would go through unchanged, don't convert them to 32 bits and back --
+          // just copy them to the output, along with any frame inserted or removed for sync
+          int passthrough = passthrough_is_possible(conn);
+          uint64_t sample_processing_start_time = get_absolute_time_in_ns();
+          perf_snapshot stage_start;
+          perf_counters_read(&stage_start);
+
           // here, let's transform the frame of data, if necessary
 
-          switch (conn->input_bit_depth) {
-          case 16: {
-            int i, j;
-            int16_t ls, rs;
-            int32_t ll = 0, rl = 0;
-            int16_t *inps = inbuf;
-            // int16_t *outps = tbuf;
-            int32_t *outpl = (int32_t *)conn->tbuf;
-            for (i = 0; i < inbuflength; i++) {
-              ls = *inps++;
-              rs = *inps++;
-
-              // here, do the mode stuff -- mono / reverse stereo / leftonly / rightonly
-              // also, raise the 16-bit samples to 32 bits.
-
-              switch (config.playback_mode) {
-              case ST_mono: {
-                int32_t both = ls + rs;
-                both = both << (16 - 1); // keep all 17 bits of the sum of the 16bit left and right
-                                         // -- the 17th bit will influence dithering later
-                ll = both;
-                rl = both;
-              } break;
-              case ST_reverse_stereo: {
-                ll = rs;
-                rl = ls;
-                ll = ll << 16;
-                rl = rl << 16;
-              } break;
-              case ST_left_only:
-                rl = ls;
-                ll = ls;
-                ll = ll << 16;
-                rl = rl << 16;
-                break;
-              case ST_right_only:
-                ll = rs;
-                rl = rs;
-                ll = ll << 16;
-                rl = rl << 16;
-                break;
-              case ST_stereo:
-                ll = ls;
-                rl = rs;
-                ll = ll << 16;
-                rl = rl << 16;
-                break; // nothing extra to do
-              }
+          if (passthrough == 0) {
+            switch (conn->input_bit_depth) {
+            case 16: {
+              int i, j;
+              int16_t ls, rs;
+              int32_t ll = 0, rl = 0;
+              int16_t *inps = inbuf;
+              // int16_t *outps = tbuf;
+              int32_t *outpl = (int32_t *)conn->tbuf;
+              for (i = 0; i < inbuflength; i++) {
+                ls = *inps++;
+                rs = *inps++;
+
+                // here, do the mode stuff -- mono / reverse stereo / leftonly / rightonly
+                // also, raise the 16-bit samples to 32 bits.
+
+                switch (config.playback_mode) {
+                case ST_mono: {
+                  int32_t both = ls + rs;
+                  both = both << (16 - 1); // keep all 17 bits of the sum of the 16bit left and
+                                           // right -- the 17th bit will influence dithering later
+                  ll = both;
+                  rl = both;
+                } break;
+                case ST_reverse_stereo: {
+                  ll = rs;
+                  rl = ls;
+                  ll = ll << 16;
+                  rl = rl << 16;
+                } break;
+                case ST_left_only:
+                  rl = ls;
+                  ll = ls;
+                  ll = ll << 16;
+                  rl = rl << 16;
+                  break;
+                case ST_right_only:
+                  ll = rs;
+                  rl = rs;
+                  ll = ll << 16;
+                  rl = rl << 16;
+                  break;
+                case ST_stereo:
+                  ll = ls;
+                  rl = rs;
+                  ll = ll << 16;
+                  rl = rl << 16;
+                  break; // nothing extra to do
+                }
 
-              // here, replicate the samples if you're upsampling
+                // here, replicate the samples if you're upsampling
 
-              for (j = 0; j < conn->output_sample_ratio; j++) {
-                *outpl++ = ll;
-                *outpl++ = rl;
+                for (j = 0; j < conn->output_sample_ratio; j++) {
+                  *outpl++ = ll;
+                  *outpl++ = rl;
+                }
               }
-            }
 
-          } break;
-          default:
-            die("Shairport Sync only supports 16 bit input");
+            } break;
+            default:
+              die("Shairport Sync only supports 16 bit input");
+            }
+            perf_counters_add(PS_conversion, &stage_start);
           }
+          conn->sample_processing_time += get_absolute_time_in_ns() - sample_processing_start_time;
+          conn->processed_packets++;
+          if (passthrough)
+            conn->passthrough_packets++;
 
           at_least_one_frame_seen = 1;
 
@@ -2147,6 +3086,23 @@ void *player_thread_func(void *arg) {
           // frames from then onwards
 
           inbuflength *= conn->output_sample_ratio;
+
+          if (conn->resampler) {
+            uint64_t resampler_start_time = get_absolute_time_in_ns();
+            perf_counters_read(&stage_start);
+            inbuflength = resampler_process(conn->resampler, (int32_t *)conn->tbuf, inbuflength,
+                                            (int32_t *)conn->rbuf);
+            // the resampled frames are now the ones to be processed and played
+            signed short *t = conn->tbuf;
+            conn->tbuf = conn->rbuf;
+            conn->rbuf = t;
+            conn->resampler_time += get_absolute_time_in_ns() - resampler_start_time;
+            perf_counters_add(PS_resampling, &stage_start);
+          }
+
+          // mix in any local audio, now that the frames are at the output rate
+          if ((passthrough == 0) && (config.local_input_enabled))
+            local_input_mix((int32_t *)conn->tbuf, inbuflength);
           /*
           uint32_t reference_timestamp;
           uint64_t reference_timestamp_time, remote_reference_timestamp_time;
@@ -2205,6 +3161,7 @@ void *player_thread_func(void *arg) {
           if (config.output->delay) {
             long l_delay;
             resp = config.output->delay(&l_delay);
+            SPS_PROBE3(output_delay, conn->connection_number, resp, l_delay);
             if (resp == 0) { // no error
               current_delay = l_delay;
               if (l_delay >= 0)
@@ -2246,9 +3203,22 @@ void *player_thread_func(void *arg) {
             local_time_to_frame(local_time_now, &should_be_frame_32, conn);
             // int64_t should_be_frame = ((int64_t)should_be_frame_32) * conn->output_sample_ratio;
 
-            int64_t delay =
-                int64_mod_difference(should_be_frame_32 * conn->output_sample_ratio,
-                                     nt - current_delay, UINT32_MAX * conn->output_sample_ratio);
+            int64_t delay;
+            int64_t output_latency;
+            if (conn->resampler) {
+              // the ratio of output to input frames isn't an integer, so work out the delay in
+              // input frames and scale it. The resampler holds back the frames of its group delay,
+              // so they count as being in the output queue too.
+              delay = int64_mod_difference(should_be_frame_32, inframe->given_timestamp, UINT32_MAX);
+              delay = (delay * config.output_rate) / conn->input_rate + current_delay +
+                      (int64_t)conn->resampler->group_delay;
+              output_latency = ((int64_t)conn->latency * config.output_rate) / conn->input_rate;
+            } else {
+              delay = int64_mod_difference(should_be_frame_32 * conn->output_sample_ratio,
+                                           nt - current_delay,
+                                           UINT32_MAX * conn->output_sample_ratio);
+              output_latency = (int64_t)conn->latency * conn->output_sample_ratio;
+            }
 
             // int64_t delay = should_be_frame - (nt - current_delay); // all int64_t
 
@@ -2257,10 +3227,8 @@ void *player_thread_func(void *arg) {
             // conn->output_sample_ratio; therefore, calculating the delay must be done in the light
             // of possible rollover
 
-            sync_error =
-                delay - ((int64_t)conn->latency * conn->output_sample_ratio +
-                         (int64_t)(config.audio_backend_latency_offset *
-                                   config.output_rate)); // int64_t from int64_t - int32_t, so okay
+            sync_error = delay - (output_latency +
+                                  latency_offset_in_frames); // int64_t from int64_t - int32_t, so okay
 
             if (at_least_one_frame_seen_this_session == 0) {
               at_least_one_frame_seen_this_session = 1;
@@ -2319,9 +3287,12 @@ void *player_thread_func(void *arg) {
             if (abs_sync_error < 0)
               abs_sync_error = -abs_sync_error;
 
+            if (conn->discontinuity_pending != DC_none)
+              check_discontinuity_recovery(inframe, abs_sync_error, tolerance_in_frames, conn);
+
             if ((config.no_sync == 0) && (inframe->given_timestamp != 0) &&
-                (config.resyncthreshold > 0.0) &&
-                (abs_sync_error > config.resyncthreshold * config.output_rate)) {
+                (resync_threshold_in_frames > 0) &&
+                (abs_sync_error > resync_threshold_in_frames)) {
               /*
               if (abs_sync_error > 3 * config.output_rate) {
 
@@ -2342,26 +3313,42 @@ void *player_thread_func(void *arg) {
               //          "resyncing. Error: %lld.",
               //        sync_error_out_of_bounds, sync_error);
               sync_error_out_of_bounds = 0;
+              SPS_PROBE2(sync_error_resync, conn->connection_number, sync_error);
 
-              int64_t filler_length =
-                  (int64_t)(config.resyncthreshold * config.output_rate); // number of samples
+              int64_t filler_length = resync_threshold_in_frames; // number of samples
               if ((sync_error > 0) && (sync_error > filler_length)) {
                 debug(2, "Large positive sync error: %" PRId64 ".", sync_error);
-                int64_t local_frames_to_drop = sync_error / conn->output_sample_ratio;
+                int64_t local_frames_to_drop;
+                if (conn->resampler)
+                  local_frames_to_drop = (sync_error * conn->input_rate) / config.output_rate;
+                else
+                  local_frames_to_drop = sync_error / conn->output_sample_ratio;
                 uint32_t frames_to_drop_sized = local_frames_to_drop;
 
-                debug_mutex_lock(&conn->flush_mutex, 1000, 1);
-                conn->flush_rtp_timestamp =
-                    inframe->given_timestamp +
-                    frames_to_drop_sized; // flush all packets up to (and including?) this
-                reset_input_flow_metrics(conn);
-                debug_mutex_unlock(&conn->flush_mutex, 3);
+                debug_mutex_lock(&conn->ab_mutex, 30000, 0);
+                note_discontinuity(DC_sync_error, inframe->sequence_number, conn);
+                debug_mutex_unlock(&conn->ab_mutex, 0);
+
+                // skip the frames in the buffer, if they're there, rather than flushing it
+                if (skip_frames_in_place(local_frames_to_drop, conn) == 0) {
+                  debug(2, "Not enough frames buffered to skip %" PRId64 " -- flushing instead.",
+                        local_frames_to_drop);
+                  debug_mutex_lock(&conn->flush_mutex, 1000, 1);
+                  conn->flush_rtp_timestamp =
+                      inframe->given_timestamp +
+                      frames_to_drop_sized; // flush all packets up to (and including?) this
+                  reset_input_flow_metrics(conn);
+                  debug_mutex_unlock(&conn->flush_mutex, 3);
+                }
 
               } else if ((sync_error < 0) && ((-sync_error) > filler_length)) {
                 debug(2,
                       "Large negative sync error: %" PRId64 " with should_be_frame_32 of %" PRIu32
                       ", nt of %" PRId64 " and current_delay of %" PRId64 ".",
                       sync_error, should_be_frame_32, nt, current_delay);
+                debug_mutex_lock(&conn->ab_mutex, 30000, 0);
+                note_discontinuity(DC_sync_error, inframe->sequence_number, conn);
+                debug_mutex_unlock(&conn->ab_mutex, 0);
                 int64_t silence_length = -sync_error;
                 if (silence_length > (filler_length * 5))
                   silence_length = filler_length * 5;
@@ -2400,10 +3387,10 @@ void *player_thread_func(void *arg) {
                 // use a "V" shaped function to decide if stuffing should occur
                 int64_t s = r64i();
                 s = s >> 31;
-                s = s * config.tolerance * config.output_rate;
-                s = (s >> 32) + config.tolerance * config.output_rate; // should be a number from 0
-                                                                       // to config.tolerance *
-                                                                       // config.output_rate;
+                s = s * tolerance_in_frames;
+                s = (s >> 32) + tolerance_in_frames; // should be a number from
+                                                     // tolerance_in_frames to
+                                                     // 2 * tolerance_in_frames
                 if ((sync_error > 0) && (sync_error > s)) {
                   // debug(1,"Extra stuff -1");
                   amount_to_stuff = -1;
@@ -2440,6 +3427,7 @@ void *player_thread_func(void *arg) {
 
               if (config.no_sync != 0)
                 amount_to_stuff = 0; // no stuffing if it's been disabled
+              SPS_PROBE3(stuffing, conn->connection_number, sync_error, amount_to_stuff);
 
               // Apply DSP here
 
@@ -2461,6 +3449,34 @@ void *player_thread_func(void *arg) {
                 convolution_is_enabled = 1;
 #endif
 
+              int dsp_in_use = do_loudness;
+#ifdef CONFIG_CONVOLUTION
+              dsp_in_use |= convolution_is_enabled;
+#endif
+              perf_counters_read(&stage_start);
+
+#ifdef CONFIG_FIXED_POINT
+              // Without an FPU, apply the volume and the loudness filter in integer arithmetic.
+              // The convolver works in floating point, so if it's enabled, leave it all to the
+              // floating point code below.
+              if (do_loudness
+#ifdef CONFIG_CONVOLUTION
+                  && (convolution_is_enabled == 0)
+#endif
+              ) {
+                int32_t *tbuf32 = (int32_t *)conn->tbuf;
+                int i;
+                for (i = 0; i < inbuflength; ++i) {
+                  // fix_volume is at most 65536, so this can't overflow
+                  tbuf32[2 * i] = loudness_process_fixed(
+                      &loudness_l, ((int64_t)tbuf32[2 * i] * conn->fix_volume) >> 16);
+                  tbuf32[2 * i + 1] = loudness_process_fixed(
+                      &loudness_r, ((int64_t)tbuf32[2 * i + 1] * conn->fix_volume) >> 16);
+                }
+                do_loudness = 0; // it's been done
+              }
+#endif
+
               if (do_loudness
 #ifdef CONFIG_CONVOLUTION
                   || convolution_is_enabled
@@ -2512,9 +3528,13 @@ void *player_thread_func(void *arg) {
                   tbuf32[2 * i + 1] = fbuf_r[i];
                 }
               }
+              if (dsp_in_use)
+                perf_counters_add(PS_dsp, &stage_start);
 
+              sample_processing_start_time = get_absolute_time_in_ns();
+              perf_counters_read(&stage_start);
 #ifdef CONFIG_SOXR
-              if ((current_delay < conn->dac_buffer_queue_minimum_length) ||
+              if ((passthrough) || (current_delay < conn->dac_buffer_queue_minimum_length) ||
                   (config.packet_stuffing == ST_basic) ||
                   (config.soxr_delay_index == 0) || // not computed yet
                   ((config.packet_stuffing == ST_auto) &&
@@ -2522,9 +3542,13 @@ void *player_thread_func(void *arg) {
                     config.soxr_delay_threshold)) // if the CPU is deemed too slow
               ) {
 #endif
-                play_samples =
-                    stuff_buffer_basic_32((int32_t *)conn->tbuf, inbuflength, config.output_format,
-                                          conn->outbuf, amount_to_stuff, conn->enable_dither, conn);
+                if (passthrough)
+                  play_samples = stuff_buffer_passthrough(inbuf, inbuflength, conn->outbuf,
+                                                          amount_to_stuff, conn);
+                else
+                  play_samples = stuff_buffer_basic_32((int32_t *)conn->tbuf, inbuflength,
+                                                       config.output_format, conn->outbuf,
+                                                       amount_to_stuff, conn->enable_dither, conn);
 #ifdef CONFIG_SOXR
               } else { // soxr requested or auto requested with the index less or equal to the
                        // threshold
@@ -2533,6 +3557,9 @@ void *player_thread_func(void *arg) {
                                                     amount_to_stuff, conn->enable_dither, conn);
               }
 #endif
+              conn->sample_processing_time +=
+                  get_absolute_time_in_ns() - sample_processing_start_time;
+              perf_counters_add(PS_sample_processing, &stage_start);
 
               /*
               {
@@ -2559,7 +3586,11 @@ void *player_thread_func(void *arg) {
                     generate_zero_frames(conn->outbuf, play_samples, config.output_format,
                                          conn->enable_dither, conn->previous_random_number);
                   }
+                  tell_output_when_to_play(inframe, conn);
+                  SPS_PROBE2(output_play, conn->connection_number, play_samples);
+                  perf_counters_read(&stage_start);
                   config.output->play(conn->outbuf, play_samples);
+                  perf_counters_add(PS_output, &stage_start);
                 }
               }
 
@@ -2617,9 +3648,17 @@ void *player_thread_func(void *arg) {
               at_least_one_frame_seen_this_session = 1;
             }
 
-            play_samples =
-                stuff_buffer_basic_32((int32_t *)conn->tbuf, inbuflength, config.output_format,
-                                      conn->outbuf, 0, conn->enable_dither, conn);
+            sample_processing_start_time = get_absolute_time_in_ns();
+            perf_counters_read(&stage_start);
+            if (passthrough)
+              play_samples = stuff_buffer_passthrough(inbuf, inbuflength, conn->outbuf, 0, conn);
+            else
+              play_samples =
+                  stuff_buffer_basic_32((int32_t *)conn->tbuf, inbuflength, config.output_format,
+                                        conn->outbuf, 0, conn->enable_dither, conn);
+            conn->sample_processing_time +=
+                get_absolute_time_in_ns() - sample_processing_start_time;
+            perf_counters_add(PS_sample_processing, &stage_start);
             if (conn->outbuf == NULL)
               debug(1, "NULL outbuf to play -- skipping it.");
             else {
@@ -2627,7 +3666,11 @@ void *player_thread_func(void *arg) {
                 generate_zero_frames(conn->outbuf, play_samples, config.output_format,
                                      conn->enable_dither, conn->previous_random_number);
               }
+              tell_output_when_to_play(inframe, conn);
+              SPS_PROBE2(output_play, conn->connection_number, play_samples);
+              perf_counters_read(&stage_start);
               config.output->play(conn->outbuf, play_samples); // remove the (short*)!
+              perf_counters_add(PS_output, &stage_start);
             }
           }
 
@@ -2681,6 +3724,10 @@ void *player_thread_func(void *arg) {
             previous_correction = conn->amountStuffed;
 
             tsum_of_sync_errors += sync_error;
+            sync_error_stat_n++;
+            double sync_error_stat_delta = sync_error - sync_error_stat_mean;
+            sync_error_stat_mean += sync_error_stat_delta / sync_error_stat_n;
+            sync_error_stat_M2 += sync_error_stat_delta * (sync_error - sync_error_stat_mean);
             tsum_of_drifts += conn->statistics[newest_statistic].drift;
             if (conn->amountStuffed > 0) {
               tsum_of_insertions_and_deletions += conn->amountStuffed;
@@ -2760,9 +3807,9 @@ void *player_thread_func(void *arg) {
                       "%*d,"          /* source clock drift sample count */
                       "%*.2f",        /* rough calculated correction in ppm */
                       10, 1000 * moving_average_sync_error / config.output_rate, 10,
-                      moving_average_correction * 1000000 / (352 * conn->output_sample_ratio), 10,
+                      moving_average_correction * 1000000 / conn->output_frames_per_packet, 10,
                       moving_average_insertions_plus_deletions * 1000000 /
-                          (352 * conn->output_sample_ratio),
+                          conn->output_frames_per_packet,
                       12, play_number, 7, conn->missing_packets, 7, conn->late_packets, 7,
                       conn->too_late_packets, 7, conn->resend_requests, 7, minimum_dac_queue_size,
                       5, minimum_buffer_occupancy, 5, maximum_buffer_occupancy, 11,
@@ -2770,8 +3817,8 @@ void *player_thread_func(void *arg) {
                       (conn->local_to_remote_time_gradient - 1.0) * 1000000, 6,
                       conn->local_to_remote_time_gradient_sample_count, 10,
                       (conn->frame_rate > 0.0)
-                          ? ((conn->frame_rate - conn->remote_frame_rate *
-                                                     conn->output_sample_ratio *
+                          ? ((conn->frame_rate - conn->remote_frame_rate * config.output_rate /
+                                                     conn->input_rate *
                                                      conn->local_to_remote_time_gradient) *
                              1000000) /
                                 conn->frame_rate
@@ -2817,10 +3864,54 @@ void *player_thread_func(void *arg) {
                        (conn->local_to_remote_time_gradient - 1.0) * 1000000, 6,
                        conn->local_to_remote_time_gradient_sample_count);
               }
+              if ((conn->audio_socket_drops != 0) || (conn->control_socket_drops != 0))
+                inform("packets dropped by the kernel (not by the network) because a receive "
+                       "queue was full -- audio: %u, control: %u.",
+                       conn->audio_socket_drops, conn->control_socket_drops);
+              if (conn->resampler) {
+                // the time spent resampling as a percentage of the duration of the audio resampled
+                inform("resampler: %.3f%% of one CPU, adding a delay of %.2f milliseconds.",
+                       (100.0 * conn->resampler_time * conn->input_rate) /
+                           (1.0E9 * print_interval * conn->max_frames_per_packet),
+                       1000.0 * conn->resampler->group_delay / config.output_rate);
+                conn->resampler_time = 0;
+              }
+              if (conn->processed_packets) {
+                // the time spent converting, scaling and formatting samples for output, per second
+                // of audio
+                inform("sample processing: %.1f microseconds per second of audio; %" PRIu64
+                       " of %" PRIu64 " packets passed through bit for bit.",
+                       (0.001 * conn->sample_processing_time * conn->input_rate) /
+                           (1.0 * conn->processed_packets * conn->max_frames_per_packet),
+                       conn->passthrough_packets, conn->processed_packets);
+              }
+              conn->sample_processing_time = 0;
+              conn->passthrough_packets = 0;
+              conn->processed_packets = 0;
+              // to compare with and without the CPU latency bound and utilisation clamp
+              inform("player thread wakeups: %u, mean lateness %.1f and maximum lateness %.1f "
+                     "microseconds; sync error standard deviation: %.3f milliseconds.",
+                     conn->wakeup_count,
+                     conn->wakeup_count
+                         ? (0.001 * conn->wakeup_lateness_total) / conn->wakeup_count
+                         : 0.0,
+                     0.001 * conn->wakeup_lateness_maximum,
+                     sync_error_stat_n > 1
+                         ? (1000.0 * sqrt(sync_error_stat_M2 / (sync_error_stat_n - 1))) /
+                               config.output_rate
+                         : 0.0);
+              if (config.performance_counters)
+                perf_counters_report();
             } else {
               inform("No frames received in the last sampling interval.");
             }
           }
+          conn->wakeup_lateness_total = 0;
+          conn->wakeup_lateness_maximum = 0;
+          conn->wakeup_count = 0;
+          sync_error_stat_n = 0;
+          sync_error_stat_mean = 0.0;
+          sync_error_stat_M2 = 0.0;
           minimum_dac_queue_size = UINT64_MAX;  // hack reset
           maximum_buffer_occupancy = INT32_MIN; // can't be less than this
           minimum_buffer_occupancy = INT32_MAX; // can't be more than this
@@ -2830,7 +3921,7 @@ void *player_thread_func(void *arg) {
     }
   }
 
-  debug(1, "This should never be called.");
+  debug(3, "Connection %d: player thread asked to stop.", conn->connection_number);
   pthread_cleanup_pop(1); // pop the cleanup handler
                           //  debug(1, "This should never be called either.");
                           //  pthread_cleanup_pop(1); // pop the initial cleanup handler
@@ -3069,6 +4160,9 @@ void player_volume_without_notification(double airplay_volume, rtsp_conn_info *c
 }
 
 void player_volume(double airplay_volume, rtsp_conn_info *conn) {
+#ifdef CONFIG_DACP_CLIENT
+  dacp_volume_model_invalidate(); // the source has changed our speaker's volume
+#endif
   command_set_volume(airplay_volume);
   player_volume_without_notification(airplay_volume, conn);
 }
@@ -3076,6 +4170,7 @@ void player_volume(double airplay_volume, rtsp_conn_info *conn) {
 void do_flush(uint32_t timestamp, rtsp_conn_info *conn) {
 
   debug(2, "do_flush: flush to %u.", timestamp);
+  SPS_PROBE2(flush_requested, conn->connection_number, timestamp);
   debug_mutex_lock(&conn->flush_mutex, 1000, 1);
   conn->flush_requested = 1;
   conn->flush_rtp_timestamp = timestamp; // flush all packets up to, but not including, this one.
@@ -3098,6 +4193,8 @@ int player_play(rtsp_conn_info *conn) {
   // need to use conn in place of stream below. Need to put the stream as a parameter to he
   if (conn->player_thread != NULL)
     die("Trying to create a second player thread for this RTSP session");
+  conn->player_thread_please_stop = 0;
+  conn->player_thread_has_stopped = 0;
   if (config.buffer_start_fill > BUFFER_FRAMES)
     die("specified buffer starting fill %d > buffer size %d", config.buffer_start_fill,
         BUFFER_FRAMES);
@@ -3123,14 +4220,51 @@ int player_play(rtsp_conn_info *conn) {
   return 0;
 }
 
+// if the player thread hasn't stopped by itself within this time, it's cancelled
+static const uint64_t player_stop_time_limit_ns = 2000000000;
+
 int player_stop(rtsp_conn_info *conn) {
   // note -- this may be called from another connection thread.
   // int dl = debuglev;
   // debuglev = 3;
   debug(3, "player_stop");
   if (conn->player_thread) {
-    debug(3, "player_thread cancel...");
-    pthread_cancel(*conn->player_thread);
+    uint64_t stop_requested_time = get_absolute_time_in_ns();
+    uint64_t time_limit = stop_requested_time + player_stop_time_limit_ns;
+    // ask the player thread to stop by itself -- it checks at least once per packet and whenever
+    // it's woken up while waiting for a packet -- and wait for it to say it's done.
+    // Don't allow this thread to be cancelled while waiting, as that would leave ab_mutex locked
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    debug_mutex_lock(&conn->ab_mutex, 30000, 0);
+    conn->player_thread_please_stop = 1;
+    pthread_cond_broadcast(&conn->flowcontrol);
+    while ((conn->player_thread_has_stopped == 0) && (get_absolute_time_in_ns() < time_limit)) {
+#ifdef COMPILE_FOR_LINUX_AND_FREEBSD_AND_CYGWIN_AND_OPENBSD
+      struct timespec time_of_wakeup;
+      time_of_wakeup.tv_sec = time_limit / 1000000000;
+      time_of_wakeup.tv_nsec = time_limit % 1000000000;
+      pthread_cond_timedwait(&conn->flowcontrol, &conn->ab_mutex, &time_of_wakeup);
+#endif
+#ifdef COMPILE_FOR_OSX
+      uint64_t time_to_wait_ns = time_limit - get_absolute_time_in_ns();
+      struct timespec time_to_wait;
+      time_to_wait.tv_sec = time_to_wait_ns / 1000000000;
+      time_to_wait.tv_nsec = time_to_wait_ns % 1000000000;
+      pthread_cond_timedwait_relative_np(&conn->flowcontrol, &conn->ab_mutex, &time_to_wait);
+#endif
+    }
+    int stopped_by_itself = conn->player_thread_has_stopped;
+    debug_mutex_unlock(&conn->ab_mutex, 0);
+    pthread_setcancelstate(oldState, NULL);
+    if (stopped_by_itself == 0) {
+      // it must be stuck somewhere, e.g. in the output device, so fall back to cancelling it
+      debug(1,
+            "Connection %d: the player thread did not stop within %" PRIu64
+            " milliseconds -- cancelling it.",
+            conn->connection_number, player_stop_time_limit_ns / 1000000);
+      pthread_cancel(*conn->player_thread);
+    }
     debug(3, "player_thread join...");
     if (pthread_join(*conn->player_thread, NULL) == -1) {
       char errorstring[1024];
@@ -3138,7 +4272,9 @@ int player_stop(rtsp_conn_info *conn) {
       debug(1, "Connection %d: error %d joining player thread: \"%s\".", conn->connection_number,
             errno, (char *)errorstring);
     } else {
-      debug(3, "player_thread joined.");
+      debug(2, "Connection %d: player thread stopped in %.3f milliseconds.",
+            conn->connection_number,
+            (get_absolute_time_in_ns() - stop_requested_time) * 0.000001);
     }
     free(conn->player_thread);
     conn->player_thread = NULL;
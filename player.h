@@ -23,6 +23,8 @@
 
 #include "alac.h"
 #include "audio.h"
+#include "resampler.h"
+#include "session_profile.h"
 
 #define time_ping_history_power_of_two 7
 #define time_ping_history                                                                          \
@@ -52,6 +54,25 @@ typedef struct audio_buffer_entry { // decoded audio packets
   int length;                   // the length of the decoded data
 } abuf_t;
 
+// the kinds of break in the incoming stream that can be recovered from without a flush
+typedef enum {
+  DC_none = 0,
+  DC_sequence_jump,  // sequence numbers jumped but timestamps ran on -- packets are renumbered
+  DC_timestamp_jump, // timestamps jumped but sequence numbers ran on -- the sync loop re-anchors
+  DC_stream_restart, // both jumped -- the new stream is renumbered to follow on in the ring
+  DC_sync_error,     // the sync error exceeded the resync threshold -- frames are skipped in place
+  DC_number_of_classes
+} discontinuity_class_type;
+
+// what the flow of packets from the source says about it
+typedef enum {
+  SF_waiting = 0, // no audio has arrived yet
+  SF_flowing,     // audio is arriving at its usual cadence
+  SF_probing,     // the audio has stopped -- timing requests are sent often to see if it's still there
+  SF_paused,      // the audio has stopped but the source is answering timing requests
+  SF_gone,        // nothing at all has come from the source for config.sender_silence_timeout
+} sender_flow_type;
+
 typedef struct stats { // statistics for running averages
   int64_t sync_error, correction, drift;
 } stats_t;
@@ -76,6 +97,13 @@ typedef enum {
   ast_apple_lossless,
 } audio_stream_type;
 
+typedef struct {
+  int64_t gain;         // 1 << 16 is unity
+  int32_t *delay_line;  // NULL if the channel isn't delayed
+  int delay_length;     // frames
+  int delay_index;
+} output_channel_state; // for an output channel made according to a channel map
+
 typedef struct {
   int encrypted;
   uint8_t aesiv[16], aeskey[16];
@@ -89,6 +117,8 @@ typedef struct {
   char *UserAgent;           // free this on teardown
   int AirPlayVersion;        // zero if not an AirPlay session. Used to help calculate latency
   uint32_t latency;          // the actual latency used for this play session
+  uint32_t sender_latency;   // the latency the sender asked for, before any adaptive latency
+  uint32_t adaptive_latency; // chosen by the receiver at the last flush; zero if not in effect
   uint32_t minimum_latency;  // set if an a=min-latency: line appears in the ANNOUNCE message; zero
                              // otherwise
   uint32_t maximum_latency;  // set if an a=max-latency: line appears in the ANNOUNCE message; zero
@@ -107,14 +137,23 @@ typedef struct {
   volatile int watchdog_barks;  // number of times the watchdog has timed out and done something
   int unfixable_error_reported; // set when an unfixable error command has been executed.
 
+  // the flow of packets from the source, fed by the RTP receivers and protected by watchdog_mutex
+  sender_flow_type sender_flow_state;
+  uint64_t last_audio_packet_time;  // when anything last arrived on the audio port
+  uint64_t last_sign_of_life_time;  // when anything last arrived on any of the ports
+  uint64_t audio_packet_interval;   // smoothed, in nanoseconds
+  uint64_t sender_silence_start_time; // when the source was last expected to send something
+  uint32_t timing_reply_count;
+  uint32_t timing_reply_count_at_probe_start;
+
   time_t playstart;
-  pthread_t thread, timer_requester, rtp_audio_thread, rtp_control_thread, rtp_timing_thread,
-      player_watchdog_thread;
+  pthread_t thread, rtp_audio_thread, rtp_control_and_timing_thread, player_watchdog_thread;
 
   // buffers to delete on exit
   signed short *tbuf;
   int32_t *sbuf;
   char *outbuf;
+  output_channel_state output_channel[MAX_OUTPUT_CHANNELS]; // if a channel map is in use
 
   // for generating running statistics...
 
@@ -141,6 +180,18 @@ typedef struct {
   unsigned int max_frames_per_packet, input_num_channels, input_bit_depth, input_rate;
   int input_bytes_per_frame, output_bytes_per_frame, output_sample_ratio;
   int max_frame_size_change;
+  unsigned int output_frames_per_packet; // the nominal number of output frames per input packet
+  resampler_t *resampler; // used if the output rate isn't an integer multiple of the input rate
+  signed short *rbuf;     // the resampler's output buffer, swapped with tbuf after use
+  uint64_t resampler_time; // nanoseconds spent resampling since the last statistics report
+  int resampler_reset_needed; // set at a resync, so the player thread clears its history
+  uint64_t sample_processing_time; // nanoseconds spent preparing samples for output, likewise
+  uint64_t passthrough_packets, processed_packets; // packets passed through bit for bit, of all
+  uint32_t splice_random_state; // for choosing where to insert or remove a frame
+  int cpu_latency_fd; // held open while the audio flows if a CPU latency bound is requested
+  int performance_hints_held; // the CPU latency bound and utilisation clamp, if asked for
+  uint64_t wakeup_lateness_total, wakeup_lateness_maximum; // in nanoseconds, of timed-out waits in
+  uint32_t wakeup_count; // buffer_get_frame since the last statistics report
   int64_t previous_random_number;
   alac_file *decoder_info;
   uint64_t packet_count;
@@ -150,6 +201,8 @@ typedef struct {
   int64_t time_since_play_started; // nanoseconds
                                    // stats
   uint64_t missing_packets, late_packets, too_late_packets, resend_requests;
+  uint32_t audio_socket_drops, control_socket_drops; // packets dropped by the kernel because a
+                                                      // socket's receive queue was full
   int decoder_in_use;
   // debug variables
   int32_t last_seqno_read;
@@ -167,6 +220,21 @@ typedef struct {
   uint32_t flush_rtp_timestamp;
   uint64_t time_of_last_audio_packet;
   seq_t ab_read, ab_write;
+  seq_t sequence_number_offset; // added to incoming sequence numbers to undo a jump in them
+  seq_t previous_sequence_number_offset; // the offset for packets sent before the last jump
+  seq_t sequence_jump_point;             // the ring position of the first packet after the jump
+  int sequence_jump_point_is_valid;      // while packets from before the jump may yet turn up
+  uint32_t next_timestamp;      // expected on the next packet in sequence, if next_timestamp_is_valid
+  int next_timestamp_is_valid;
+  seq_t restart_candidate_sequence_number; // a packet behind the write point that didn't match,
+  uint32_t restart_candidate_timestamp;    // which may be the first of a new stream
+  int restart_candidate_is_valid;
+  discontinuity_class_type discontinuity_pending; // awaiting recovery, or DC_none
+  seq_t discontinuity_sequence_number;            // the first packet after the pending discontinuity
+  uint64_t discontinuity_disruption_time; // when the sync error left tolerance after it, or 0
+  uint32_t discontinuity_count[DC_number_of_classes], discontinuity_recoveries[DC_number_of_classes];
+  uint64_t discontinuity_recovery_time_total[DC_number_of_classes],
+      discontinuity_recovery_time_maximum[DC_number_of_classes]; // nanoseconds
 
 #ifdef CONFIG_MBEDTLS
   mbedtls_aes_context dctx;
@@ -190,6 +258,12 @@ typedef struct {
   // RTP stuff
   // only one RTP session can be active at a time.
   int rtp_running;
+  int rtp_shutdown_pipe[2]; // a byte written to this tells the RTP threads to stop; it's never read
+  volatile int player_thread_please_stop; // set by player_stop to ask the player thread to finish
+  volatile int player_thread_has_stopped; // set, under ab_mutex, as the player thread finishes
+  int player_parked; // set, under ab_mutex, while an idle player has given up its audio buffers
+  volatile int tearing_down; // set while TEARDOWN is stopping the player
+  session_profile profile;   // what the connection costs in each state, for the statistics
   uint64_t rtp_time_of_last_resend_request_error_ns;
 
   char client_ip_string[INET6_ADDRSTRLEN]; // the ip string pointing to the client
@@ -201,6 +275,7 @@ typedef struct {
   SOCKADDR rtp_client_control_socket; // a socket pointing to the control port of the client
   SOCKADDR rtp_client_timing_socket;  // a socket pointing to the timing port of the client
   int audio_socket;                   // our local [server] audio socket
+  int audio_over_tcp; // if set, audio_socket listens for a TCP connection carrying buffered audio
   int control_socket;                 // our local [server] control socket
   int timing_socket;                  // local timing socket
 
@@ -282,6 +357,10 @@ void player_volume_without_notification(double f, rtsp_conn_info *conn);
 void player_flush(uint32_t timestamp, rtsp_conn_info *conn);
 void player_put_packet(seq_t seqno, uint32_t actual_timestamp, uint8_t *data, int len,
                        rtsp_conn_info *conn);
+// the number of packets that can be put into the buffer without eating into its headroom
+int player_buffer_space(rtsp_conn_info *conn);
+// take back the audio buffers of a parked player, ahead of the audio resuming
+void player_unpark(rtsp_conn_info *conn);
 int64_t monotonic_timestamp(uint32_t timestamp,
                             rtsp_conn_info *conn); // add an epoch to the timestamp. The monotonic
 // timestamp guaranteed to start between 2^32 2^33
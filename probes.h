@@ -0,0 +1,51 @@
+#ifndef _PROBES_H
+#define _PROBES_H
+
+// Statically defined tracing probes at the stages of the audio pipeline, for bpftrace, perf or
+// SystemTap to attach to, in the "shairport_sync" provider. For example:
+//
+//   bpftrace -e 'usdt:/usr/local/bin/shairport-sync:shairport_sync:resend_request
+//     { printf("connection %d: resend %d from %d\n", arg0, arg2, arg1); }'
+//
+// When built with --with-usdt, each probe is a nop instruction until a tracer attaches to it,
+// and the arguments are only fetched by the tracer. Otherwise the probes compile to nothing.
+//
+// Every probe's first argument is the connection number. The others are:
+//   audio_packet_received    seqno, timestamp, length  -- from the audio port or TCP stream
+//   resent_packet_received   seqno, timestamp, length  -- from the control port
+//   put_packet               seqno, timestamp, write_point_gap -- 0 if it was the one expected
+//   resend_request           first seqno, count
+//   get_frame                seqno, ready, buffer occupancy in packets
+//   frame_missing            seqno -- a silent frame is played in its place
+//   stuffing                 sync error in frames, amount to stuff (-1, 0 or 1)
+//   sync_error_resync        sync error in frames -- frames are skipped or silence played
+//   output_delay             result, delay in frames
+//   output_play              frames
+//   flush_requested          timestamp to flush up to
+//   flush_done               (none)
+//   buffer_resync            (none)
+
+#include "config.h"
+
+#ifdef CONFIG_USDT
+#include <sys/sdt.h>
+#define SPS_PROBE1(name, a) DTRACE_PROBE1(shairport_sync, name, a)
+#define SPS_PROBE2(name, a, b) DTRACE_PROBE2(shairport_sync, name, a, b)
+#define SPS_PROBE3(name, a, b, c) DTRACE_PROBE3(shairport_sync, name, a, b, c)
+#define SPS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(shairport_sync, name, a, b, c, d)
+#else
+#define SPS_PROBE1(name, a)                                                                        \
+  do {                                                                                             \
+  } while (0)
+#define SPS_PROBE2(name, a, b)                                                                     \
+  do {                                                                                             \
+  } while (0)
+#define SPS_PROBE3(name, a, b, c)                                                                  \
+  do {                                                                                             \
+  } while (0)
+#define SPS_PROBE4(name, a, b, c, d)                                                               \
+  do {                                                                                             \
+  } while (0)
+#endif
+
+#endif // _PROBES_H
@@ -0,0 +1,250 @@
+#include "resampler.h"
+#include "common.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// This is a straightforward polyphase implementation of an L/M rational resampler.
+// Conceptually, the input is upsampled by L (by inserting L-1 zeros between samples), low-pass
+// filtered at the lower of the two Nyquist frequencies and then decimated by M.
+// Only the filter coefficients that line up with a non-zero input sample are ever used, so each
+// output sample is the dot product of taps_per_phase input samples with one of L "phases" of the
+// prototype filter.
+// For 44,100 to 48,000, L/M is 160/147; for 44,100 to 96,000 it's 320/147.
+
+// The dot product is written with four independent accumulators over contiguous, suitably
+// reversed coefficients so that the compiler can keep it in vector registers without needing
+// -ffast-math to reorder the additions.
+
+// If built for CPUs without floating point hardware, the filter runs in integer arithmetic.
+// The coefficients are less than 1.0 in magnitude, so they are held in Q30; samples lose their
+// bottom eight bits, which leaves 24 bits, so the 64-bit sum of up to 64 products can't overflow.
+
+static unsigned int greatest_common_divisor(unsigned int a, unsigned int b) {
+  while (b != 0) {
+    unsigned int t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// zeroth order modified Bessel function of the first kind, for the Kaiser window
+static double bessel_i0(double x) {
+  double sum = 1.0;
+  double term = 1.0;
+  double halfx = x / 2.0;
+  int k;
+  for (k = 1; k < 50; k++) {
+    term = term * (halfx / k) * (halfx / k);
+    sum += term;
+    if (term < sum * 1e-12)
+      break;
+  }
+  return sum;
+}
+
+const char *resampler_quality_description(resampler_quality_type quality) {
+  switch (quality) {
+  case RQ_low:
+    return "low";
+  case RQ_medium:
+    return "medium";
+  case RQ_high:
+    return "high";
+  default:
+    return "unknown";
+  }
+}
+
+resampler_t *resampler_create(unsigned int input_rate, unsigned int output_rate,
+                              resampler_quality_type quality, size_t max_input_frames) {
+  resampler_t *r = NULL;
+  if ((input_rate == 0) || (output_rate == 0)) {
+    debug(1, "resampler: invalid rates: %u to %u.", input_rate, output_rate);
+    return NULL;
+  }
+  r = calloc(1, sizeof(resampler_t));
+  if (r == NULL) {
+    debug(1, "resampler: can not allocate memory for a resampler.");
+    return NULL;
+  }
+  unsigned int gcd = greatest_common_divisor(input_rate, output_rate);
+  r->input_rate = input_rate;
+  r->output_rate = output_rate;
+  r->interpolation_factor = output_rate / gcd;
+  r->decimation_factor = input_rate / gcd;
+
+  double passband; // as a fraction of the lower Nyquist frequency
+  double beta;     // Kaiser window parameter
+  switch (quality) {
+  case RQ_low:
+    r->taps_per_phase = 16;
+    passband = 0.85;
+    beta = 6.0;
+    break;
+  case RQ_high:
+    r->taps_per_phase = 64;
+    passband = 0.95;
+    beta = 10.0;
+    break;
+  default:
+    r->taps_per_phase = 32;
+    passband = 0.91;
+    beta = 8.0;
+    break;
+  }
+
+  unsigned int L = r->interpolation_factor;
+  unsigned int M = r->decimation_factor;
+  unsigned int taps = r->taps_per_phase;
+  size_t prototype_length = (size_t)taps * L;
+
+  r->coefficients = malloc(sizeof(resampler_coefficient_t) * prototype_length);
+  r->history_size = taps - 1 + max_input_frames;
+  r->history_l = calloc(r->history_size, sizeof(resampler_sample_t));
+  r->history_r = calloc(r->history_size, sizeof(resampler_sample_t));
+  if ((r->coefficients == NULL) || (r->history_l == NULL) || (r->history_r == NULL)) {
+    debug(1, "resampler: can not allocate memory for %zu coefficients or the history buffers.",
+          prototype_length);
+    resampler_free(r);
+    return NULL;
+  }
+
+  // the cutoff, in cycles per sample at the upsampled rate
+  double cutoff = 0.5 * passband / (L > M ? L : M);
+  double centre = (prototype_length - 1) / 2.0;
+  double i0_beta = bessel_i0(beta);
+  unsigned int p, j;
+  for (p = 0; p < L; p++) {
+    for (j = 0; j < taps; j++) {
+      size_t n = (size_t)(taps - 1 - j) * L + p; // reversed, so the dot product runs forwards
+      double x = n - centre;
+      double sinc = (x == 0.0) ? 1.0 : sin(2.0 * M_PI * cutoff * x) / (2.0 * M_PI * cutoff * x);
+      double w = x / centre;
+      double window = bessel_i0(beta * sqrt(fmax(0.0, 1.0 - w * w))) / i0_beta;
+      // the factor L restores the gain lost by zero-stuffing
+      double coefficient = 2.0 * cutoff * L * sinc * window;
+#ifdef CONFIG_FIXED_POINT
+      r->coefficients[p * taps + j] = lrint(coefficient * (1 << RESAMPLER_COEFFICIENT_BITS));
+#else
+      r->coefficients[p * taps + j] = (float)coefficient;
+#endif
+    }
+  }
+  r->group_delay = centre / M;
+  resampler_reset(r);
+  debug(2,
+        "resampler: %u to %u frames per second, L/M = %u/%u, %u taps per phase, group delay "
+        "%.2f output frames.",
+        input_rate, output_rate, L, M, taps, r->group_delay);
+  return r;
+}
+
+void resampler_free(resampler_t *r) {
+  if (r) {
+    free(r->coefficients);
+    free(r->history_l);
+    free(r->history_r);
+    free(r);
+  }
+}
+
+void resampler_reset(resampler_t *r) {
+  memset(r->history_l, 0, sizeof(resampler_sample_t) * r->history_size);
+  memset(r->history_r, 0, sizeof(resampler_sample_t) * r->history_size);
+  r->phase = 0;
+  r->next_input_index = 0;
+}
+
+size_t resampler_max_output_frames(resampler_t *r, size_t input_frames) {
+  return (input_frames * r->interpolation_factor + r->decimation_factor - 1) /
+             r->decimation_factor +
+         1;
+}
+
+#ifdef CONFIG_FIXED_POINT
+static inline int32_t dot_product(const int32_t *c, const int32_t *x, unsigned int n) {
+  int64_t s0 = 0, s1 = 0;
+  unsigned int i;
+  for (i = 0; i < n; i += 2) { // n is always a multiple of 4
+    s0 += (int64_t)c[i] * x[i];
+    s1 += (int64_t)c[i + 1] * x[i + 1];
+  }
+  int64_t s = (s0 + s1) >> (RESAMPLER_COEFFICIENT_BITS - RESAMPLER_HEADROOM_BITS);
+  if (s > INT32_MAX)
+    return INT32_MAX;
+  if (s < INT32_MIN)
+    return INT32_MIN;
+  return (int32_t)s;
+}
+
+static inline resampler_sample_t to_resampler_sample(int32_t sample) {
+  return sample >> RESAMPLER_HEADROOM_BITS;
+}
+#else
+static inline float dot_product_float(const float *c, const float *x, unsigned int n) {
+  float s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+  unsigned int i;
+  for (i = 0; i < n; i += 4) { // n is always a multiple of 4
+    s0 += c[i] * x[i];
+    s1 += c[i + 1] * x[i + 1];
+    s2 += c[i + 2] * x[i + 2];
+    s3 += c[i + 3] * x[i + 3];
+  }
+  return (s0 + s1) + (s2 + s3);
+}
+
+static inline int32_t dot_product(const float *c, const float *x, unsigned int n) {
+  float v = dot_product_float(c, x, n);
+  if (v >= 2147483647.0f)
+    return INT32_MAX;
+  if (v <= -2147483648.0f)
+    return INT32_MIN;
+  return (int32_t)lrintf(v);
+}
+
+static inline resampler_sample_t to_resampler_sample(int32_t sample) { return sample; }
+#endif
+
+size_t resampler_process(resampler_t *r, const int32_t *input, size_t input_frames,
+                         int32_t *output) {
+  unsigned int taps = r->taps_per_phase;
+  unsigned int L = r->interpolation_factor;
+  unsigned int M = r->decimation_factor;
+  size_t i;
+
+  if (input_frames > r->history_size - (taps - 1)) {
+    debug(1, "resampler: too many frames -- %zu -- in a packet.", input_frames);
+    input_frames = r->history_size - (taps - 1);
+  }
+
+  // append the input to the history, so that a window of taps frames ending on any input frame
+  // is contiguous
+  resampler_sample_t *hl = r->history_l + taps - 1;
+  resampler_sample_t *hr = r->history_r + taps - 1;
+  for (i = 0; i < input_frames; i++) {
+    hl[i] = to_resampler_sample(input[2 * i]);
+    hr[i] = to_resampler_sample(input[2 * i + 1]);
+  }
+
+  size_t output_frames = 0;
+  int64_t index = r->next_input_index;
+  unsigned int phase = r->phase;
+  while (index < (int64_t)input_frames) {
+    const resampler_coefficient_t *c = r->coefficients + phase * taps;
+    *output++ = dot_product(c, r->history_l + index, taps);
+    *output++ = dot_product(c, r->history_r + index, taps);
+    output_frames++;
+    phase += M;
+    index += phase / L;
+    phase = phase % L;
+  }
+  r->next_input_index = index - input_frames;
+  r->phase = phase;
+
+  // keep the last taps-1 input frames for the next packet
+  memmove(r->history_l, r->history_l + input_frames, sizeof(resampler_sample_t) * (taps - 1));
+  memmove(r->history_r, r->history_r + input_frames, sizeof(resampler_sample_t) * (taps - 1));
+  return output_frames;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "config.h"
+
+// A rational-ratio polyphase FIR sample rate converter for interleaved stereo int32_t frames.
+// It is used to convert 44,100 frames per second input to an output rate that is not an
+// integer multiple of it, e.g. 48,000 or 96,000 frames per second.
+
+typedef enum {
+  RQ_low = 0, // 16 taps per phase
+  RQ_medium,  // 32 taps per phase
+  RQ_high,    // 64 taps per phase
+} resampler_quality_type;
+
+#ifdef CONFIG_FIXED_POINT
+#define RESAMPLER_COEFFICIENT_BITS 30
+#define RESAMPLER_HEADROOM_BITS 8
+typedef int32_t resampler_coefficient_t; // Q30
+typedef int32_t resampler_sample_t;      // input samples shifted down by eight bits
+#else
+typedef float resampler_coefficient_t;
+typedef float resampler_sample_t;
+#endif
+
+typedef struct {
+  unsigned int input_rate, output_rate;
+  unsigned int interpolation_factor; // L: upsample by this...
+  unsigned int decimation_factor;    // M: ...then downsample by this
+  unsigned int taps_per_phase;
+  resampler_coefficient_t *coefficients; // L rows of taps_per_phase coefficients, each reversed
+  resampler_sample_t *history_l; // the last (taps_per_phase - 1) input samples plus room for a packet
+  resampler_sample_t *history_r;
+  size_t history_size;  // in frames
+  unsigned int phase;   // 0 to L-1
+  int64_t next_input_index; // input frame (relative to the start of the next packet) of the next
+                            // output frame
+  double group_delay;   // in output frames
+} resampler_t;
+
+const char *resampler_quality_description(resampler_quality_type quality);
+resampler_t *resampler_create(unsigned int input_rate, unsigned int output_rate,
+                              resampler_quality_type quality, size_t max_input_frames);
+void resampler_free(resampler_t *r);
+void resampler_reset(resampler_t *r);
+
+// the maximum number of frames that resampler_process can generate from input_frames
+size_t resampler_max_output_frames(resampler_t *r, size_t input_frames);
+
+// input and output are interleaved stereo; returns the number of frames written to output
+size_t resampler_process(resampler_t *r, const int32_t *input, size_t input_frames,
+                         int32_t *output);
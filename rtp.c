@@ -27,8 +27,11 @@
 
 #include "rtp.h"
 #include "common.h"
+#include "perf_counters.h"
+#include "probes.h"
 #include "player.h"
 #include "rtsp.h"
+#include "syncgroup.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -37,9 +40,11 @@
 #include <memory.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <time.h>
@@ -74,13 +79,20 @@ void rtp_terminate(rtsp_conn_info *conn) {
 }
 
 uint64_t local_to_remote_time_difference_now(rtsp_conn_info *conn) {
+  uint64_t time_now = get_absolute_time_in_ns();
+  uint64_t result;
+  // in a sync group, a follower uses the leader's timing whenever it can
+  if ((config.syncgroup_role == SG_follower) &&
+      (syncgroup_local_to_remote_time_difference(time_now, &result, conn) == 0))
+    return result;
+
   // this is an attempt to compensate for clock drift since the last time ping that was used
   // so, if we have a non-zero clock drift, we will calculate the drift there would
   // be from the time of the last time ping
   uint64_t time_since_last_local_to_remote_time_difference_measurement =
-      get_absolute_time_in_ns() - conn->local_to_remote_time_difference_measurement_time;
+      time_now - conn->local_to_remote_time_difference_measurement_time;
 
-  uint64_t result = conn->local_to_remote_time_difference;
+  result = conn->local_to_remote_time_difference;
   if (conn->local_to_remote_time_gradient >= 1.0) {
     result = conn->local_to_remote_time_difference +
              (uint64_t)((conn->local_to_remote_time_gradient - 1.0) *
@@ -93,13 +105,200 @@ uint64_t local_to_remote_time_difference_now(rtsp_conn_info *conn) {
   return result;
 }
 
-void rtp_audio_receiver_cleanup_handler(__attribute__((unused)) void *arg) {
+// Receive a datagram. If SO_RXQ_OVFL has been enabled on the socket, the kernel attaches its count
+// of datagrams dropped because the socket's receive queue was full. Those are packets that
+// arrived but that we didn't read in time -- quite different from packets lost by the network.
+static ssize_t recv_and_count_drops(int fd, void *buf, size_t len, uint32_t *drops,
+                                    const char *socket_name, rtsp_conn_info *conn) {
+#ifdef SO_RXQ_OVFL
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  char control[CMSG_SPACE(sizeof(uint32_t))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t nread = recvmsg(fd, &msg, 0);
+  if (nread >= 0) {
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_RXQ_OVFL)) {
+        uint32_t drop_count;
+        memcpy(&drop_count, CMSG_DATA(cmsg), sizeof(drop_count));
+        if (drop_count != *drops) {
+          debug(2,
+                "Connection %d: %u %s packet(s) dropped by the kernel because the receive queue "
+                "was full -- %u so far.",
+                conn->connection_number, drop_count - *drops, socket_name, drop_count);
+          *drops = drop_count;
+        }
+      }
+    }
+  }
+  return nread;
+#else
+  return recv(fd, buf, len, 0);
+#endif
+}
+
+// RUSAGE_THREAD is only declared if _GNU_SOURCE is defined, but Linux has had it since 2.6.26
+#if defined(__linux__) && !defined(RUSAGE_THREAD)
+#define RUSAGE_THREAD 1
+#endif
+
+// Report the CPU time and context switches of the calling thread, where the system can say.
+static void report_thread_resource_usage(const char *thread_name, rtsp_conn_info *conn) {
+#ifdef RUSAGE_THREAD
+  struct rusage usage;
+  if (getrusage(RUSAGE_THREAD, &usage) == 0)
+    debug(2,
+          "Connection %d: %s thread used %.3f seconds of user and %.3f seconds of system CPU "
+          "time, with %ld voluntary and %ld involuntary context switches.",
+          conn->connection_number, thread_name,
+          usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 0.000001,
+          usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 0.000001, usage.ru_nvcsw,
+          usage.ru_nivcsw);
+#else
+  debug(3, "Connection %d: no resource usage report for the %s thread on this system.",
+        conn->connection_number, thread_name);
+#endif
+}
+
+// The RTP threads don't get cancelled -- instead, when they should stop, a byte is written to the
+// session's rtp_shutdown_pipe. It is never read, so it stays readable and wakes every thread
+// waiting on it.
+// Wait for a packet to arrive on fd (if fd is -1, just wait for timeout_ms to pass).
+// Returns 1 if there is a packet, 0 on timeout and -1 if the thread should stop.
+static int wait_for_packet_or_shutdown(int fd, int timeout_ms, rtsp_conn_info *conn) {
+  struct pollfd fds[2];
+  fds[0].fd = fd; // poll ignores negative file descriptors
+  fds[0].events = POLLIN;
+  fds[0].revents = 0;
+  fds[1].fd = conn->rtp_shutdown_pipe[0];
+  fds[1].events = POLLIN;
+  fds[1].revents = 0;
+  int response;
+  do {
+    response = poll(fds, 2, timeout_ms);
+  } while ((response == -1) && (errno == EINTR));
+  if (response == -1) {
+    char errorstring[1024];
+    strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+    debug(1, "Connection %d: error %d waiting for a packet: \"%s\".", conn->connection_number,
+          errno, (char *)errorstring);
+    return -1; // something's badly wrong, so stop
+  }
+  if (fds[1].revents != 0)
+    return -1;
+  if (response == 0)
+    return 0;
+  return 1;
+}
+
+// The flow of packets from the source is watched so that a source that has gone can be told
+// quickly from one that has merely paused. While audio flows, a packet arrives every few
+// milliseconds. When it stops, timing requests are sent every sender_probe_interval; a source that's
+// still there answers them, so it's taken to be paused and is then checked on by the usual timing
+// requests. If nothing at all comes back for config.sender_silence_timeout, the watchdog ends the
+// session.
+
+static const uint64_t sender_probe_interval = 100000000;    // 100 milliseconds
+static const uint64_t timing_request_interval = 3000000000; // once the timing model is going
+
+static void note_audio_packet_arrival(uint64_t time_now, rtsp_conn_info *conn) {
+  debug_mutex_lock(&conn->watchdog_mutex, 1000, 0);
+  if (conn->last_audio_packet_time != 0) {
+    uint64_t interval = time_now - conn->last_audio_packet_time;
+    if (interval < 1000000000) { // a longer gap is a break in the flow, not its cadence
+      if (conn->audio_packet_interval == 0)
+        conn->audio_packet_interval = interval;
+      else
+        conn->audio_packet_interval = (conn->audio_packet_interval * 15 + interval) / 16;
+    }
+  }
+  conn->last_audio_packet_time = time_now;
+  conn->last_sign_of_life_time = time_now;
+  debug_mutex_unlock(&conn->watchdog_mutex, 0);
+}
+
+static void note_sender_sign_of_life(int is_timing_reply, rtsp_conn_info *conn) {
+  uint64_t time_now = get_absolute_time_in_ns();
+  debug_mutex_lock(&conn->watchdog_mutex, 1000, 0);
+  conn->last_sign_of_life_time = time_now;
+  if (is_timing_reply)
+    conn->timing_reply_count++;
+  debug_mutex_unlock(&conn->watchdog_mutex, 0);
+}
+
+// Work out what the flow of packets says about the source. Returns the time by which it should be
+// looked at again and sets *probing if timing requests should be sent every sender_probe_interval.
+static uint64_t rtp_assess_sender_flow(uint64_t time_now, int *probing, rtsp_conn_info *conn) {
+  uint64_t next_check_time = time_now + timing_request_interval;
+  debug_mutex_lock(&conn->watchdog_mutex, 1000, 0);
+  if ((conn->last_audio_packet_time != 0) && (conn->sender_flow_state != SF_gone)) {
+    // the audio has stopped if nothing has come for a good few packet intervals
+    uint64_t audio_silence_limit = 8 * conn->audio_packet_interval;
+    if (audio_silence_limit < sender_probe_interval)
+      audio_silence_limit = sender_probe_interval;
+    if (time_now - conn->last_audio_packet_time < audio_silence_limit) {
+      if (conn->sender_flow_state == SF_probing)
+        debug(2, "Connection %d: the audio has resumed.", conn->connection_number);
+      conn->sender_flow_state = SF_flowing;
+      next_check_time = conn->last_audio_packet_time + audio_silence_limit;
+    } else if (conn->sender_flow_state == SF_flowing) {
+      debug(2, "Connection %d: the audio has stopped -- checking that the source is still there.",
+            conn->connection_number);
+      conn->sender_flow_state = SF_probing;
+      conn->sender_silence_start_time = conn->last_sign_of_life_time;
+      conn->timing_reply_count_at_probe_start = conn->timing_reply_count;
+      next_check_time = time_now + sender_probe_interval;
+    } else if (conn->sender_flow_state == SF_probing) {
+      if (conn->timing_reply_count != conn->timing_reply_count_at_probe_start) {
+        debug(2, "Connection %d: the source is still there, so it's taken to be paused.",
+              conn->connection_number);
+        conn->sender_flow_state = SF_paused;
+      }
+      next_check_time = time_now + sender_probe_interval;
+    } else if (conn->sender_flow_state == SF_paused) {
+      // a reply to the latest of the usual timing requests should have come by now
+      uint64_t reply_due_time =
+          conn->last_sign_of_life_time + timing_request_interval + sender_probe_interval;
+      if (time_now >= reply_due_time) {
+        debug(2, "Connection %d: the paused source has stopped answering -- checking that it's "
+                 "still there.",
+              conn->connection_number);
+        conn->sender_flow_state = SF_probing;
+        conn->sender_silence_start_time = conn->last_sign_of_life_time + timing_request_interval;
+        conn->timing_reply_count_at_probe_start = conn->timing_reply_count;
+        next_check_time = time_now + sender_probe_interval;
+      } else {
+        // keep looking often enough to notice when the audio resumes and stops again
+        next_check_time = time_now + audio_silence_limit;
+        if (next_check_time > reply_due_time)
+          next_check_time = reply_due_time;
+      }
+    }
+  }
+  *probing = (conn->sender_flow_state == SF_probing);
+  debug_mutex_unlock(&conn->watchdog_mutex, 0);
+  return next_check_time;
+}
+
+void rtp_audio_receiver_cleanup_handler(void *arg) {
+  rtsp_conn_info *conn = (rtsp_conn_info *)arg;
+  report_thread_resource_usage("audio receiver", conn);
+  session_profile_thread_stop(&conn->profile, SPT_rtp_audio);
   debug(3, "Audio Receiver Cleanup Done.");
 }
 
 void *rtp_audio_receiver(void *arg) {
+  perf_counters_thread_start("audio receiver");
   pthread_cleanup_push(rtp_audio_receiver_cleanup_handler, arg);
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
+  session_profile_thread_start(&conn->profile, SPT_rtp_audio);
 
   int32_t last_seqno = -1;
   uint8_t packet[2048], *pktp;
@@ -116,12 +315,15 @@ void *rtp_audio_receiver(void *arg) {
 
   int frame_count = 0;
   ssize_t nread;
-  while (1) {
-    nread = recv(conn->audio_socket, packet, sizeof(packet), 0);
+  while (wait_for_packet_or_shutdown(conn->audio_socket, -1, conn) > 0) {
+    nread = recv_and_count_drops(conn->audio_socket, packet, sizeof(packet),
+                                 &conn->audio_socket_drops, "audio", conn);
 
     frame_count++;
 
     uint64_t local_time_now_ns = get_absolute_time_in_ns();
+    if (config.sender_silence_timeout != 0.0)
+      note_audio_packet_arrival(local_time_now_ns, conn);
     if (time_of_previous_packet_ns) {
       float time_interval_us = (local_time_now_ns - time_of_previous_packet_ns) * 0.001;
       time_of_previous_packet_ns = local_time_now_ns;
@@ -197,6 +399,8 @@ void *rtp_audio_receiver(void *arg) {
 
         // check if packet contains enough content to be reasonable
         if (plen >= 16) {
+          SPS_PROBE4(audio_packet_received, conn->connection_number, seqno, actual_timestamp,
+                     plen);
           if ((config.diagnostic_drop_packet_fraction == 0.0) ||
               (drand48() > config.diagnostic_drop_packet_fraction))
             player_put_packet(seqno, actual_timestamp, pktp, plen, conn);
@@ -222,244 +426,402 @@ void *rtp_audio_receiver(void *arg) {
   close(conn->audio_socket);
   */
 
-  debug(1, "Audio receiver thread \"normal\" exit -- this can't happen. Hah!");
-  pthread_cleanup_pop(0); // don't execute anything here.
-  debug(2, "Audio receiver thread exit.");
+  debug(3, "Connection %d: Audio receiver thread asked to stop.", conn->connection_number);
+  pthread_cleanup_pop(1);
+  debug(3, "Audio receiver thread exit.");
   pthread_exit(NULL);
 }
 
-void rtp_control_handler_cleanup_handler(__attribute__((unused)) void *arg) {
-  debug(3, "Control Receiver Cleanup Done.");
+// Buffered audio. If the sender asks for it in its SETUP and buffered_audio is enabled, the audio
+// comes over a TCP connection instead of in UDP datagrams, each RTP packet preceded by its length
+// as a 16-bit big-endian number, as in RFC 4571. The sender can send it as far ahead as it likes,
+// and the packets are held here, still encoded, in a backlog of up to config.buffered_audio_length
+// seconds. They are passed on to the player as its buffer has room for them, so they are played by
+// the same presentation-time logic as audio that arrives in real time. When the backlog is full,
+// the connection isn't read, and TCP's flow control holds the sender back. A network outage that's
+// shorter than the audio held is then just a pause in the flow into the backlog, and TCP
+// retransmits whatever was lost in it, rather than it becoming a dropout.
+
+static const int buffered_audio_feed_interval_ms = 5; // how often to top up the player's buffer
+
+typedef struct {
+  rtsp_conn_info *conn;
+  int fd;            // the sender's connection, or -1 while waiting for it
+  uint8_t *packets;  // the backlog -- a ring of slots of slot_size bytes
+  uint16_t *lengths; // the length of the packet in each slot
+  size_t slot_size;
+  uint32_t capacity; // the number of slots
+  uint32_t first;    // the slot of the oldest packet
+  uint32_t count;
+  uint8_t stream[2 + 65535]; // what has been read from the connection but not yet taken
+  size_t stream_length;
+} buffered_audio_state;
+
+static void rtp_buffered_audio_receiver_cleanup_handler(void *arg) {
+  buffered_audio_state *s = (buffered_audio_state *)arg;
+  report_thread_resource_usage("audio receiver", s->conn);
+  session_profile_add_memory(&s->conn->profile, -(int64_t)s->capacity * s->slot_size);
+  session_profile_thread_stop(&s->conn->profile, SPT_rtp_audio);
+  if (s->fd >= 0)
+    close(s->fd);
+  free(s->packets);
+  free(s->lengths);
+  free(s);
 }
 
-void *rtp_control_receiver(void *arg) {
-  pthread_cleanup_push(rtp_control_handler_cleanup_handler, arg);
+// move complete packets from what's been read into the backlog, while there's room
+static void buffered_audio_take_packets(buffered_audio_state *s) {
+  size_t offset = 0;
+  while ((s->count < s->capacity) && (s->stream_length - offset >= 2)) {
+    size_t length = (s->stream[offset] << 8) | s->stream[offset + 1];
+    if (s->stream_length - offset < 2 + length)
+      break; // the rest of it hasn't arrived yet
+    if ((length < 12 + 16) || (length > s->slot_size)) {
+      debug(1, "Connection %d: a buffered audio packet of %zu bytes has been ignored.",
+            s->conn->connection_number, length);
+    } else {
+      uint32_t slot = (s->first + s->count) % s->capacity;
+      memcpy(s->packets + slot * s->slot_size, s->stream + offset + 2, length);
+      s->lengths[slot] = length;
+      s->count++;
+    }
+    offset += 2 + length;
+  }
+  memmove(s->stream, s->stream + offset, s->stream_length - offset);
+  s->stream_length -= offset;
+}
+
+// pass packets from the backlog to the player, while its buffer has room
+static void buffered_audio_feed_player(buffered_audio_state *s) {
+  rtsp_conn_info *conn = s->conn;
+  // packets from before a pending flush would only be thrown away by the player
+  debug_mutex_lock(&conn->flush_mutex, 1000, 0);
+  uint32_t flush_timestamp = conn->flush_rtp_timestamp;
+  debug_mutex_unlock(&conn->flush_mutex, 0);
+  int space = player_buffer_space(conn);
+  while ((s->count > 0) && (space > 0)) {
+    uint8_t *packet = s->packets + s->first * s->slot_size;
+    int length = s->lengths[s->first];
+    uint8_t type = packet[1] & ~0x80;
+    seq_t seqno = ntohs(*(uint16_t *)(packet + 2));
+    uint32_t timestamp = ntohl(*(uint32_t *)(packet + 4));
+    if (type != 0x60) {
+      debug(1, "Connection %d: unknown buffered audio packet of type 0x%02X length %d.",
+            conn->connection_number, type, length);
+    } else if ((flush_timestamp != 0) && ((int32_t)(timestamp - flush_timestamp) < 0)) {
+      debug(3, "Connection %d: buffered audio packet %u dropped as it precedes a flush.",
+            conn->connection_number, seqno);
+    } else {
+      // the source is judged by the flow of audio to the player, which the backlog keeps going
+      if (config.sender_silence_timeout != 0.0)
+        note_audio_packet_arrival(get_absolute_time_in_ns(), conn);
+      SPS_PROBE4(audio_packet_received, conn->connection_number, seqno, timestamp, length - 12);
+      player_put_packet(seqno, timestamp, packet + 12, length - 12, conn);
+      space--;
+    }
+    s->first = (s->first + 1) % s->capacity;
+    s->count--;
+  }
+}
+
+void *rtp_buffered_audio_receiver(void *arg) {
+  perf_counters_thread_start("audio receiver");
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
+  session_profile_thread_start(&conn->profile, SPT_rtp_audio);
+  buffered_audio_state *s = calloc(1, sizeof(buffered_audio_state));
+  if (s == NULL)
+    die("Connection %d: can not allocate the buffered audio receiver.", conn->connection_number);
+  s->conn = conn;
+  s->fd = -1;
+  unsigned int frames_per_packet = conn->max_frames_per_packet;
+  if (frames_per_packet == 0)
+    frames_per_packet = 352;
+  // room for the RTP header and an uncompressed packet, with some to spare for padding
+  s->slot_size = 12 + frames_per_packet * 4 + 64;
+  s->capacity = (uint32_t)(config.buffered_audio_length * conn->input_rate / frames_per_packet) + 1;
+  s->packets = malloc(s->capacity * s->slot_size);
+  s->lengths = malloc(s->capacity * sizeof(uint16_t));
+  if ((s->packets == NULL) || (s->lengths == NULL))
+    die("Connection %d: can not allocate %.1f seconds of buffered audio.", conn->connection_number,
+        config.buffered_audio_length);
+  session_profile_add_memory(&conn->profile, (int64_t)s->capacity * s->slot_size);
+  pthread_cleanup_push(rtp_buffered_audio_receiver_cleanup_handler, s);
+  debug(2, "Connection %d: waiting for buffered audio on TCP port %u, holding up to %u packets.",
+        conn->connection_number, conn->local_audio_port, s->capacity);
+
+  int response;
+  do {
+    // wait for the sender to connect, or for more audio if there's room for it, or, if there's
+    // audio in the backlog, until it's time to top up the player's buffer again
+    int fd = -1; // poll ignores negative file descriptors
+    if (s->fd < 0)
+      fd = conn->audio_socket;
+    else if ((s->count < s->capacity) && (s->stream_length < sizeof(s->stream)))
+      fd = s->fd;
+    response =
+        wait_for_packet_or_shutdown(fd, s->count ? buffered_audio_feed_interval_ms : -1, conn);
+    if ((response > 0) && (s->fd < 0)) {
+      s->fd = accept(conn->audio_socket, NULL, NULL);
+      if (s->fd < 0) {
+        debug(1, "Connection %d: error accepting the buffered audio connection: %s.",
+              conn->connection_number, strerror(errno));
+        usleep(100000);
+      } else {
+        debug(2, "Connection %d: buffered audio connection accepted.", conn->connection_number);
+      }
+    } else if (response > 0) {
+      ssize_t nread =
+          recv(s->fd, s->stream + s->stream_length, sizeof(s->stream) - s->stream_length, 0);
+      if (nread > 0) {
+        s->stream_length += nread;
+      } else {
+        if (nread < 0)
+          debug(1, "Connection %d: error receiving buffered audio: %s.", conn->connection_number,
+                strerror(errno));
+        debug(2,
+              "Connection %d: the buffered audio connection has closed with %u packets held -- "
+              "waiting for the sender to connect again.",
+              conn->connection_number, s->count);
+        close(s->fd);
+        s->fd = -1;
+        // keep the complete packets that haven't been taken yet, but not a partial one
+        size_t complete = 0;
+        while ((s->stream_length - complete >= 2) &&
+               (s->stream_length - complete >=
+                2 + (size_t)((s->stream[complete] << 8) | s->stream[complete + 1])))
+          complete += 2 + ((s->stream[complete] << 8) | s->stream[complete + 1]);
+        s->stream_length = complete;
+      }
+    }
+    buffered_audio_take_packets(s);
+    buffered_audio_feed_player(s);
+  } while (response >= 0);
 
-  conn->reference_timestamp = 0; // nothing valid received yet
+  debug(3, "Connection %d: Buffered audio receiver thread asked to stop.", conn->connection_number);
+  pthread_cleanup_pop(1);
+  pthread_exit(NULL);
+}
+
+// Receive and act on a packet from the control port -- a sync packet or a resent audio packet
+static void rtp_control_receive_packet(rtsp_conn_info *conn) {
   uint8_t packet[2048], *pktp;
   // struct timespec tn;
   uint64_t remote_time_of_sync;
   uint32_t sync_rtp_timestamp;
   ssize_t nread;
-  while (1) {
-    nread = recv(conn->control_socket, packet, sizeof(packet), 0);
-
-    if (nread >= 0) {
-
-      if ((config.diagnostic_drop_packet_fraction == 0.0) ||
-          (drand48() > config.diagnostic_drop_packet_fraction)) {
+  nread = recv_and_count_drops(conn->control_socket, packet, sizeof(packet),
+                               &conn->control_socket_drops, "control", conn);
 
-        ssize_t plen = nread;
-        if (packet[1] == 0xd4) {                       // sync data
-                                                       /*
-                                                            // the following stanza is for debugging only -- normally commented out.
-                                                            {
-                                                              char obf[4096];
-                                                              char *obfp = obf;
-                                                              int obfc;
-                                                              for (obfc = 0; obfc < plen; obfc++) {
-                                                                snprintf(obfp, 3, "%02X", packet[obfc]);
-                                                                obfp += 2;
-                                                              };
-                                                              *obfp = 0;
-                                             
-                                             
-                                                              // get raw timestamp information
-                                                              // I think that a good way to understand these timestamps is that
-                                                              // (1) the rtlt below is the timestamp of the frame that should be playing at the
-                                                              // client-time specified in the packet if there was no delay
-                                                              // and (2) that the rt below is the timestamp of the frame that should be playing
-                                                              // at the client-time specified in the packet on this device taking account of
-                                                              // the delay
-                                                              // Thus, (3) the latency can be calculated by subtracting the second from the
-                                                              // first.
-                                                              // There must be more to it -- there something missing.
-                                             
-                                                              // In addition, it seems that if the value of the short represented by the second
-                                                              // pair of bytes in the packet is 7
-                                                              // then an extra time lag is expected to be added, presumably by
-                                                              // the AirPort Express.
-                                             
-                                                              // Best guess is that this delay is 11,025 frames.
-                                             
-                                                              uint32_t rtlt = nctohl(&packet[4]); // raw timestamp less latency
-                                                              uint32_t rt = nctohl(&packet[16]);  // raw timestamp
-                                             
-                                                              uint32_t fl = nctohs(&packet[2]); //
-                                             
-                                                              debug(1,"Sync Packet of %d bytes received: \"%s\", flags: %d, timestamps %u and %u,
-                                                          giving a latency of %d frames.",plen,obf,fl,rt,rtlt,rt-rtlt);
-                                                              //debug(1,"Monotonic timestamps are: %" PRId64 " and %" PRId64 "
-                                                          respectively.",monotonic_timestamp(rt, conn),monotonic_timestamp(rtlt, conn));
-                                                            }
-                                                       */
-          if (conn->local_to_remote_time_difference) { // need a time packet to be interchanged
-                                                       // first...
-            uint64_t ps, pn;
+  if (nread >= 0) {
 
-            ps = nctohl(&packet[8]);
-            ps = ps * 1000000000; // this many nanoseconds from the whole seconds
-            pn = nctohl(&packet[12]);
-            pn = pn * 1000000000;
-            pn = pn >> 32; // this many nanoseconds from the fractional part
-            remote_time_of_sync = ps + pn;
-
-            // debug(1,"Remote Sync Time: " PRIu64 "",remote_time_of_sync);
-
-            sync_rtp_timestamp = nctohl(&packet[16]);
-            uint32_t rtp_timestamp_less_latency = nctohl(&packet[4]);
+    if ((config.diagnostic_drop_packet_fraction == 0.0) ||
+        (drand48() > config.diagnostic_drop_packet_fraction)) {
 
-            // debug(1,"Sync timestamp is %u.",ntohl(*((uint32_t *)&packet[16])));
+      if (config.sender_silence_timeout != 0.0)
+        note_sender_sign_of_life(0, conn);
+      ssize_t plen = nread;
+      if (packet[1] == 0xd4) {                       // sync data
+                                                     /*
+                                                          // the following stanza is for debugging only -- normally commented out.
+                                                          {
+                                                            char obf[4096];
+                                                            char *obfp = obf;
+                                                            int obfc;
+                                                            for (obfc = 0; obfc < plen; obfc++) {
+                                                              snprintf(obfp, 3, "%02X", packet[obfc]);
+                                                              obfp += 2;
+                                                            };
+                                                            *obfp = 0;
+                                           
+                                           
+                                                            // get raw timestamp information
+                                                            // I think that a good way to understand these timestamps is that
+                                                            // (1) the rtlt below is the timestamp of the frame that should be playing at the
+                                                            // client-time specified in the packet if there was no delay
+                                                            // and (2) that the rt below is the timestamp of the frame that should be playing
+                                                            // at the client-time specified in the packet on this device taking account of
+                                                            // the delay
+                                                            // Thus, (3) the latency can be calculated by subtracting the second from the
+                                                            // first.
+                                                            // There must be more to it -- there something missing.
+                                           
+                                                            // In addition, it seems that if the value of the short represented by the second
+                                                            // pair of bytes in the packet is 7
+                                                            // then an extra time lag is expected to be added, presumably by
+                                                            // the AirPort Express.
+                                           
+                                                            // Best guess is that this delay is 11,025 frames.
+                                           
+                                                            uint32_t rtlt = nctohl(&packet[4]); // raw timestamp less latency
+                                                            uint32_t rt = nctohl(&packet[16]);  // raw timestamp
+                                           
+                                                            uint32_t fl = nctohs(&packet[2]); //
+                                           
+                                                            debug(1,"Sync Packet of %d bytes received: \"%s\", flags: %d, timestamps %u and %u,
+                                                        giving a latency of %d frames.",plen,obf,fl,rt,rtlt,rt-rtlt);
+                                                            //debug(1,"Monotonic timestamps are: %" PRId64 " and %" PRId64 "
+                                                        respectively.",monotonic_timestamp(rt, conn),monotonic_timestamp(rtlt, conn));
+                                                          }
+                                                     */
+        if (conn->local_to_remote_time_difference) { // need a time packet to be interchanged
+                                                     // first...
+          uint64_t ps, pn;
+
+          ps = nctohl(&packet[8]);
+          ps = ps * 1000000000; // this many nanoseconds from the whole seconds
+          pn = nctohl(&packet[12]);
+          pn = pn * 1000000000;
+          pn = pn >> 32; // this many nanoseconds from the fractional part
+          remote_time_of_sync = ps + pn;
+
+          // debug(1,"Remote Sync Time: " PRIu64 "",remote_time_of_sync);
+
+          sync_rtp_timestamp = nctohl(&packet[16]);
+          uint32_t rtp_timestamp_less_latency = nctohl(&packet[4]);
+
+          // debug(1,"Sync timestamp is %u.",ntohl(*((uint32_t *)&packet[16])));
+
+          if (config.userSuppliedLatency) {
+            if (config.userSuppliedLatency != conn->latency) {
+              debug(1, "Using the user-supplied latency: %" PRIu32 ".",
+                    config.userSuppliedLatency);
+            }
+            conn->latency = config.userSuppliedLatency;
+          } else {
 
-            if (config.userSuppliedLatency) {
-              if (config.userSuppliedLatency != conn->latency) {
-                debug(1, "Using the user-supplied latency: %" PRIu32 ".",
-                      config.userSuppliedLatency);
-              }
-              conn->latency = config.userSuppliedLatency;
+            // It seems that the second pair of bytes in the packet indicate whether a fixed
+            // delay of 11,025 frames should be added -- iTunes set this field to 7 and
+            // AirPlay sets it to 4.
+
+            // However, on older versions of AirPlay, the 11,025 frames seem to be necessary too
+
+            // The value of 11,025 (0.25 seconds) is a guess based on the "Audio-Latency"
+            // parameter
+            // returned by an AE.
+
+            // Sigh, it would be nice to have a published protocol...
+
+            uint16_t flags = nctohs(&packet[2]);
+            uint32_t la = sync_rtp_timestamp - rtp_timestamp_less_latency; // note, this might
+                                                                           // loop around in
+                                                                           // modulo. Not sure if
+                                                                           // you'll get an error!
+            // debug(3, "Latency derived just from the sync packet is %" PRIu32 " frames.", la);
+
+            if ((flags == 7) || ((conn->AirPlayVersion > 0) && (conn->AirPlayVersion <= 353)) ||
+                ((conn->AirPlayVersion > 0) && (conn->AirPlayVersion >= 371))) {
+              la += config.fixedLatencyOffset;
+              // debug(3, "A fixed latency offset of %d frames has been added, giving a latency of
+              // "
+              //         "%" PRId64
+              //         " frames with flags: %d and AirPlay version %d (triggers if 353 or
+              //         less).",
+              //      config.fixedLatencyOffset, la, flags, conn->AirPlayVersion);
+            }
+            conn->sender_latency = la;
+            if (conn->adaptive_latency != 0)
+              la = conn->adaptive_latency; // chosen by the receiver, at the last flush
+            if ((conn->maximum_latency) && (conn->maximum_latency < la))
+              la = conn->maximum_latency;
+            if ((conn->minimum_latency) && (conn->minimum_latency > la))
+              la = conn->minimum_latency;
+
+            const uint32_t max_frames = ((3 * BUFFER_FRAMES * 352) / 4) - 11025;
+
+            if (la > max_frames) {
+              warn("An out-of-range latency request of %" PRIu32
+                   " frames was ignored. Must be %" PRIu32
+                   " frames or less (44,100 frames per second). "
+                   "Latency remains at %" PRIu32 " frames.",
+                   la, max_frames, conn->latency);
             } else {
 
-              // It seems that the second pair of bytes in the packet indicate whether a fixed
-              // delay of 11,025 frames should be added -- iTunes set this field to 7 and
-              // AirPlay sets it to 4.
-
-              // However, on older versions of AirPlay, the 11,025 frames seem to be necessary too
-
-              // The value of 11,025 (0.25 seconds) is a guess based on the "Audio-Latency"
-              // parameter
-              // returned by an AE.
-
-              // Sigh, it would be nice to have a published protocol...
-
-              uint16_t flags = nctohs(&packet[2]);
-              uint32_t la = sync_rtp_timestamp - rtp_timestamp_less_latency; // note, this might
-                                                                             // loop around in
-                                                                             // modulo. Not sure if
-                                                                             // you'll get an error!
-              // debug(3, "Latency derived just from the sync packet is %" PRIu32 " frames.", la);
-
-              if ((flags == 7) || ((conn->AirPlayVersion > 0) && (conn->AirPlayVersion <= 353)) ||
-                  ((conn->AirPlayVersion > 0) && (conn->AirPlayVersion >= 371))) {
-                la += config.fixedLatencyOffset;
-                // debug(3, "A fixed latency offset of %d frames has been added, giving a latency of
-                // "
-                //         "%" PRId64
-                //         " frames with flags: %d and AirPlay version %d (triggers if 353 or
-                //         less).",
-                //      config.fixedLatencyOffset, la, flags, conn->AirPlayVersion);
-              }
-              if ((conn->maximum_latency) && (conn->maximum_latency < la))
-                la = conn->maximum_latency;
-              if ((conn->minimum_latency) && (conn->minimum_latency > la))
-                la = conn->minimum_latency;
-
-              const uint32_t max_frames = ((3 * BUFFER_FRAMES * 352) / 4) - 11025;
-
-              if (la > max_frames) {
-                warn("An out-of-range latency request of %" PRIu32
-                     " frames was ignored. Must be %" PRIu32
-                     " frames or less (44,100 frames per second). "
-                     "Latency remains at %" PRIu32 " frames.",
-                     la, max_frames, conn->latency);
-              } else {
-
-                if (la != conn->latency) {
-                  conn->latency = la;
-                  debug(3,
-                        "New latency detected: %" PRIu32 ", sync latency: %" PRIu32
-                        ", minimum latency: %" PRIu32 ", maximum "
-                        "latency: %" PRIu32 ", fixed offset: %" PRIu32 ".",
-                        la, sync_rtp_timestamp - rtp_timestamp_less_latency, conn->minimum_latency,
-                        conn->maximum_latency, config.fixedLatencyOffset);
-                }
+              if (la != conn->latency) {
+                conn->latency = la;
+                debug(3,
+                      "New latency detected: %" PRIu32 ", sync latency: %" PRIu32
+                      ", minimum latency: %" PRIu32 ", maximum "
+                      "latency: %" PRIu32 ", fixed offset: %" PRIu32 ".",
+                      la, sync_rtp_timestamp - rtp_timestamp_less_latency, conn->minimum_latency,
+                      conn->maximum_latency, config.fixedLatencyOffset);
               }
             }
+          }
 
-            debug_mutex_lock(&conn->reference_time_mutex, 1000, 0);
+          debug_mutex_lock(&conn->reference_time_mutex, 1000, 0);
 
-            if (conn->initial_reference_time == 0) {
-              if (conn->packet_count_since_flush > 0) {
-                conn->initial_reference_time = remote_time_of_sync;
-                conn->initial_reference_timestamp = sync_rtp_timestamp;
-              }
-            } else {
-              uint64_t remote_frame_time_interval =
-                  conn->remote_reference_timestamp_time -
-                  conn->initial_reference_time; // here, this should never be zero
-              if (remote_frame_time_interval) {
-                conn->remote_frame_rate =
-                    (1.0E9 * (conn->reference_timestamp - conn->initial_reference_timestamp)) /
-                    remote_frame_time_interval;
-              } else {
-                conn->remote_frame_rate = 0.0; // use as a flag.
-              }
+          if (conn->initial_reference_time == 0) {
+            if (conn->packet_count_since_flush > 0) {
+              conn->initial_reference_time = remote_time_of_sync;
+              conn->initial_reference_timestamp = sync_rtp_timestamp;
             }
-
-            // this is for debugging
-            uint64_t old_remote_reference_time = conn->remote_reference_timestamp_time;
-            uint32_t old_reference_timestamp = conn->reference_timestamp;
-            // int64_t old_latency_delayed_timestamp = conn->latency_delayed_timestamp;
-
-            conn->remote_reference_timestamp_time = remote_time_of_sync;
-            // conn->reference_timestamp_time =
-            //    remote_time_of_sync - local_to_remote_time_difference_now(conn);
-            conn->reference_timestamp = sync_rtp_timestamp;
-            conn->latency_delayed_timestamp = rtp_timestamp_less_latency;
-            debug_mutex_unlock(&conn->reference_time_mutex, 0);
-
-            conn->reference_to_previous_time_difference =
-                remote_time_of_sync - old_remote_reference_time;
-            if (old_reference_timestamp == 0)
-              conn->reference_to_previous_frame_difference = 0;
-            else
-              conn->reference_to_previous_frame_difference =
-                  sync_rtp_timestamp - old_reference_timestamp;
           } else {
-            debug(2, "Sync packet received before we got a timing packet back.");
+            uint64_t remote_frame_time_interval =
+                conn->remote_reference_timestamp_time -
+                conn->initial_reference_time; // here, this should never be zero
+            if (remote_frame_time_interval) {
+              conn->remote_frame_rate =
+                  (1.0E9 * (conn->reference_timestamp - conn->initial_reference_timestamp)) /
+                  remote_frame_time_interval;
+            } else {
+              conn->remote_frame_rate = 0.0; // use as a flag.
+            }
           }
-        } else if (packet[1] == 0xd6) { // resent audio data in the control path -- whaale only?
-          pktp = packet + 4;
-          plen -= 4;
-          seq_t seqno = ntohs(*(uint16_t *)(pktp + 2));
-          debug(3, "Control Receiver -- Retransmitted Audio Data Packet %u received.", seqno);
 
-          uint32_t actual_timestamp = ntohl(*(uint32_t *)(pktp + 4));
+          // this is for debugging
+          uint64_t old_remote_reference_time = conn->remote_reference_timestamp_time;
+          uint32_t old_reference_timestamp = conn->reference_timestamp;
+          // int64_t old_latency_delayed_timestamp = conn->latency_delayed_timestamp;
+
+          conn->remote_reference_timestamp_time = remote_time_of_sync;
+          // conn->reference_timestamp_time =
+          //    remote_time_of_sync - local_to_remote_time_difference_now(conn);
+          conn->reference_timestamp = sync_rtp_timestamp;
+          conn->latency_delayed_timestamp = rtp_timestamp_less_latency;
+          debug_mutex_unlock(&conn->reference_time_mutex, 0);
+
+          conn->reference_to_previous_time_difference =
+              remote_time_of_sync - old_remote_reference_time;
+          if (old_reference_timestamp == 0)
+            conn->reference_to_previous_frame_difference = 0;
+          else
+            conn->reference_to_previous_frame_difference =
+                sync_rtp_timestamp - old_reference_timestamp;
+        } else {
+          debug(2, "Sync packet received before we got a timing packet back.");
+        }
+      } else if (packet[1] == 0xd6) { // resent audio data in the control path -- whaale only?
+        pktp = packet + 4;
+        plen -= 4;
+        seq_t seqno = ntohs(*(uint16_t *)(pktp + 2));
+        debug(3, "Control Receiver -- Retransmitted Audio Data Packet %u received.", seqno);
 
-          pktp += 12;
-          plen -= 12;
+        uint32_t actual_timestamp = ntohl(*(uint32_t *)(pktp + 4));
 
-          // check if packet contains enough content to be reasonable
-          if (plen >= 16) {
-            player_put_packet(seqno, actual_timestamp, pktp, plen, conn);
-            continue;
-          } else {
-            debug(3, "Too-short retransmitted audio packet received in control port, ignored.");
-          }
-        } else
-          debug(1, "Control Receiver -- Unknown RTP packet of type 0x%02X length %d, ignored.",
-                packet[1], nread);
-      } else {
-        debug(3, "Control Receiver -- dropping a packet to simulate a bad network.");
-      }
+        pktp += 12;
+        plen -= 12;
+
+        // check if packet contains enough content to be reasonable
+        if (plen >= 16) {
+          SPS_PROBE4(resent_packet_received, conn->connection_number, seqno, actual_timestamp,
+                     plen);
+          player_put_packet(seqno, actual_timestamp, pktp, plen, conn);
+          return;
+        } else {
+          debug(3, "Too-short retransmitted audio packet received in control port, ignored.");
+        }
+      } else
+        debug(1, "Control Receiver -- Unknown RTP packet of type 0x%02X length %d, ignored.",
+              packet[1], nread);
     } else {
-      debug(1, "Control Receiver -- error receiving a packet.");
+      debug(3, "Control Receiver -- dropping a packet to simulate a bad network.");
     }
+  } else {
+    debug(1, "Control Receiver -- error receiving a packet.");
   }
-  debug(1, "Control RTP thread \"normal\" exit -- this can't happen. Hah!");
-  pthread_cleanup_pop(0); // don't execute anything here.
-  debug(2, "Control RTP thread exit.");
-  pthread_exit(NULL);
 }
 
-void rtp_timing_sender_cleanup_handler(void *arg) {
-  rtsp_conn_info *conn = (rtsp_conn_info *)arg;
-  debug(3, "Connection %d: Timing Sender Cleanup.", conn->connection_number);
-}
-
-void *rtp_timing_sender(void *arg) {
-  pthread_cleanup_push(rtp_timing_sender_cleanup_handler, arg);
-  rtsp_conn_info *conn = (rtsp_conn_info *)arg;
+static void rtp_timing_send_request(rtsp_conn_info *conn) {
   struct timing_request {
     char leader;
     char type;
@@ -468,62 +830,101 @@ void *rtp_timing_sender(void *arg) {
     uint64_t origin, receive, transmit;
   };
 
-  uint64_t request_number = 0;
-
   struct timing_request req; // *not* a standard RTCP NACK
 
   req.leader = 0x80;
   req.type = 0xd2; // Timing request
   req.filler = 0;
   req.seqno = htons(7);
+  req.origin = req.receive = req.transmit = 0;
 
-  conn->time_ping_count = 0;
-  while (1) {
-    // debug(1,"Send a timing request");
-
-    if (!conn->rtp_running)
-      debug(1, "rtp_timing_sender called without active stream in RTSP conversation thread %d!",
-            conn->connection_number);
+  if (!conn->rtp_running)
+    debug(1, "rtp_timing_send_request called without active stream in RTSP conversation thread %d!",
+          conn->connection_number);
 
-    // debug(1, "Requesting ntp timestamp exchange.");
-
-    req.filler = 0;
-    req.origin = req.receive = req.transmit = 0;
-
-    conn->departure_time = get_absolute_time_in_ns();
-    socklen_t msgsize = sizeof(struct sockaddr_in);
+  conn->departure_time = get_absolute_time_in_ns();
+  socklen_t msgsize = sizeof(struct sockaddr_in);
 #ifdef AF_INET6
-    if (conn->rtp_client_timing_socket.SAFAMILY == AF_INET6) {
-      msgsize = sizeof(struct sockaddr_in6);
-    }
+  if (conn->rtp_client_timing_socket.SAFAMILY == AF_INET6) {
+    msgsize = sizeof(struct sockaddr_in6);
+  }
 #endif
-    if ((config.diagnostic_drop_packet_fraction == 0.0) ||
-        (drand48() > config.diagnostic_drop_packet_fraction)) {
-      if (sendto(conn->timing_socket, &req, sizeof(req), 0,
-                 (struct sockaddr *)&conn->rtp_client_timing_socket, msgsize) == -1) {
-        char em[1024];
-        strerror_r(errno, em, sizeof(em));
-        debug(1, "Error %d using send-to to the timing socket: \"%s\".", errno, em);
-      }
-    } else {
-      debug(3, "Timing Sender Thread -- dropping outgoing packet to simulate bad network.");
+  if ((config.diagnostic_drop_packet_fraction == 0.0) ||
+      (drand48() > config.diagnostic_drop_packet_fraction)) {
+    if (sendto(conn->timing_socket, &req, sizeof(req), 0,
+               (struct sockaddr *)&conn->rtp_client_timing_socket, msgsize) == -1) {
+      char em[1024];
+      strerror_r(errno, em, sizeof(em));
+      debug(1, "Error %d using send-to to the timing socket: \"%s\".", errno, em);
     }
+  } else {
+    debug(3, "Timing Sender -- dropping outgoing packet to simulate bad network.");
+  }
+}
 
-    request_number++;
-
-    if (request_number <= 6)
-      usleep(300000); // these are thread cancellation points
-    else
-      usleep(3000000);
+// The control port, the timing port and the timing request schedule are all looked after by one
+// thread per session. It sleeps in poll() until a packet arrives on either port, a timing request
+// falls due or the shutdown pipe becomes readable, so it only wakes when there's work to do.
+// Control packets are dealt with here; this returns 1 when there is a timing packet to be read
+// and -1 when the thread should stop.
+static int rtp_wait_for_timing_packet(uint64_t *next_timing_request_time,
+                                      uint64_t *timing_request_number, rtsp_conn_info *conn) {
+  struct pollfd fds[3];
+  fds[0].fd = conn->timing_socket;
+  fds[0].events = POLLIN;
+  fds[1].fd = conn->control_socket;
+  fds[1].events = POLLIN;
+  fds[2].fd = conn->rtp_shutdown_pipe[0];
+  fds[2].events = POLLIN;
+  uint64_t next_flow_check_time = UINT64_MAX;
+  int probing = 0;
+  while (1) {
+    uint64_t time_now = get_absolute_time_in_ns();
+    if (config.sender_silence_timeout != 0.0) {
+      next_flow_check_time = rtp_assess_sender_flow(time_now, &probing, conn);
+      // while the source is being probed, don't wait for the usual timing request
+      if ((probing) && (*next_timing_request_time > conn->departure_time + sender_probe_interval))
+        *next_timing_request_time = conn->departure_time + sender_probe_interval;
+    }
+    if (time_now >= *next_timing_request_time) {
+      rtp_timing_send_request(conn);
+      *timing_request_number = *timing_request_number + 1;
+      // a quick flurry at the start to get the timing model going, then every three seconds
+      uint64_t interval = *timing_request_number <= 6 ? 300000000 : timing_request_interval;
+      if (probing)
+        interval = sender_probe_interval;
+      *next_timing_request_time = time_now + interval;
+    }
+    uint64_t wake_time = *next_timing_request_time;
+    if (next_flow_check_time < wake_time)
+      wake_time = next_flow_check_time;
+    // round up so that it doesn't wake just before the request falls due
+    int timeout_ms = wake_time > time_now ? (wake_time - time_now + 999999) / 1000000 : 0;
+    fds[0].revents = 0;
+    fds[1].revents = 0;
+    fds[2].revents = 0;
+    int response = poll(fds, 3, timeout_ms);
+    if (response == -1) {
+      if (errno == EINTR)
+        continue;
+      char errorstring[1024];
+      strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+      debug(1, "Connection %d: error %d waiting for a control or timing packet: \"%s\".",
+            conn->connection_number, errno, (char *)errorstring);
+      return -1; // something's badly wrong, so stop
+    }
+    if (fds[2].revents != 0)
+      return -1;
+    if (fds[1].revents != 0)
+      rtp_control_receive_packet(conn);
+    if (fds[0].revents != 0)
+      return 1;
   }
-  debug(3, "rtp_timing_sender thread interrupted. This should never happen.");
-  pthread_cleanup_pop(0); // don't execute anything here.
-  pthread_exit(NULL);
 }
 
-void rtp_timing_receiver_cleanup_handler(void *arg) {
+void rtp_control_and_timing_receiver_cleanup_handler(void *arg) {
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
-  debug(3, "Timing Receiver Cleanup.");
+  debug(3, "Control and Timing Receiver Cleanup.");
   // walk down the list of DACP / gradient pairs, if any
   nvll *gradients = config.gradients;
   if (conn->dacp_id)
@@ -548,23 +949,23 @@ void rtp_timing_receiver_cleanup_handler(void *arg) {
     }
   }
 
-  debug(3, "Cancel Timing Requester.");
-  pthread_cancel(conn->timer_requester);
-  int oldState;
-  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
-  debug(3, "Join Timing Requester.");
-  pthread_join(conn->timer_requester, NULL);
-  debug(3, "Timing Receiver Cleanup Successful.");
-  pthread_setcancelstate(oldState, NULL);
+  report_thread_resource_usage("control and timing", conn);
+  session_profile_thread_stop(&conn->profile, SPT_rtp_control);
+  debug(3, "Control and Timing Receiver Cleanup Successful.");
 }
 
-void *rtp_timing_receiver(void *arg) {
-  pthread_cleanup_push(rtp_timing_receiver_cleanup_handler, arg);
+void *rtp_control_and_timing_receiver(void *arg) {
+  perf_counters_thread_start("control and timing");
+  pthread_cleanup_push(rtp_control_and_timing_receiver_cleanup_handler, arg);
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
+  session_profile_thread_start(&conn->profile, SPT_rtp_control);
 
+  conn->reference_timestamp = 0; // nothing valid received yet
   uint8_t packet[2048];
   ssize_t nread;
-  pthread_create(&conn->timer_requester, NULL, &rtp_timing_sender, arg);
+  conn->time_ping_count = 0;
+  uint64_t next_timing_request_time = get_absolute_time_in_ns(); // send the first one right away
+  uint64_t timing_request_number = 0;
   //    struct timespec att;
   uint64_t distant_receive_time, distant_transmit_time, arrival_time, return_time;
   local_to_remote_time_jitter = 0;
@@ -610,7 +1011,7 @@ void *rtp_timing_receiver(void *arg) {
   double stat_mean = 0.0;
   double stat_M2 = 0.0;
 
-  while (1) {
+  while (rtp_wait_for_timing_packet(&next_timing_request_time, &timing_request_number, conn) > 0) {
     nread = recv(conn->timing_socket, packet, sizeof(packet), 0);
 
     if (nread >= 0) {
@@ -622,6 +1023,8 @@ void *rtp_timing_receiver(void *arg) {
         // ssize_t plen = nread;
         // debug(1,"Packet Received on Timing Port.");
         if (packet[1] == 0xd3) { // timing reply
+          if (config.sender_silence_timeout != 0.0)
+            note_sender_sign_of_life(1, conn);
 
           return_time = arrival_time - conn->departure_time;
           debug(3, "clock synchronisation request: return time is %8.3f milliseconds.",
@@ -813,6 +1216,8 @@ void *rtp_timing_receiver(void *arg) {
             }
             // debug(1,"local to remote time gradient is %12.2f ppm, based on %d
             // samples.",conn->local_to_remote_time_gradient*1000000,sample_count);
+            if (config.syncgroup_role == SG_leader)
+              syncgroup_publish_timing_model(conn);
 
           } else {
             debug(1,
@@ -831,18 +1236,20 @@ void *rtp_timing_receiver(void *arg) {
     }
   }
 
-  debug(1, "Timing Receiver RTP thread \"normal\" exit -- this can't happen. Hah!");
-  pthread_cleanup_pop(0); // don't execute anything here.
-  debug(2, "Timing Receiver RTP thread exit.");
+  debug(3, "Connection %d: Control and Timing Receiver RTP thread asked to stop.",
+        conn->connection_number);
+  pthread_cleanup_pop(1);
+  debug(3, "Control and Timing Receiver RTP thread exit.");
   pthread_exit(NULL);
 }
 
 static uint16_t bind_port(int ip_family, const char *self_ip_address, uint32_t scope_id,
-                          int *sock) {
+                          int socket_type, socket_class_type socket_class, int *sock) {
   // look for a port in the range, if any was specified.
   int ret = 0;
 
-  int local_socket = socket(ip_family, SOCK_DGRAM, IPPROTO_UDP);
+  int local_socket =
+      socket(ip_family, socket_type, socket_type == SOCK_STREAM ? IPPROTO_TCP : IPPROTO_UDP);
   if (local_socket == -1)
     die("Could not allocate a socket.");
 
@@ -856,6 +1263,8 @@ static uint16_t bind_port(int ip_family, const char *self_ip_address, uint32_t s
     }
   */
 
+  set_socket_traffic_class(local_socket, ip_family, socket_class);
+
   SOCKADDR myaddr;
   int tryCount = 0;
   uint16_t desired_port;
@@ -890,12 +1299,13 @@ static uint16_t bind_port(int ip_family, const char *self_ip_address, uint32_t s
     close(local_socket);
     char errorstring[1024];
     strerror_r(errno, (char *)errorstring, sizeof(errorstring));
-    die("error %d: \"%s\". Could not bind a UDP port! Check the udp_port_range is large enough -- "
+    die("error %d: \"%s\". Could not bind a %s port! Check the udp_port_range is large enough -- "
         "it must be "
         "at least 3, and 10 or more is suggested -- or "
         "check for restrictive firewall settings or a bad router! UDP base is %u, range is %u and "
         "current suggestion is %u.",
-        errno, errorstring, config.udp_port_base, config.udp_port_range, desired_port);
+        errno, errorstring, socket_type == SOCK_STREAM ? "TCP" : "UDP", config.udp_port_base,
+        config.udp_port_range, desired_port);
   }
 
   uint16_t sport;
@@ -916,6 +1326,65 @@ static uint16_t bind_port(int ip_family, const char *self_ip_address, uint32_t s
   return sport;
 }
 
+// The receive buffer is sized to hold all the packets the source might send in a burst -- up to
+// the latency's worth plus another second, e.g. when it's catching up or when resent packets
+// arrive on top of regular ones -- without the receiver thread having to run.
+// A datagram costs more than its payload in the receive buffer, but the kernel doubles the size
+// requested to allow for that, so this is the nominal allowance for each packet.
+#define RECEIVE_BUFFER_ALLOWANCE_PER_PACKET 1536
+
+static void set_receive_buffer_size(int fd, const char *socket_name, rtsp_conn_info *conn) {
+  char errorstring[1024];
+#ifdef SO_RXQ_OVFL
+  int on = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0) {
+    strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+    debug(1, "error %d: \"%s\" enabling drop counting on the %s socket.", errno, errorstring,
+          socket_name);
+  }
+#endif
+  if (config.udp_receive_buffer_size >= 0) {
+    int desired_size = config.udp_receive_buffer_size;
+    if (desired_size == 0) {
+      uint32_t latency = conn->maximum_latency;
+      if (latency == 0)
+        latency = 88200; // the usual latency
+      unsigned int frames_per_packet = conn->max_frames_per_packet;
+      if (frames_per_packet == 0)
+        frames_per_packet = 352;
+      int packets = (latency + 44100) / frames_per_packet + 1;
+      desired_size = packets * RECEIVE_BUFFER_ALLOWANCE_PER_PACKET;
+    }
+    int actual_size = 0;
+    socklen_t size_length = sizeof(actual_size);
+    getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &actual_size, &size_length);
+    if (actual_size < 2 * desired_size) { // the kernel reports double the size it was given
+      if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &desired_size, sizeof(desired_size)) < 0) {
+        strerror_r(errno, (char *)errorstring, sizeof(errorstring));
+        debug(1, "error %d: \"%s\" setting the receive buffer size of the %s socket.", errno,
+              errorstring, socket_name);
+      }
+      size_length = sizeof(actual_size);
+      getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &actual_size, &size_length);
+#ifdef SO_RCVBUFFORCE
+      // SO_RCVBUF is capped at net.core.rmem_max; SO_RCVBUFFORCE isn't, but needs CAP_NET_ADMIN
+      if ((actual_size < 2 * desired_size) &&
+          (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &desired_size, sizeof(desired_size)) == 0)) {
+        size_length = sizeof(actual_size);
+        getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &actual_size, &size_length);
+      }
+#endif
+      if (actual_size < 2 * desired_size)
+        debug(1,
+              "Connection %d: the %s socket's receive buffer is %d bytes, less than the %d bytes "
+              "requested. Consider increasing net.core.rmem_max.",
+              conn->connection_number, socket_name, actual_size / 2, desired_size);
+    }
+    debug(2, "Connection %d: %s socket receive buffer size is %d bytes.", conn->connection_number,
+          socket_name, actual_size / 2);
+  }
+}
+
 void rtp_setup(SOCKADDR *local, SOCKADDR *remote, uint16_t cport, uint16_t tport,
                rtsp_conn_info *conn) {
 
@@ -1015,12 +1484,26 @@ void rtp_setup(SOCKADDR *local, SOCKADDR *remote, uint16_t cport, uint16_t tport
     conn->remote_control_port = cport;
     conn->remote_timing_port = tport;
 
-    conn->local_control_port = bind_port(conn->connection_ip_family, conn->self_ip_string,
-                                         conn->self_scope_id, &conn->control_socket);
-    conn->local_timing_port = bind_port(conn->connection_ip_family, conn->self_ip_string,
-                                        conn->self_scope_id, &conn->timing_socket);
+    conn->local_control_port =
+        bind_port(conn->connection_ip_family, conn->self_ip_string, conn->self_scope_id,
+                  SOCK_DGRAM, SC_control, &conn->control_socket);
+    conn->local_timing_port =
+        bind_port(conn->connection_ip_family, conn->self_ip_string, conn->self_scope_id,
+                  SOCK_DGRAM, SC_timing, &conn->timing_socket);
     conn->local_audio_port = bind_port(conn->connection_ip_family, conn->self_ip_string,
-                                       conn->self_scope_id, &conn->audio_socket);
+                                       conn->self_scope_id,
+                                       conn->audio_over_tcp ? SOCK_STREAM : SOCK_DGRAM, SC_audio,
+                                       &conn->audio_socket);
+
+    if (conn->audio_over_tcp) {
+      if (listen(conn->audio_socket, 1) < 0)
+        die("Connection %d: can not listen for buffered audio on TCP port %u: %s.",
+            conn->connection_number, conn->local_audio_port, strerror(errno));
+    } else {
+      set_receive_buffer_size(conn->audio_socket, "audio", conn);
+    }
+    // resent audio packets arrive on the control port, so it needs the room too
+    set_receive_buffer_size(conn->control_socket, "control", conn);
 
     debug(3, "listening for audio, control and timing on ports %d, %d, %d.", conn->local_audio_port,
           conn->local_control_port, conn->local_timing_port);
@@ -9,8 +9,8 @@ void rtp_initialise(rtsp_conn_info *conn);
 void rtp_terminate(rtsp_conn_info *conn);
 
 void *rtp_audio_receiver(void *arg);
-void *rtp_control_receiver(void *arg);
-void *rtp_timing_receiver(void *arg);
+void *rtp_buffered_audio_receiver(void *arg);
+void *rtp_control_and_timing_receiver(void *arg);
 
 void rtp_setup(SOCKADDR *local, SOCKADDR *remote, uint16_t controlport, uint16_t timingport,
                rtsp_conn_info *conn);
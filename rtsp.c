@@ -96,6 +96,8 @@ int metadata_running = 0;
 
 // always lock use this when accessing the playing conn value
 static pthread_mutex_t playing_conn_lock = PTHREAD_MUTEX_INITIALIZER;
+// signalled whenever the playing_conn is released, so that a waiting ANNOUNCE can take it at once
+static pthread_cond_t playing_conn_released = PTHREAD_COND_INITIALIZER;
 
 // every time we want to retain or release a reference count, lock it with this
 // if a reference count is read as zero, it means the it's being deallocated.
@@ -310,14 +312,91 @@ int have_player(rtsp_conn_info *conn) {
 
 void player_watchdog_thread_cleanup_handler(void *arg) {
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
+  session_profile_thread_stop(&conn->profile, SPT_watchdog);
   debug(3, "Connection %d: Watchdog Exit.", conn->connection_number);
 }
 
+// the connection's cost profile is reported this often, as well as when the connection ends
+static const uint64_t session_profile_report_interval = 600000000000; // ten minutes
+
+// what the connection is doing, for its cost profile
+static session_profile_state connection_profile_state(rtsp_conn_info *conn) {
+  if ((conn->stop) || (conn->tearing_down))
+    return SPS_tearing_down;
+  if (conn->player_thread == NULL)
+    return SPS_idle;
+  if (conn->player_parked)
+    return SPS_paused;
+  debug_mutex_lock(&conn->watchdog_mutex, 1000, 0);
+  int flowing = (conn->sender_flow_state == SF_flowing);
+  debug_mutex_unlock(&conn->watchdog_mutex, 0);
+  return flowing ? SPS_playing : SPS_paused;
+}
+
+static void sample_session_profile(session_profile_state state, rtsp_conn_info *conn) {
+  if (config.statistics_requested) {
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState); // the profile's mutex is held
+    session_profile_sample(&conn->profile, state, sizeof(rtsp_conn_info));
+    pthread_setcancelstate(oldState, NULL);
+  }
+}
+
+// If the source is being probed because its audio has stopped and nothing at all has come from it
+// for config.sender_silence_timeout, it has gone, so end the session.
+static void check_sender_is_still_there(rtsp_conn_info *conn) {
+  uint64_t silence_limit = (uint64_t)(config.sender_silence_timeout * 1000000000);
+  int sender_has_gone = 0;
+  uint64_t time_since_last_sign_of_life = 0;
+  debug_mutex_lock(&conn->watchdog_mutex, 1000, 0);
+  if (conn->sender_flow_state == SF_probing) {
+    uint64_t time_now = get_absolute_time_in_ns();
+    uint64_t silence_start_time = conn->sender_silence_start_time;
+    if (conn->last_sign_of_life_time > silence_start_time)
+      silence_start_time = conn->last_sign_of_life_time;
+    if ((time_now > silence_start_time) && (time_now - silence_start_time >= silence_limit)) {
+      conn->sender_flow_state = SF_gone;
+      sender_has_gone = 1;
+      time_since_last_sign_of_life = time_now - conn->last_sign_of_life_time;
+    }
+  }
+  debug_mutex_unlock(&conn->watchdog_mutex, 0);
+  if (sender_has_gone) {
+    debug(1,
+          "Connection %d: the source has gone -- nothing has come from it for %.3f seconds -- so "
+          "the session is ending.",
+          conn->connection_number, time_since_last_sign_of_life * 0.000000001);
+    conn->stop = 1;
+    pthread_cancel(conn->thread);
+  }
+}
+
 void *player_watchdog_thread_code(void *arg) {
   pthread_cleanup_push(player_watchdog_thread_cleanup_handler, arg);
   rtsp_conn_info *conn = (rtsp_conn_info *)arg;
+  session_profile_thread_start(&conn->profile, SPT_watchdog);
+  // check every two seconds, or often enough to notice promptly that the source has gone
+  useconds_t check_interval = 2000000;
+  if (config.sender_silence_timeout != 0.0) {
+    check_interval = (useconds_t)(config.sender_silence_timeout * 250000);
+    if (check_interval < 10000)
+      check_interval = 10000;
+    else if (check_interval > 2000000)
+      check_interval = 2000000;
+  }
   do {
-    usleep(2000000); // check every two seconds
+    usleep(check_interval);
+    if (config.sender_silence_timeout != 0.0)
+      check_sender_is_still_there(conn);
+    sample_session_profile(connection_profile_state(conn), conn);
+    if ((config.statistics_requested) &&
+        (get_absolute_time_in_ns() - conn->profile.last_report_time >=
+         session_profile_report_interval)) {
+      int oldState;
+      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+      session_profile_report(&conn->profile, conn->connection_number);
+      pthread_setcancelstate(oldState, NULL);
+    }
     // debug(3, "Connection %d: Check the thread is doing something...", conn->connection_number);
     if ((config.dont_check_timeout == 0) && (config.timeout != 0)) {
       debug_mutex_lock(&conn->watchdog_mutex, 1000, 0);
@@ -854,9 +933,13 @@ int msg_write_response(int fd, rtsp_message *resp) {
 void handle_record(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp) {
   debug(2, "Connection %d: RECORD", conn->connection_number);
   if (have_player(conn)) {
-    if (conn->player_thread)
-      warn("Connection %d: RECORD: Duplicate RECORD message -- ignored", conn->connection_number);
-    else
+    if (conn->player_thread) {
+      if (conn->player_parked)
+        player_unpark(conn); // the player was parked while the session was idle
+      else
+        warn("Connection %d: RECORD: Duplicate RECORD message -- ignored",
+             conn->connection_number);
+    } else
       player_play(conn); // the thread better be 0
 
     resp->respcode = 200;
@@ -916,7 +999,11 @@ void handle_teardown(rtsp_conn_info *conn, __attribute__((unused)) rtsp_message
         3,
         "TEARDOWN: synchronously terminating the player thread of RTSP conversation thread %d (2).",
         conn->connection_number);
+    sample_session_profile(connection_profile_state(conn), conn);
+    conn->tearing_down = 1;
     player_stop(conn);
+    sample_session_profile(SPS_tearing_down, conn);
+    conn->tearing_down = 0;
     debug(3, "TEARDOWN: successful termination of playing thread of RTSP conversation thread %d.",
           conn->connection_number);
   } else {
@@ -1037,6 +1124,9 @@ void handle_setup(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp) {
                    conn->connection_number, conn->remote_control_port, conn->remote_timing_port);
             }
           } else {
+            // the audio can come ahead of time over TCP, if the sender asks and it's enabled
+            conn->audio_over_tcp =
+                (config.buffered_audio_length > 0.0) && (strstr(hdr, "RTP/AVP/TCP") != NULL);
             rtp_setup(&conn->local, &conn->remote, cport, tport, conn);
           }
           if (conn->local_audio_port != 0) {
@@ -1044,10 +1134,11 @@ void handle_setup(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp) {
             char resphdr[256] = "";
             snprintf(resphdr, sizeof(resphdr),
                      "RTP/AVP/"
-                     "UDP;unicast;interleaved=0-1;mode=record;control_port=%d;"
+                     "%s;unicast;interleaved=0-1;mode=record;control_port=%d;"
                      "timing_port=%d;server_"
                      "port=%d",
-                     conn->local_control_port, conn->local_timing_port, conn->local_audio_port);
+                     conn->audio_over_tcp ? "TCP" : "UDP", conn->local_control_port,
+                     conn->local_timing_port, conn->local_audio_port);
 
             msg_add_header(resp, "Transport", resphdr);
 
@@ -1056,10 +1147,10 @@ void handle_setup(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp) {
             resp->respcode = 200; // it all worked out okay
             debug(1,
                   "Connection %d: SETUP DACP-ID \"%s\" from %s to %s with UDP ports Control: "
-                  "%d, Timing: %d and Audio: %d.",
+                  "%d, Timing: %d and %s Audio: %d.",
                   conn->connection_number, conn->dacp_id, &conn->client_ip_string,
                   &conn->self_ip_string, conn->local_control_port, conn->local_timing_port,
-                  conn->local_audio_port);
+                  conn->audio_over_tcp ? "TCP" : "UDP", conn->local_audio_port);
 
           } else {
             debug(1, "Connection %d: SETUP seems to specify a null audio port.",
@@ -1077,8 +1168,10 @@ void handle_setup(rtsp_conn_info *conn, rtsp_message *req, rtsp_message *resp) {
     if (resp->respcode != 200) {
       debug(1, "Connection %d: SETUP error -- releasing the player lock.", conn->connection_number);
       debug_mutex_lock(&playing_conn_lock, 1000000, 3);
-      if (playing_conn == conn) // if we have the player
-        playing_conn = NULL;    // let it go
+      if (playing_conn == conn) { // if we have the player
+        playing_conn = NULL;      // let it go
+        pthread_cond_broadcast(&playing_conn_released);
+      }
       debug_mutex_unlock(&playing_conn_lock, 3);
     }
 
@@ -1992,21 +2085,26 @@ static void handle_announce(rtsp_conn_info *conn, rtsp_message *req, rtsp_messag
   debug_mutex_unlock(&playing_conn_lock, 3);
 
   if (should_wait) {
-    int time_remaining = 3000000; // must be signed, as it could go negative...
-
-    while ((time_remaining > 0) && (have_the_player == 0)) {
-      debug_mutex_lock(&playing_conn_lock, 1000000, 3); // get it
-      if (playing_conn == NULL) {
-        playing_conn = conn;
-        have_the_player = 1;
-      }
-      debug_mutex_unlock(&playing_conn_lock, 3);
-
-      if (have_the_player == 0) {
-        usleep(100000);
-        time_remaining -= 100000;
-      }
+    // wait for up to three seconds for the playing connection to release the player, being woken
+    // as soon as it does. The condition variable uses the realtime clock.
+    uint64_t wait_start_time = get_absolute_time_in_ns();
+    struct timespec time_limit;
+    clock_gettime(CLOCK_REALTIME, &time_limit);
+    time_limit.tv_sec += 3;
+    int oldState;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    debug_mutex_lock(&playing_conn_lock, 1000000, 3); // get it
+    int rc = 0;
+    while ((playing_conn != NULL) && (rc != ETIMEDOUT))
+      rc = pthread_cond_timedwait(&playing_conn_released, &playing_conn_lock, &time_limit);
+    if (playing_conn == NULL) {
+      playing_conn = conn;
+      have_the_player = 1;
     }
+    debug_mutex_unlock(&playing_conn_lock, 3);
+    pthread_setcancelstate(oldState, NULL);
+    debug(2, "Connection %d: waited %.3f milliseconds for the player to be released.",
+          conn->connection_number, (get_absolute_time_in_ns() - wait_start_time) * 0.000001);
 
     if ((have_the_player == 1) && (interrupting_current_session == 1)) {
       debug(2, "Connection %d: ANNOUNCE got the player", conn->connection_number);
@@ -2251,8 +2349,10 @@ out:
     debug(1, "Connection %d: Error in handling ANNOUNCE. Unlocking the play lock.",
           conn->connection_number);
     debug_mutex_lock(&playing_conn_lock, 1000000, 3); // get it
-    if (playing_conn == conn)                         // if we managed to acquire it
+    if (playing_conn == conn) {                       // if we managed to acquire it
       playing_conn = NULL;                            // let it go
+      pthread_cond_broadcast(&playing_conn_released);
+    }
     debug_mutex_unlock(&playing_conn_lock, 3);
   }
 }
@@ -2531,6 +2631,9 @@ void rtsp_conversation_thread_cleanup_function(void *arg) {
 
   debug(3, "Connection %d: rtsp_conversation_thread_func_cleanup_function called.",
         conn->connection_number);
+  if (conn->stop == 0)
+    sample_session_profile(connection_profile_state(conn), conn);
+  conn->tearing_down = 1;
   if (conn->player_thread)
     player_stop(conn);
 
@@ -2586,11 +2689,18 @@ void rtsp_conversation_thread_cleanup_function(void *arg) {
   debug(3, "Delete watchdog mutex.");
   pthread_mutex_destroy(&conn->watchdog_mutex);
 
+  sample_session_profile(SPS_tearing_down, conn);
+  session_profile_thread_stop(&conn->profile, SPT_conversation);
+  if (config.statistics_requested)
+    session_profile_report(&conn->profile, conn->connection_number);
+  session_profile_destroy(&conn->profile);
+
   debug(3, "Connection %d: Checking play lock.", conn->connection_number);
   debug_mutex_lock(&playing_conn_lock, 1000000, 3); // get it
   if (playing_conn == conn) {                       // if it's ours
     debug(3, "Connection %d: Unlocking play lock.", conn->connection_number);
     playing_conn = NULL; // let it go
+    pthread_cond_broadcast(&playing_conn_released);
   }
   debug_mutex_unlock(&playing_conn_lock, 3);
 
@@ -2607,6 +2717,9 @@ void msg_cleanup_function(void *arg) {
 static void *rtsp_conversation_thread_func(void *pconn) {
   rtsp_conn_info *conn = pconn;
 
+  session_profile_init(&conn->profile);
+  session_profile_thread_start(&conn->profile, SPT_conversation);
+
   // create the watchdog mutex, initialise the watchdog time and start the watchdog thread;
   conn->watchdog_bark_time = get_absolute_time_in_ns();
   pthread_mutex_init(&conn->watchdog_mutex, NULL);
@@ -2967,6 +3080,7 @@ void rtsp_listen_loop(void) {
         socklen_t size_of_reply = sizeof(*local_info);
         memset(local_info, 0, sizeof(SOCKADDR));
         if (getsockname(conn->fd, (struct sockaddr *)local_info, &size_of_reply) == 0) {
+          set_socket_traffic_class(conn->fd, local_info->SAFAMILY, SC_rtsp);
 
           // IPv4:
           if (local_info->SAFAMILY == AF_INET) {
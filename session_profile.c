@@ -0,0 +1,180 @@
+/*
+ * Per-session cost profile. This file is part of Shairport Sync.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Senders such as iOS keep a connection open long after they have stopped playing, and each
+// connection keeps threads and buffers. To see what that costs, each of a connection's threads
+// registers itself as it starts, and the connection's watchdog samples them every couple of
+// seconds, attributing the CPU time and wakeups since the previous sample, and the number of
+// threads and the memory held over the interval, to the state the connection is in. On Linux, a
+// thread's CPU time and voluntary context switches -- each a wait that ended -- are read from
+// /proc/self/task; elsewhere, only the time, threads and memory are profiled.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "session_profile.h"
+
+static const char *state_names[SPS_state_count] = {"connected but idle", "paused", "playing",
+                                                   "being torn down"};
+
+#ifdef __linux__
+// returns 0 if the thread's usage could be read
+static int read_thread_usage(pid_t tid, double *cpu_seconds, uint64_t *wakeups) {
+  char path[64];
+  char line[1024];
+  int response = -1;
+  snprintf(path, sizeof(path), "/proc/self/task/%d/stat", (int)tid);
+  FILE *f = fopen(path, "r");
+  if (f) {
+    if (fgets(line, sizeof(line), f)) {
+      char *p = strrchr(line, ')'); // the thread's name is in brackets, and may contain spaces
+      unsigned long utime, stime;
+      if ((p) && (sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime,
+                         &stime) == 2)) {
+        *cpu_seconds = (1.0 * (utime + stime)) / sysconf(_SC_CLK_TCK);
+        response = 0;
+      }
+    }
+    fclose(f);
+  }
+  if (response == 0) {
+    response = -1;
+    snprintf(path, sizeof(path), "/proc/self/task/%d/status", (int)tid);
+    f = fopen(path, "r");
+    if (f) {
+      while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "voluntary_ctxt_switches: %" SCNu64, wakeups) == 1) {
+          response = 0;
+          break;
+        }
+      fclose(f);
+    }
+  }
+  return response;
+}
+#endif
+
+void session_profile_init(session_profile *p) {
+  memset(p, 0, sizeof(session_profile));
+  pthread_mutex_init(&p->mutex, NULL);
+}
+
+void session_profile_destroy(session_profile *p) { pthread_mutex_destroy(&p->mutex); }
+
+void session_profile_thread_start(session_profile *p, session_profile_thread which) {
+  pthread_mutex_lock(&p->mutex);
+  p->running[which] = 1;
+#if defined(__linux__) && defined(SYS_gettid)
+  p->tids[which] = syscall(SYS_gettid);
+#endif
+  pthread_mutex_unlock(&p->mutex);
+}
+
+void session_profile_thread_stop(session_profile *p, session_profile_thread which) {
+  pthread_mutex_lock(&p->mutex);
+#ifdef __linux__
+  double cpu_seconds;
+  uint64_t wakeups;
+  if ((p->tids[which]) && (read_thread_usage(p->tids[which], &cpu_seconds, &wakeups) == 0)) {
+    p->retired_cpu_seconds += cpu_seconds;
+    p->retired_wakeups += wakeups;
+  }
+#endif
+  p->running[which] = 0;
+  p->tids[which] = 0;
+  pthread_mutex_unlock(&p->mutex);
+}
+
+void session_profile_add_memory(session_profile *p, int64_t bytes) {
+  pthread_mutex_lock(&p->mutex);
+  p->memory_held += bytes;
+  pthread_mutex_unlock(&p->mutex);
+}
+
+void session_profile_sample(session_profile *p, session_profile_state state,
+                            size_t fixed_memory) {
+  uint64_t time_now = get_absolute_time_in_ns();
+  pthread_mutex_lock(&p->mutex);
+  double cpu_seconds = p->retired_cpu_seconds;
+  uint64_t wakeups = p->retired_wakeups;
+  int threads = 0;
+  int i;
+  for (i = 0; i < SPT_thread_count; i++)
+    if (p->running[i]) {
+      threads++;
+#ifdef __linux__
+      double thread_cpu_seconds;
+      uint64_t thread_wakeups;
+      if ((p->tids[i]) &&
+          (read_thread_usage(p->tids[i], &thread_cpu_seconds, &thread_wakeups) == 0)) {
+        cpu_seconds += thread_cpu_seconds;
+        wakeups += thread_wakeups;
+      }
+#endif
+    }
+  if (p->last_sample_time != 0) {
+    double interval = (time_now - p->last_sample_time) * 0.000000001;
+    session_profile_totals *t = &p->totals[state];
+    t->seconds += interval;
+    t->thread_seconds += threads * interval;
+    if (cpu_seconds > p->last_cpu_seconds)
+      t->cpu_seconds += cpu_seconds - p->last_cpu_seconds;
+    if (wakeups > p->last_wakeups)
+      t->wakeups += wakeups - p->last_wakeups;
+    t->memory_byte_seconds += (fixed_memory + p->memory_held) * interval;
+  } else {
+    p->last_report_time = time_now;
+  }
+  p->last_sample_time = time_now;
+  p->last_cpu_seconds = cpu_seconds;
+  p->last_wakeups = wakeups;
+  pthread_mutex_unlock(&p->mutex);
+}
+
+void session_profile_report(session_profile *p, int connection_number) {
+  pthread_mutex_lock(&p->mutex);
+  int state;
+  for (state = 0; state < SPS_state_count; state++) {
+    session_profile_totals *t = &p->totals[state];
+    if (t->seconds == 0.0)
+      continue;
+#ifdef __linux__
+    inform("Connection %d: %s for %.1f seconds -- %.1f threads, %.1f wakeups per second, %.3f%% "
+           "CPU, %.0f kilobytes held.",
+           connection_number, state_names[state], t->seconds, t->thread_seconds / t->seconds,
+           t->wakeups / t->seconds, (100.0 * t->cpu_seconds) / t->seconds,
+           t->memory_byte_seconds / (t->seconds * 1024));
+#else
+    inform("Connection %d: %s for %.1f seconds -- %.1f threads, %.0f kilobytes held.",
+           connection_number, state_names[state], t->seconds, t->thread_seconds / t->seconds,
+           t->memory_byte_seconds / (t->seconds * 1024));
+#endif
+  }
+  p->last_report_time = get_absolute_time_in_ns();
+  pthread_mutex_unlock(&p->mutex);
+}
@@ -0,0 +1,62 @@
+#ifndef _SESSION_PROFILE_H
+#define _SESSION_PROFILE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef enum {
+  SPS_idle = 0,      // connected, but with no player -- before RECORD or after TEARDOWN
+  SPS_paused,        // with a player, but the audio has stopped, or the player is parked
+  SPS_playing,       // audio is flowing
+  SPS_tearing_down,  // the player, or the whole connection, is being stopped
+  SPS_state_count
+} session_profile_state;
+
+typedef enum {
+  SPT_conversation = 0, // the RTSP conversation
+  SPT_watchdog,
+  SPT_player,
+  SPT_rtp_audio,
+  SPT_rtp_control,
+  SPT_thread_count
+} session_profile_thread;
+
+typedef struct {
+  double seconds;
+  double thread_seconds;       // the number of threads, integrated over the time in the state
+  double cpu_seconds;
+  uint64_t wakeups;            // voluntary context switches, i.e. waits that ended
+  double memory_byte_seconds;  // the memory held, integrated over the time in the state
+} session_profile_totals;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  int running[SPT_thread_count];
+  pid_t tids[SPT_thread_count]; // for reading the threads' usage, where the system can say
+  double retired_cpu_seconds;   // the usage of threads that have finished
+  uint64_t retired_wakeups;
+  int64_t memory_held;          // buffers, besides the connection record itself
+  uint64_t last_sample_time;    // zero until the first sample
+  double last_cpu_seconds;
+  uint64_t last_wakeups;
+  uint64_t last_report_time;
+  session_profile_totals totals[SPS_state_count];
+} session_profile;
+
+void session_profile_init(session_profile *p);
+void session_profile_destroy(session_profile *p);
+
+// call these on the thread itself, as it starts and as it finishes
+void session_profile_thread_start(session_profile *p, session_profile_thread which);
+void session_profile_thread_stop(session_profile *p, session_profile_thread which);
+
+void session_profile_add_memory(session_profile *p, int64_t bytes); // negative when it's freed
+
+// attribute the usage since the last sample to the given state
+void session_profile_sample(session_profile *p, session_profile_state state,
+                            size_t fixed_memory);
+// report the totals for each state the connection has been in
+void session_profile_report(session_profile *p, int connection_number);
+
+#endif // _SESSION_PROFILE_H
@@ -25,6 +25,7 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
@@ -64,7 +65,9 @@
 #include "audio.h"
 #include "common.h"
 #include "rtp.h"
+#include "local_input.h"
 #include "rtsp.h"
+#include "syncgroup.h"
 
 #if defined(CONFIG_DACP_CLIENT)
 #include "dacp.h"
@@ -277,6 +280,22 @@ void usage(char *progname) {
   audio_ls_outputs();
 }
 
+// convert a DSCP name, e.g. "EF", "AF41" or "CS6", to its value. Returns -1 if not recognised.
+int dscp_from_name(const char *name) {
+  int response = -1;
+  if ((strcasecmp(name, "BE") == 0) || (strcasecmp(name, "default") == 0))
+    response = 0;
+  else if (strcasecmp(name, "EF") == 0)
+    response = 46;
+  else if ((strlen(name) == 3) && (strncasecmp(name, "CS", 2) == 0) && (name[2] >= '0') &&
+           (name[2] <= '7'))
+    response = (name[2] - '0') << 3; // class selector
+  else if ((strlen(name) == 4) && (strncasecmp(name, "AF", 2) == 0) && (name[2] >= '1') &&
+           (name[2] <= '4') && (name[3] >= '1') && (name[3] <= '3'))
+    response = ((name[2] - '0') << 3) | ((name[3] - '0') << 1); // assured forwarding
+  return response;
+}
+
 int parse_options(int argc, char **argv) {
   // there are potential memory leaks here -- it's called a second time, previously allocated
   // strings will dangle.
@@ -397,9 +416,23 @@ int parse_options(int argc, char **argv) {
   config.fixedLatencyOffset = 11025; // this sounds like it works properly.
   config.diagnostic_drop_packet_fraction = 0.0;
   config.active_state_timeout = 10.0;
+  config.sender_silence_timeout = 0.0; // don't end sessions early when the source goes silent
+  config.idle_session_shrink_timeout = 0.0; // keep idle sessions ready to play at once
+  config.adaptive_latency = 0;                // use the sender's latency
+  config.adaptive_latency_minimum = 0.3;
+  config.adaptive_latency_maximum = 2.0;
+  config.adaptive_latency_late_packet_target = 0.001;
+  config.syncgroup_role = SG_none;
+  config.syncgroup_name = "default";
+  config.syncgroup_address = "239.255.83.71";
+  config.syncgroup_port = 5199;
+  config.local_input_socket_path = "/tmp/shairport-sync-local-input";
+  config.local_input_ducking_level = -15.0;
+  config.local_input_ducking_release_time = 0.5;
   config.soxr_delay_threshold = 30; // the soxr measurement time (milliseconds) of two oneshots must
                                     // not exceed this if soxr interpolation is to be chosen
                                     // automatically.
+  config.resampler_quality = RQ_medium; // if the output rate isn't a multiple of the input rate
   config.volume_range_hw_priority =
       0; // if combining software and hardware volume control, give the software priority
          // i.e. when reducing volume, reduce the sw first before reducing the software.
@@ -519,6 +552,157 @@ int parse_options(int argc, char **argv) {
           config.udp_port_range = value;
       }
 
+      /* Get the receive buffer size for the audio and control sockets -- "auto", "default" or a
+       * size in bytes. */
+      if (config_lookup_int(config.cfg, "general.udp_receive_buffer_size", &value)) {
+        if ((value < 4096) || (value > 16777216))
+          die("Invalid udp_receive_buffer_size \"%d\". It should be \"auto\", \"default\" or a "
+              "size in bytes between 4096 and 16777216.",
+              value);
+        else
+          config.udp_receive_buffer_size = value;
+      } else if (config_lookup_string(config.cfg, "general.udp_receive_buffer_size", &str)) {
+        if (strcasecmp(str, "auto") == 0)
+          config.udp_receive_buffer_size = 0;
+        else if (strcasecmp(str, "default") == 0)
+          config.udp_receive_buffer_size = -1;
+        else
+          die("Invalid udp_receive_buffer_size \"%s\". It should be \"auto\", \"default\" or a "
+              "size in bytes between 4096 and 16777216.",
+              str);
+      }
+
+      /* Get the buffered audio setting -- "no" or the number of seconds of audio to hold. */
+      if (config_lookup_float(config.cfg, "general.buffered_audio", &dvalue)) {
+        if ((dvalue < 1.0) || (dvalue > 600.0))
+          die("Invalid buffered_audio \"%f\". It should be \"no\" or a number of seconds "
+              "from 1 to 600.",
+              dvalue);
+        else
+          config.buffered_audio_length = dvalue;
+      } else if (config_lookup_int(config.cfg, "general.buffered_audio", &value)) {
+        if ((value < 1) || (value > 600))
+          die("Invalid buffered_audio \"%d\". It should be \"no\" or a number of seconds "
+              "from 1 to 600.",
+              value);
+        else
+          config.buffered_audio_length = value;
+      } else if (config_lookup_string(config.cfg, "general.buffered_audio", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.buffered_audio_length = 0.0;
+        else
+          die("Invalid buffered_audio \"%s\". It should be \"no\" or a number of seconds "
+              "from 1 to 600.",
+              str);
+      }
+
+      /* Get the adaptive latency settings. */
+      if (config_lookup_string(config.cfg, "general.adaptive_latency", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.adaptive_latency = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.adaptive_latency = 1;
+        else
+          die("Invalid adaptive_latency option choice \"%s\". It should be \"yes\" or \"no\"",
+              str);
+      }
+
+      if (config_lookup_float(config.cfg, "general.adaptive_latency_minimum_in_seconds",
+                              &dvalue)) {
+        if ((dvalue < 0.1) || (dvalue > 5.0))
+          die("Invalid adaptive_latency_minimum_in_seconds \"%f\". It should be between 0.1 and "
+              "5.0 seconds.",
+              dvalue);
+        else
+          config.adaptive_latency_minimum = dvalue;
+      }
+
+      if (config_lookup_float(config.cfg, "general.adaptive_latency_maximum_in_seconds",
+                              &dvalue)) {
+        if ((dvalue < 0.1) || (dvalue > 5.0))
+          die("Invalid adaptive_latency_maximum_in_seconds \"%f\". It should be between 0.1 and "
+              "5.0 seconds.",
+              dvalue);
+        else
+          config.adaptive_latency_maximum = dvalue;
+      }
+
+      if (config.adaptive_latency_maximum < config.adaptive_latency_minimum)
+        die("The adaptive_latency_maximum_in_seconds setting, %f, is less than the "
+            "adaptive_latency_minimum_in_seconds setting, %f.",
+            config.adaptive_latency_maximum, config.adaptive_latency_minimum);
+
+      if (config_lookup_float(config.cfg, "general.adaptive_latency_late_packet_target",
+                              &dvalue)) {
+        if ((dvalue <= 0.0) || (dvalue >= 0.1))
+          die("Invalid adaptive_latency_late_packet_target \"%f\". It should be greater than 0 "
+              "and less than 0.1.",
+              dvalue);
+        else
+          config.adaptive_latency_late_packet_target = dvalue;
+      }
+
+      /* Get the CPU latency bound to request while playing, in microseconds, or "no". */
+      if (config_lookup_int(config.cfg, "general.cpu_latency_bound_in_microseconds", &value)) {
+        if ((value < 0) || (value > 1000000))
+          die("Invalid cpu_latency_bound_in_microseconds \"%d\". It should be \"no\" or a number "
+              "of microseconds between 0 and 1000000.",
+              value);
+        else
+          config.cpu_latency_bound = value;
+      } else if (config_lookup_string(config.cfg, "general.cpu_latency_bound_in_microseconds",
+                                      &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.cpu_latency_bound = -1;
+        else
+          die("Invalid cpu_latency_bound_in_microseconds \"%s\". It should be \"no\" or a number "
+              "of microseconds between 0 and 1000000.",
+              str);
+      }
+
+      /* Get the minimum utilisation, in percent, to clamp the player thread to while playing. */
+      if (config_lookup_int(config.cfg, "general.player_thread_minimum_utilisation", &value)) {
+        if ((value < 0) || (value > 100))
+          die("Invalid player_thread_minimum_utilisation \"%d\". It should be a percentage "
+              "between 0 and 100.",
+              value);
+        else
+          config.player_thread_minimum_utilisation = value;
+      }
+
+      /* Get the DSCP marking and SO_PRIORITY settings for each class of socket, e.g.
+       * "timing_dscp" or "control_socket_priority". The DSCP may be given as a number from 0 to 63
+       * or by name, e.g. "EF", "AF41" or "CS6". */
+      socket_class_type sc;
+      for (sc = SC_audio; sc < SC_number_of_socket_classes; sc++) {
+        char setting_name[64];
+        snprintf(setting_name, sizeof(setting_name), "general.%s_dscp", socket_class_name(sc));
+        if (config_lookup_int(config.cfg, setting_name, &value)) {
+          if ((value < 0) || (value > 63))
+            die("Invalid %s_dscp setting \"%d\". It should be between 0 and 63.",
+                socket_class_name(sc), value);
+          else
+            config.socket_dscp[sc] = value;
+        } else if (config_lookup_string(config.cfg, setting_name, &str)) {
+          int dscp = dscp_from_name(str);
+          if (dscp < 0)
+            die("Invalid %s_dscp setting \"%s\". It should be a number from 0 to 63 or a name "
+                "such as \"BE\", \"EF\", \"CS0\" to \"CS7\" or \"AF11\" to \"AF43\".",
+                socket_class_name(sc), str);
+          else
+            config.socket_dscp[sc] = dscp;
+        }
+        snprintf(setting_name, sizeof(setting_name), "general.%s_socket_priority",
+                 socket_class_name(sc));
+        if (config_lookup_int(config.cfg, setting_name, &value)) {
+          if ((value < 0) || (value > 6)) // 7 and up need CAP_NET_ADMIN
+            die("Invalid %s_socket_priority setting \"%d\". It should be between 0 and 6.",
+                socket_class_name(sc), value);
+          else
+            config.socket_priority[sc] = value;
+        }
+      }
+
       /* Get the password setting. */
       if (config_lookup_string(config.cfg, "general.password", &str))
         config.password = (char *)str;
@@ -553,6 +737,20 @@ int parse_options(int argc, char **argv) {
       }
 #endif
 
+      /* Get the resampler_quality setting. */
+      if (config_lookup_string(config.cfg, "general.resampler_quality", &str)) {
+        if (strcasecmp(str, "low") == 0)
+          config.resampler_quality = RQ_low;
+        else if (strcasecmp(str, "medium") == 0)
+          config.resampler_quality = RQ_medium;
+        else if (strcasecmp(str, "high") == 0)
+          config.resampler_quality = RQ_high;
+        else
+          warn("Invalid general resampler_quality setting option choice \"%s\". It should be "
+               "\"low\", \"medium\" or \"high\". It remains set to \"%s\".",
+               str, resampler_quality_description(config.resampler_quality));
+      }
+
       /* Get the statistics setting. */
       if (config_set_lookup_bool(config.cfg, "general.statistics",
                                  &(config.statistics_requested))) {
@@ -649,6 +847,17 @@ int parse_options(int argc, char **argv) {
               "\"no\"");
       }
 
+      /* Get the performance_counters setting. */
+      if (config_lookup_string(config.cfg, "diagnostics.performance_counters", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.performance_counters = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.performance_counters = 1;
+        else
+          die("Invalid diagnostics performance_counters option choice \"%s\". It should be "
+              "\"yes\" or \"no\"", str);
+      }
+
       /* Get the disable_resend_requests setting. */
       if (config_lookup_string(config.cfg, "diagnostics.disable_resend_requests", &str)) {
         config.disable_resend_requests = 0; // this is for legacy -- only set by -t 0
@@ -795,18 +1004,31 @@ int parse_options(int argc, char **argv) {
 
       /* Get the alac_decoder setting. */
       if (config_lookup_string(config.cfg, "general.alac_decoder", &str)) {
-        if (strcasecmp(str, "hammerton") == 0)
+        if (strcasecmp(str, "hammerton") == 0) {
           config.use_apple_decoder = 0;
-        else if (strcasecmp(str, "apple") == 0) {
-          if ((config.decoders_supported & 1 << decoder_apple_alac) != 0)
+          config.alac_decoder_auto = 0;
+        } else if (strcasecmp(str, "apple") == 0) {
+          if ((config.decoders_supported & 1 << decoder_apple_alac) != 0) {
             config.use_apple_decoder = 1;
-          else
+            config.alac_decoder_auto = 0;
+          } else
             inform("Support for the Apple ALAC decoder has not been compiled into this version of "
                    "Shairport Sync. The default decoder will be used.");
+        } else if (strcasecmp(str, "auto") == 0) {
+          if ((config.decoders_supported & 1 << decoder_apple_alac) != 0)
+            config.alac_decoder_auto = 1;
+          else
+            inform("Support for the Apple ALAC decoder has not been compiled into this version of "
+                   "Shairport Sync, so the \"auto\" alac_decoder setting has no effect.");
         } else
-          die("Invalid alac_decoder option choice \"%s\". It should be \"hammerton\" or \"apple\"");
+          die("Invalid alac_decoder option choice \"%s\". It should be \"hammerton\", \"apple\" "
+              "or \"auto\"",
+              str);
       }
 
+      if (config_lookup_string(config.cfg, "general.alac_decoder_choice_file", &str))
+        config.alac_decoder_choice_file = (char *)str;
+
       /* Get the resend control settings. */
       if (config_lookup_float(config.cfg, "general.resend_control_first_check_time", &dvalue)) {
         if ((dvalue >= 0.0) && (dvalue <= 3.0))
@@ -982,6 +1204,121 @@ int parse_options(int argc, char **argv) {
         config.dont_check_timeout = 0; // this is for legacy -- only set by -t 0
       }
 
+      /* Get the silence, in seconds, after which a source that has stopped sending anything at all
+       * is taken to have gone, or "no". */
+      if (config_lookup_float(config.cfg, "sessioncontrol.sender_silence_timeout", &dvalue)) {
+        if ((dvalue < 0.05) || (dvalue > 120.0))
+          die("Invalid sender_silence_timeout \"%f\". It should be \"no\" or a number of seconds "
+              "between 0.05 and 120.",
+              dvalue);
+        else
+          config.sender_silence_timeout = dvalue;
+      } else if (config_lookup_string(config.cfg, "sessioncontrol.sender_silence_timeout", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.sender_silence_timeout = 0.0;
+        else
+          die("Invalid sender_silence_timeout \"%s\". It should be \"no\" or a number of seconds "
+              "between 0.05 and 120.",
+              str);
+      }
+
+      /* Get the time, in seconds, after which a session whose audio has stopped gives up its
+       * audio buffers and parks its player, or "no". */
+      if (config_lookup_float(config.cfg, "sessioncontrol.idle_session_shrink_timeout", &dvalue)) {
+        if ((dvalue < 1.0) || (dvalue > 3600.0))
+          die("Invalid idle_session_shrink_timeout \"%f\". It should be \"no\" or a number of "
+              "seconds between 1 and 3600.",
+              dvalue);
+        else
+          config.idle_session_shrink_timeout = dvalue;
+      } else if (config_lookup_int(config.cfg, "sessioncontrol.idle_session_shrink_timeout",
+                                   &value)) {
+        if ((value < 1) || (value > 3600))
+          die("Invalid idle_session_shrink_timeout \"%d\". It should be \"no\" or a number of "
+              "seconds between 1 and 3600.",
+              value);
+        else
+          config.idle_session_shrink_timeout = value;
+      } else if (config_lookup_string(config.cfg, "sessioncontrol.idle_session_shrink_timeout",
+                                      &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.idle_session_shrink_timeout = 0.0;
+        else
+          die("Invalid idle_session_shrink_timeout \"%s\". It should be \"no\" or a number of "
+              "seconds between 1 and 3600.",
+              str);
+      }
+
+      /* Get the sync group settings. */
+      if (config_lookup_string(config.cfg, "syncgroup.role", &str)) {
+        if (strcasecmp(str, "none") == 0)
+          config.syncgroup_role = SG_none;
+        else if (strcasecmp(str, "leader") == 0)
+          config.syncgroup_role = SG_leader;
+        else if (strcasecmp(str, "follower") == 0)
+          config.syncgroup_role = SG_follower;
+        else
+          die("Invalid syncgroup role \"%s\". It should be \"none\", \"leader\" or "
+              "\"follower\".",
+              str);
+      }
+
+      if (config_lookup_string(config.cfg, "syncgroup.name", &str)) {
+        if ((strlen(str) == 0) || (strlen(str) > 64))
+          die("Invalid syncgroup name \"%s\". It should be between 1 and 64 characters long.",
+              str);
+        else
+          config.syncgroup_name = (char *)str;
+      }
+
+      if (config_lookup_string(config.cfg, "syncgroup.address", &str)) {
+        struct in_addr group_address;
+        if (inet_aton(str, &group_address) == 0)
+          die("Invalid syncgroup address \"%s\". It should be an IPv4 address.", str);
+        else
+          config.syncgroup_address = (char *)str;
+      }
+
+      if (config_lookup_int(config.cfg, "syncgroup.port", &value)) {
+        if ((value <= 0) || (value > 65535))
+          die("Invalid syncgroup port number \"%d\". It should be between 1 and 65535, default "
+              "is 5199.",
+              value);
+        else
+          config.syncgroup_port = value;
+      }
+
+      /* Get the local input settings. */
+      if (config_lookup_string(config.cfg, "local_input.enabled", &str)) {
+        if (strcasecmp(str, "no") == 0)
+          config.local_input_enabled = 0;
+        else if (strcasecmp(str, "yes") == 0)
+          config.local_input_enabled = 1;
+        else
+          die("Invalid local_input enabled option choice \"%s\". It should be \"yes\" or \"no\".",
+              str);
+      }
+
+      if (config_lookup_string(config.cfg, "local_input.socket_path", &str))
+        config.local_input_socket_path = (char *)str;
+
+      if (config_lookup_float(config.cfg, "local_input.ducking_level", &dvalue)) {
+        if ((dvalue < -96.0) || (dvalue > 0.0))
+          die("Invalid local_input ducking_level \"%f\". It should be between -96.0 and 0.0 dB.",
+              dvalue);
+        else
+          config.local_input_ducking_level = dvalue;
+      }
+
+      if (config_lookup_float(config.cfg, "local_input.ducking_release_time", &dvalue)) {
+        if ((dvalue < 0.01) || (dvalue > 10.0))
+          die("Invalid local_input ducking_release_time \"%f\". It should be between 0.01 and "
+              "10.0 seconds.",
+              dvalue);
+        else
+          config.local_input_ducking_release_time = dvalue;
+      }
+
 #ifdef CONFIG_CONVOLUTION
       if (config_lookup_string(config.cfg, "dsp.convolution", &str)) {
         if (strcasecmp(str, "no") == 0)
@@ -1365,6 +1702,9 @@ void exit_function() {
       metadata_stop(); // close down the metadata pipe
 #endif
 
+      local_input_stop();
+      syncgroup_stop();
+
       activity_monitor_stop(0);
 
       if ((config.output) && (config.output->deinit)) {
@@ -1553,16 +1893,30 @@ int main(int argc, char **argv) {
   config.audio_backend_buffer_desired_length = 0.15; // seconds
   config.udp_port_base = 6001;
   config.udp_port_range = 10;
+  config.udp_receive_buffer_size = 0; // size the audio and control receive buffers automatically
+  config.cpu_latency_bound = -1;      // don't ask for a CPU latency bound while playing
+  config.player_thread_minimum_utilisation = 0; // leave the player thread's utilisation unclamped
+  socket_class_type sc;
+  for (sc = SC_audio; sc < SC_number_of_socket_classes; sc++) {
+    config.socket_dscp[sc] = -1;     // leave the marking at the system default
+    config.socket_priority[sc] = -1; // leave the priority at the system default
+  }
   config.output_format = SPS_FORMAT_S16_LE; // default
   config.output_format_auto_requested = 1;  // default auto select format
   config.output_rate = 44100;               // default
   config.output_rate_auto_requested = 1;    // default auto select format
+  config.output_channels = 2;               // stereo, unless a backend sets up a channel map
   config.decoders_supported =
       1 << decoder_hammerton; // David Hammerton's decoder supported by default
 #ifdef CONFIG_APPLE_ALAC
   config.decoders_supported += 1 << decoder_apple_alac;
   config.use_apple_decoder = 1; // use the ALAC decoder by default if support has been included
+  config.alac_decoder_auto = 1; // but measure both and use the faster one
+#endif
+#ifndef LOCALSTATEDIR
+#define LOCALSTATEDIR "/var"
 #endif
+  config.alac_decoder_choice_file = LOCALSTATEDIR "/lib/shairport-sync/alac_decoder";
 
   // initialise random number generator
 
@@ -1813,6 +2167,7 @@ int main(int argc, char **argv) {
         "deliberately.",
         config.diagnostic_drop_packet_fraction);
   debug(1, "statistics_requester status is %d.", config.statistics_requested);
+  debug(1, "performance counters are %s.", config.performance_counters ? "on" : "off");
 #if CONFIG_LIBDAEMON
   debug(1, "daemon status is %d.", config.daemonise);
   debug(1, "daemon pid file path is \"%s\".", pid_file_proc());
@@ -1820,6 +2175,32 @@ int main(int argc, char **argv) {
   debug(1, "rtsp listening port is %d.", config.port);
   debug(1, "udp base port is %d.", config.udp_port_base);
   debug(1, "udp port range is %d.", config.udp_port_range);
+  if (config.udp_receive_buffer_size == 0)
+    debug(1, "udp receive buffer size is \"auto\".");
+  else if (config.udp_receive_buffer_size < 0)
+    debug(1, "udp receive buffer size is \"default\".");
+  else
+    debug(1, "udp receive buffer size is %d bytes.", config.udp_receive_buffer_size);
+  if (config.buffered_audio_length == 0.0)
+    debug(1, "buffered audio is \"no\".");
+  else
+    debug(1, "buffered audio is %.1f seconds.", config.buffered_audio_length);
+  if (config.adaptive_latency)
+    debug(1, "adaptive latency is on, from %.3f to %.3f seconds, with a late packet target of %f.",
+          config.adaptive_latency_minimum, config.adaptive_latency_maximum,
+          config.adaptive_latency_late_packet_target);
+  else
+    debug(1, "adaptive latency is off.");
+  if (config.cpu_latency_bound < 0)
+    debug(1, "cpu latency bound is \"no\".");
+  else
+    debug(1, "cpu latency bound is %d microseconds.", config.cpu_latency_bound);
+  debug(1, "player thread minimum utilisation is %d%%.", config.player_thread_minimum_utilisation);
+  for (sc = SC_audio; sc < SC_number_of_socket_classes; sc++) {
+    if ((config.socket_dscp[sc] >= 0) || (config.socket_priority[sc] >= 0))
+      debug(1, "%s socket DSCP is %d and SO_PRIORITY is %d.", socket_class_name(sc),
+            config.socket_dscp[sc], config.socket_priority[sc]);
+  }
   debug(1, "player name is \"%s\".", config.service_name);
   debug(1, "backend is \"%s\".", config.output_name);
   debug(1, "run_this_before_play_begins action is \"%s\".", config.cmd_start);
@@ -1836,9 +2217,33 @@ int main(int argc, char **argv) {
         config.packet_stuffing == ST_basic ? "basic"
                                            : config.packet_stuffing == ST_soxr ? "soxr" : "auto");
   debug(1, "interpolation soxr_delay_threshold is %d.", config.soxr_delay_threshold);
+  debug(1, "resampler quality is \"%s\".",
+        resampler_quality_description(config.resampler_quality));
   debug(1, "resync time is %f seconds.", config.resyncthreshold);
   debug(1, "allow a session to be interrupted: %d.", config.allow_session_interruption);
   debug(1, "busy timeout time is %d.", config.timeout);
+  if (config.sender_silence_timeout == 0.0)
+    debug(1, "sender silence timeout is \"no\".");
+  else
+    debug(1, "sender silence timeout is %.3f seconds.", config.sender_silence_timeout);
+  if (config.idle_session_shrink_timeout == 0.0)
+    debug(1, "idle session shrink timeout is \"no\".");
+  else
+    debug(1, "idle session shrink timeout is %.1f seconds.", config.idle_session_shrink_timeout);
+  if (config.syncgroup_role == SG_none)
+    debug(1, "sync group role is \"none\".");
+  else
+    debug(1, "sync group role is \"%s\" in group \"%s\", with announcements on %s:%d.",
+          config.syncgroup_role == SG_leader ? "leader" : "follower", config.syncgroup_name,
+          config.syncgroup_address, config.syncgroup_port);
+  if (config.local_input_enabled)
+    debug(1,
+          "local input is enabled on \"%s\", ducking to %.1f dB with a release time of %.2f "
+          "seconds.",
+          config.local_input_socket_path, config.local_input_ducking_level,
+          config.local_input_ducking_release_time);
+  else
+    debug(1, "local input is disabled.");
   debug(1, "drift tolerance is %f seconds.", config.tolerance);
   debug(1, "password is \"%s\".", config.password);
   debug(1, "ignore_volume_control is %d.", config.ignore_volume_control);
@@ -1864,6 +2269,7 @@ int main(int argc, char **argv) {
         config.output_rate_auto_requested ? "en" : "dis");
   if (config.output_rate_auto_requested == 0)
     debug(1, "output_rate is %d.", config.output_rate);
+  debug(1, "output_channels is %d.", config.output_channels);
   debug(1, "audio backend desired buffer length is %f seconds.",
         config.audio_backend_buffer_desired_length);
   debug(1, "audio_backend_buffer_interpolation_threshold_in_seconds is %f seconds.",
@@ -1877,6 +2283,8 @@ int main(int argc, char **argv) {
   debug(1, "zeroconf regtype is \"%s\".", config.regtype);
   debug(1, "decoders_supported field is %d.", config.decoders_supported);
   debug(1, "use_apple_decoder is %d.", config.use_apple_decoder);
+  debug(1, "alac_decoder_auto is %d.", config.alac_decoder_auto);
+  debug(1, "alac_decoder_choice_file is \"%s\".", config.alac_decoder_choice_file);
   debug(1, "alsa_use_hardware_mute is %d.", config.alsa_use_hardware_mute);
   if (config.interface)
     debug(1, "mdns service interface \"%s\" requested.", config.interface);
@@ -1965,6 +2373,9 @@ int main(int argc, char **argv) {
   dacp_monitor_start();
 #endif
 
+  syncgroup_start();
+  local_input_start();
+
 #if defined(CONFIG_DBUS_INTERFACE) || defined(CONFIG_MPRIS_INTERFACE)
   // Start up DBUS services after initial settings are all made
   // debug(1, "Starting up D-Bus services");
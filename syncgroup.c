@@ -0,0 +1,507 @@
+/*
+ * Sync groups. This file is part of Shairport Sync.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Several instances of Shairport Sync playing from the same source each time their output from
+// their own estimate of the source's clock. Those estimates are made separately, over separate
+// network paths, so the instances are only as well aligned with one another as their estimates
+// happen to agree.
+
+// In a sync group, one instance -- the leader -- announces its estimate: a time on its own clock,
+// the difference between the source's clock and its own at that time, and the rate at which that
+// difference is changing. The others -- the followers -- measure the offset between the leader's
+// clock and their own with NTP-style pings and, while they are playing from the same source as
+// the leader, use the leader's estimate in place of their own. They are then aligned with the
+// leader to within the accuracy of the offset measurement, which on a LAN is usually a few tens of
+// microseconds.
+
+// All fields are in network byte order. Every packet starts with "SPSG", a version byte, a type
+// byte and two reserved bytes. An announcement continues with the leader's measurement time, the
+// remote-minus-local difference at that time, the drift in parts per trillion, then the group name
+// and the source's address, each as a length byte followed by the characters.
+// A ping carries the follower's send time; the reply echoes it and adds the leader's receive and
+// send times.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "player.h"
+#include "syncgroup.h"
+
+#define SYNCGROUP_VERSION 1
+#define SYNCGROUP_HEADER_LENGTH 8
+#define SYNCGROUP_ID_LENGTH 64 // group names and source addresses are limited to this
+#define SYNCGROUP_PING_HISTORY 8
+
+enum syncgroup_packet_type { SG_announcement = 1, SG_ping, SG_ping_reply };
+
+static const uint64_t announcement_interval = 250000000; // 250 milliseconds
+static const uint64_t ping_interval = 100000000;         // 100 milliseconds
+// the leader's model is updated with every timing reply, normally every three seconds, so it's
+// not announced once it's older than this
+static const uint64_t model_lifetime = 10000000000;
+// a follower stops following a leader that hasn't been heard from for this long
+static const uint64_t leader_lifetime = 2000000000;
+// the rate at which the leader's clock drifts from ours is measured over at least this long
+static const uint64_t drift_baseline = 10000000000;
+
+typedef struct {
+  uint64_t measurement_time; // on the leader's clock
+  uint64_t difference;       // remote time minus the leader's local time at measurement_time
+  double gradient;           // remote time elapsed per unit of the leader's local time elapsed
+  char source[SYNCGROUP_ID_LENGTH + 1];
+  uint64_t time_of_update; // on our own clock; zero if there is no model
+} syncgroup_timing_model;
+
+typedef struct {
+  uint64_t time; // when the reply arrived, on our clock
+  uint64_t round_trip_time;
+  uint64_t offset; // the leader's clock minus ours, modulo 2^64
+} syncgroup_ping_record;
+
+static pthread_mutex_t syncgroup_mutex = PTHREAD_MUTEX_INITIALIZER;
+// everything from here to syncgroup_following is protected by syncgroup_mutex
+static syncgroup_timing_model timing_model; // our own if leading, the leader's if following
+static int leader_clock_offset_valid;
+static uint64_t leader_clock_offset;      // the leader's clock minus ours, modulo 2^64
+static uint64_t leader_clock_offset_time; // when it was measured, on our clock
+static double leader_clock_drift;         // how fast the offset is changing
+static int syncgroup_following;      // just for reporting changes
+
+static pthread_t syncgroup_thread;
+static int syncgroup_running = 0;
+static int syncgroup_fd = -1;
+static int syncgroup_ping_fd = -1;
+static struct sockaddr_in group_address; // where announcements are sent
+
+static void put_uint64(uint8_t *p, uint64_t v) {
+  int i;
+  for (i = 0; i < 8; i++)
+    p[i] = (v >> (56 - 8 * i)) & 0xff;
+}
+
+static uint64_t get_uint64(const uint8_t *p) {
+  uint64_t v = 0;
+  int i;
+  for (i = 0; i < 8; i++)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static size_t put_header(uint8_t *p, enum syncgroup_packet_type type) {
+  memcpy(p, "SPSG", 4);
+  p[4] = SYNCGROUP_VERSION;
+  p[5] = type;
+  p[6] = 0;
+  p[7] = 0;
+  return SYNCGROUP_HEADER_LENGTH;
+}
+
+// returns the packet type, or zero if it isn't a sync group packet we understand
+static int check_header(const uint8_t *p, ssize_t length) {
+  if ((length < SYNCGROUP_HEADER_LENGTH) || (memcmp(p, "SPSG", 4) != 0) ||
+      (p[4] != SYNCGROUP_VERSION))
+    return 0;
+  return p[5];
+}
+
+// put a length byte followed by the string; returns the number of bytes used
+static size_t put_string(uint8_t *p, const char *s) {
+  size_t length = strnlen(s, SYNCGROUP_ID_LENGTH);
+  p[0] = length;
+  memcpy(p + 1, s, length);
+  return length + 1;
+}
+
+// get a string into s, which must have room for SYNCGROUP_ID_LENGTH + 1 bytes; returns the number
+// of bytes used, or zero if the string runs past the end of the packet
+static size_t get_string(char *s, const uint8_t *p, const uint8_t *end) {
+  if (p >= end)
+    return 0;
+  size_t length = p[0];
+  if ((length > SYNCGROUP_ID_LENGTH) || (p + 1 + length > end))
+    return 0;
+  memcpy(s, p + 1, length);
+  s[length] = '\0';
+  return length + 1;
+}
+
+int syncgroup_local_to_remote_time_difference(uint64_t time_now, uint64_t *difference,
+                                              rtsp_conn_info *conn) {
+  int response = -1;
+  pthread_mutex_lock(&syncgroup_mutex);
+  // time_now may be a little earlier than an update just made by the sync group thread
+  if ((leader_clock_offset_valid) && (timing_model.time_of_update) &&
+      ((int64_t)(time_now - timing_model.time_of_update) < (int64_t)leader_lifetime) &&
+      (strcmp(timing_model.source, conn->client_ip_string) == 0)) {
+    uint64_t offset =
+        leader_clock_offset +
+        (int64_t)(leader_clock_drift * (int64_t)(time_now - leader_clock_offset_time));
+    // the leader's difference now, on its own clock, then moved onto ours
+    int64_t elapsed = (time_now + offset) - timing_model.measurement_time;
+    *difference =
+        timing_model.difference + (int64_t)((timing_model.gradient - 1.0) * elapsed) + offset;
+    response = 0;
+  }
+  if ((response == 0) != (syncgroup_following != 0)) {
+    syncgroup_following = (response == 0);
+    if (syncgroup_following)
+      debug(1, "Connection %d: following the sync group leader's timing.",
+            conn->connection_number);
+    else
+      debug(1, "Connection %d: using its own timing.", conn->connection_number);
+  }
+  pthread_mutex_unlock(&syncgroup_mutex);
+  return response;
+}
+
+// Receive a datagram and the time it arrived, on our clock. Where the kernel can timestamp
+// datagrams as they arrive, that time is used, so that the time this thread takes to wake up isn't
+// taken for network delay -- it can be tens of microseconds, and it's longer on an idle leader
+// than on a follower that has just sent a ping. The kernel's timestamps are on CLOCK_REALTIME, so
+// the timestamp's age on that clock is taken off the time now on ours.
+static ssize_t syncgroup_receive(int fd, void *buf, size_t len, struct sockaddr_in *from,
+                                 uint64_t *time_of_arrival) {
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = from;
+  msg.msg_namelen = sizeof(*from);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+#ifdef SO_TIMESTAMPNS
+  char control[CMSG_SPACE(sizeof(struct timespec))];
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+#endif
+  ssize_t nread = recvmsg(fd, &msg, 0);
+  *time_of_arrival = get_absolute_time_in_ns();
+#ifdef SO_TIMESTAMPNS
+  if (nread >= 0) {
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPNS)) {
+        struct timespec arrival, now;
+        memcpy(&arrival, CMSG_DATA(cmsg), sizeof(arrival));
+        clock_gettime(CLOCK_REALTIME, &now);
+        int64_t age = (now.tv_sec - arrival.tv_sec) * (int64_t)1000000000 +
+                      (now.tv_nsec - arrival.tv_nsec);
+        if ((age >= 0) && (age < 1000000000)) // ignore it if the real time clock has been stepped
+          *time_of_arrival -= age;
+      }
+    }
+  }
+#endif
+  return nread;
+}
+
+static int syncgroup_open_socket(uint16_t port) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    warn("Sync group: can not open a socket: %s.", strerror(errno));
+    return -1;
+  }
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_TIMESTAMPNS
+  setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+#endif
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    warn("Sync group: can not bind to port %u: %s.", port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void syncgroup_announce(int fd, struct sockaddr_in *group, uint64_t time_now) {
+  syncgroup_timing_model model;
+  pthread_mutex_lock(&syncgroup_mutex);
+  model = timing_model;
+  pthread_mutex_unlock(&syncgroup_mutex);
+  if ((model.time_of_update == 0) || (time_now - model.time_of_update > model_lifetime))
+    return;
+  uint8_t packet[SYNCGROUP_HEADER_LENGTH + 24 + 2 * (SYNCGROUP_ID_LENGTH + 1)];
+  uint8_t *p = packet + put_header(packet, SG_announcement);
+  put_uint64(p, model.measurement_time);
+  put_uint64(p + 8, model.difference);
+  put_uint64(p + 16, (uint64_t)llrint((model.gradient - 1.0) * 1.0E12));
+  p += 24;
+  p += put_string(p, config.syncgroup_name);
+  p += put_string(p, model.source);
+  if (sendto(fd, packet, p - packet, 0, (struct sockaddr *)group, sizeof(*group)) < 0)
+    debug(2, "Sync group: error sending an announcement: %s.", strerror(errno));
+}
+
+void syncgroup_publish_timing_model(rtsp_conn_info *conn) {
+  uint64_t time_now = get_absolute_time_in_ns();
+  pthread_mutex_lock(&syncgroup_mutex);
+  timing_model.measurement_time = conn->local_to_remote_time_difference_measurement_time;
+  timing_model.difference = conn->local_to_remote_time_difference;
+  timing_model.gradient = conn->local_to_remote_time_gradient;
+  snprintf(timing_model.source, sizeof(timing_model.source), "%s", conn->client_ip_string);
+  timing_model.time_of_update = time_now;
+  pthread_mutex_unlock(&syncgroup_mutex);
+  // announce it straight away rather than at the next regular announcement -- otherwise the
+  // followers would be using the old model while we use the new one
+  if (syncgroup_fd >= 0)
+    syncgroup_announce(syncgroup_fd, &group_address, time_now);
+}
+
+static void syncgroup_answer_ping(int fd) {
+  uint8_t packet[64];
+  struct sockaddr_in from;
+  uint64_t time_of_receipt;
+  ssize_t nread = syncgroup_receive(fd, packet, sizeof(packet), &from, &time_of_receipt);
+  if ((check_header(packet, nread) == SG_ping) && (nread == SYNCGROUP_HEADER_LENGTH + 8)) {
+    uint8_t reply[SYNCGROUP_HEADER_LENGTH + 24];
+    uint8_t *p = reply + put_header(reply, SG_ping_reply);
+    memcpy(p, packet + SYNCGROUP_HEADER_LENGTH, 8); // echo the follower's send time
+    put_uint64(p + 8, time_of_receipt);
+    put_uint64(p + 16, get_absolute_time_in_ns());
+    if (sendto(fd, reply, sizeof(reply), 0, (struct sockaddr *)&from, sizeof(from)) < 0)
+      debug(2, "Sync group: error replying to a ping: %s.", strerror(errno));
+  }
+}
+
+static void syncgroup_lead(struct sockaddr_in *group) {
+  // announcements go from an ephemeral port, so pings can come straight back to it
+  syncgroup_fd = syncgroup_open_socket(0);
+  if (syncgroup_fd < 0)
+    return;
+  int on = 1;
+  setsockopt(syncgroup_fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+  uint64_t next_announcement_time = get_absolute_time_in_ns();
+  while (1) {
+    uint64_t time_now = get_absolute_time_in_ns();
+    if (time_now >= next_announcement_time) {
+      syncgroup_announce(syncgroup_fd, group, time_now);
+      next_announcement_time = time_now + announcement_interval;
+    }
+    struct pollfd pfd = {syncgroup_fd, POLLIN, 0};
+    int timeout_ms = (next_announcement_time - time_now) / 1000000 + 1;
+    if (poll(&pfd, 1, timeout_ms) > 0)
+      syncgroup_answer_ping(syncgroup_fd);
+  }
+}
+
+static void syncgroup_forget_leader(void) {
+  pthread_mutex_lock(&syncgroup_mutex);
+  leader_clock_offset_valid = 0;
+  timing_model.time_of_update = 0;
+  pthread_mutex_unlock(&syncgroup_mutex);
+}
+
+static void syncgroup_follow(struct sockaddr_in *group) {
+  syncgroup_fd = syncgroup_open_socket(config.syncgroup_port);
+  if (syncgroup_fd < 0)
+    return;
+  if (IN_MULTICAST(ntohl(group->sin_addr.s_addr))) {
+    struct ip_mreq membership;
+    membership.imr_multiaddr = group->sin_addr;
+    membership.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(syncgroup_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership,
+                   sizeof(membership)) < 0)
+      warn("Sync group: can not join the multicast group %s: %s.", config.syncgroup_address,
+           strerror(errno));
+  }
+  syncgroup_ping_fd = syncgroup_open_socket(0);
+  if (syncgroup_ping_fd < 0)
+    return;
+
+  struct sockaddr_in leader;
+  int leader_known = 0;
+  uint64_t time_leader_last_heard = 0;
+  uint64_t next_ping_time = 0;
+  syncgroup_ping_record pings[SYNCGROUP_PING_HISTORY];
+  unsigned int ping_count = 0;
+  syncgroup_ping_record drift_reference = {0, 0, 0};
+  double drift = 0.0;
+
+  while (1) {
+    uint64_t time_now = get_absolute_time_in_ns();
+    if ((leader_known) && (time_now - time_leader_last_heard >= leader_lifetime)) {
+      debug(1, "Sync group: the leader at %s has gone quiet.", inet_ntoa(leader.sin_addr));
+      leader_known = 0;
+      syncgroup_forget_leader();
+    }
+    int timeout_ms = ping_interval / 1000000;
+    if (leader_known) {
+      if (time_now >= next_ping_time) {
+        uint8_t ping[SYNCGROUP_HEADER_LENGTH + 8];
+        put_uint64(ping + put_header(ping, SG_ping), get_absolute_time_in_ns());
+        if (sendto(syncgroup_ping_fd, ping, sizeof(ping), 0, (struct sockaddr *)&leader,
+                   sizeof(leader)) < 0)
+          debug(2, "Sync group: error sending a ping: %s.", strerror(errno));
+        next_ping_time = time_now + ping_interval;
+      }
+      timeout_ms = (next_ping_time - time_now) / 1000000 + 1;
+    }
+
+    struct pollfd pfd[2] = {{syncgroup_fd, POLLIN, 0}, {syncgroup_ping_fd, POLLIN, 0}};
+    if (poll(pfd, 2, timeout_ms) <= 0)
+      continue;
+
+    uint8_t packet[SYNCGROUP_HEADER_LENGTH + 24 + 2 * (SYNCGROUP_ID_LENGTH + 1)];
+    struct sockaddr_in from;
+    uint64_t time_of_receipt;
+
+    if (pfd[0].revents & POLLIN) {
+      ssize_t nread =
+          syncgroup_receive(syncgroup_fd, packet, sizeof(packet), &from, &time_of_receipt);
+      char name[SYNCGROUP_ID_LENGTH + 1];
+      syncgroup_timing_model model;
+      const uint8_t *p = packet + SYNCGROUP_HEADER_LENGTH + 24;
+      const uint8_t *end = packet + nread;
+      size_t name_length, source_length;
+      if ((check_header(packet, nread) == SG_announcement) &&
+          (nread > SYNCGROUP_HEADER_LENGTH + 24) && ((name_length = get_string(name, p, end))) &&
+          ((source_length = get_string(model.source, p + name_length, end))) &&
+          (strcmp(name, config.syncgroup_name) == 0)) {
+        if ((leader_known == 0) || (from.sin_addr.s_addr != leader.sin_addr.s_addr) ||
+            (from.sin_port != leader.sin_port)) {
+          debug(1, "Sync group: following the leader at %s:%u.", inet_ntoa(from.sin_addr),
+                ntohs(from.sin_port));
+          leader = from;
+          leader_known = 1;
+          ping_count = 0;
+          next_ping_time = 0;
+          syncgroup_forget_leader();
+        }
+        time_leader_last_heard = time_of_receipt;
+        model.measurement_time = get_uint64(packet + SYNCGROUP_HEADER_LENGTH);
+        model.difference = get_uint64(packet + SYNCGROUP_HEADER_LENGTH + 8);
+        model.gradient =
+            1.0 + (int64_t)get_uint64(packet + SYNCGROUP_HEADER_LENGTH + 16) * 1.0E-12;
+        model.time_of_update = time_leader_last_heard;
+        pthread_mutex_lock(&syncgroup_mutex);
+        timing_model = model;
+        pthread_mutex_unlock(&syncgroup_mutex);
+      }
+    }
+
+    if (pfd[1].revents & POLLIN) {
+      ssize_t nread =
+          syncgroup_receive(syncgroup_ping_fd, packet, sizeof(packet), &from, &time_of_receipt);
+      if ((leader_known) && (from.sin_addr.s_addr == leader.sin_addr.s_addr) &&
+          (from.sin_port == leader.sin_port) && (check_header(packet, nread) == SG_ping_reply) &&
+          (nread == SYNCGROUP_HEADER_LENGTH + 24)) {
+        uint64_t t1 = get_uint64(packet + SYNCGROUP_HEADER_LENGTH);
+        uint64_t t2 = get_uint64(packet + SYNCGROUP_HEADER_LENGTH + 8);
+        uint64_t t3 = get_uint64(packet + SYNCGROUP_HEADER_LENGTH + 16);
+        uint64_t t4 = time_of_receipt;
+        syncgroup_ping_record *record = &pings[ping_count % SYNCGROUP_PING_HISTORY];
+        record->time = t4;
+        record->round_trip_time = (t4 - t1) - (t3 - t2);
+        record->offset = ((int64_t)(t2 - t1) + (int64_t)(t3 - t4)) / 2;
+        ping_count++;
+
+        // as with the source's timing pings, the quickest round trip is the least distorted
+        unsigned int i, count = ping_count < SYNCGROUP_PING_HISTORY ? ping_count
+                                                                    : SYNCGROUP_PING_HISTORY;
+        syncgroup_ping_record *best = &pings[0];
+        for (i = 1; i < count; i++)
+          if (pings[i].round_trip_time < best->round_trip_time)
+            best = &pings[i];
+        // the best record may be most of a second old, and two clocks can easily drift apart by
+        // 50 microseconds in that time, so extrapolate from it at the measured rate of drift
+        if (ping_count == 1) {
+          drift_reference = *best;
+          drift = 0.0;
+        } else if (best->time - drift_reference.time >= drift_baseline) {
+          drift = (1.0 * (int64_t)(best->offset - drift_reference.offset)) /
+                  (best->time - drift_reference.time);
+          drift_reference = *best;
+        }
+        pthread_mutex_lock(&syncgroup_mutex);
+        leader_clock_offset = best->offset;
+        leader_clock_offset_time = best->time;
+        leader_clock_drift = drift;
+        leader_clock_offset_valid = 1;
+        pthread_mutex_unlock(&syncgroup_mutex);
+      }
+    }
+  }
+}
+
+static void syncgroup_thread_cleanup_handler(__attribute__((unused)) void *arg) {
+  if (syncgroup_ping_fd >= 0)
+    close(syncgroup_ping_fd);
+  syncgroup_ping_fd = -1;
+  if (syncgroup_fd >= 0)
+    close(syncgroup_fd);
+  syncgroup_fd = -1;
+  syncgroup_forget_leader();
+}
+
+static void *syncgroup_thread_code(__attribute__((unused)) void *arg) {
+  pthread_cleanup_push(syncgroup_thread_cleanup_handler, NULL);
+  if (config.syncgroup_role == SG_leader)
+    syncgroup_lead(&group_address);
+  else
+    syncgroup_follow(&group_address);
+  pthread_cleanup_pop(1);
+  pthread_exit(NULL);
+}
+
+void syncgroup_start(void) {
+  if (config.syncgroup_role != SG_none) {
+    memset(&group_address, 0, sizeof(group_address));
+    group_address.sin_family = AF_INET;
+    group_address.sin_addr.s_addr = inet_addr(config.syncgroup_address);
+    group_address.sin_port = htons(config.syncgroup_port);
+    if (pthread_create(&syncgroup_thread, NULL, syncgroup_thread_code, NULL) == 0)
+      syncgroup_running = 1;
+    else
+      debug(1, "Failed to create the sync group thread!");
+  }
+}
+
+void syncgroup_stop(void) {
+  if (syncgroup_running) {
+    debug(2, "Stopping the sync group thread.");
+    pthread_cancel(syncgroup_thread);
+    pthread_join(syncgroup_thread, NULL);
+    syncgroup_running = 0;
+  }
+}
@@ -0,0 +1,20 @@
+#ifndef _SYNCGROUP_H
+#define _SYNCGROUP_H
+
+#include <stdint.h>
+
+#include "player.h"
+
+void syncgroup_start(void);
+void syncgroup_stop(void);
+
+// leader: announce the session's current model of the source's clock
+void syncgroup_publish_timing_model(rtsp_conn_info *conn);
+
+// follower: if the leader is playing from the same source as this session and its clock offset is
+// known, set difference to the leader's local-to-remote time difference, translated into our
+// local time, and return 0
+int syncgroup_local_to_remote_time_difference(uint64_t time_now, uint64_t *difference,
+                                              rtsp_conn_info *conn);
+
+#endif // _SYNCGROUP_H
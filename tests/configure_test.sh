@@ -133,6 +133,9 @@ check_for_success x$1 --without-stdout --with-ssl=mbedtls x stdout
 check_for_success x$1 --with-pipe --with-ssl=mbedtls pipe
 check_for_success x$1 --without-pipe --with-ssl=mbedtls x pipe
 
+check_for_success x$1 --with-chunk --with-ssl=mbedtls chunk
+check_for_success x$1 --without-chunk --with-ssl=mbedtls x chunk
+
 check_for_success x$1 --with-external-mdns --with-ssl=mbedtls external_mdns
 check_for_success x$1 --without-external-mdns --with-ssl=mbedtls x external_mdns
 
@@ -176,6 +179,12 @@ check_for_success x$1 --without-pa --with-ssl=mbedtls x pa
 check_for_success x$1 --with-convolution --with-ssl=mbedtls convolution
 check_for_success x$1 --without-convolution --with-ssl=mbedtls x convolution
 
+check_for_success x$1 --with-fixed-point --with-ssl=mbedtls fixed-point
+check_for_success x$1 --without-fixed-point --with-ssl=mbedtls x fixed-point
+
+check_for_success x$1 --with-usdt --with-ssl=mbedtls usdt
+check_for_success x$1 --without-usdt --with-ssl=mbedtls x usdt
+
 check_for_success x$1 --with-dns_sd --with-ssl=mbedtls dns_sd
 check_for_success x$1 --without-dns_sd --with-ssl=mbedtls x dns_sd
 
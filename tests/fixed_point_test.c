@@ -0,0 +1,249 @@
+// Checks the integer DSP used in --with-fixed-point builds against floating point, and reports the
+// cost per frame of each. Built and run by "make check"; it exits with a non-zero status if
+// anything is out of tolerance.
+//
+// In a fixed-point build, the loudness filter is built both ways, so the same input is run through
+// each and both are compared with a double precision filter using the same coefficients. The root
+// mean square difference must be below -110 dB of full scale for the fixed-point filter and below
+// -90 dB, about a third of a 16-bit step, for the float one.
+//
+// The resampler is built one way or the other, so whichever is built is compared with a double
+// precision resampler using its own coefficients. Every output sample must be within -120 dB of
+// full scale of it. Running "make check" in a fixed-point and in an ordinary build covers both.
+//
+// The input is 20 Hz and 1 kHz tones with noise, 16-bit audio in the top of an int32_t, as the
+// player has it, in packets of 352 frames.
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "loudness.h"
+#include "resampler.h"
+
+#define TEST_FRAMES 441000 // ten seconds
+#define TEST_PACKET_FRAMES 352
+
+// the test is linked with loudness.c and resampler.c only, so it supplies what they use
+shairport_cfg config;
+
+void _debug(__attribute__((unused)) const char *filename,
+            __attribute__((unused)) const int linenumber, __attribute__((unused)) int level,
+            __attribute__((unused)) const char *format, ...) {}
+
+static int failures = 0;
+
+static double time_now(void) {
+  struct timespec tn;
+  clock_gettime(CLOCK_MONOTONIC, &tn);
+  return tn.tv_sec + tn.tv_nsec * 0.000000001;
+}
+
+static int32_t saturate(double sample) {
+  if (sample >= 2147483647.0)
+    return INT32_MAX;
+  if (sample <= -2147483648.0)
+    return INT32_MIN;
+  return (int32_t)lrint(sample);
+}
+
+// 20 Hz and 1 kHz at -12 dB each and noise at -40 dB
+static void make_input(int32_t *input, int frames) {
+  uint32_t random_state = 12345;
+  int i;
+  for (i = 0; i < frames; i++) {
+    random_state = random_state * 1664525 + 1013904223;
+    double noise = ((int32_t)random_state) / 2147483648.0;
+    double t = (double)i / 44100;
+    double sample = 0.25 * sin(2 * M_PI * 20 * t) + 0.25 * sin(2 * M_PI * 1000 * t) + 0.01 * noise;
+    int16_t sample16 = (int16_t)lrint(sample * 32767);
+    input[2 * i] = sample16 * 65536;
+    input[2 * i + 1] = -sample16 * 65536;
+  }
+}
+
+// the root mean square difference from the reference, in dB of full scale
+static double rms_error_db(const int32_t *output, const double *reference, int count) {
+  double noise = 0.0;
+  int i;
+  for (i = 0; i < count; i++)
+    noise += (output[i] - reference[i]) * (output[i] - reference[i]);
+  if (noise == 0.0)
+    return -999.0;
+  return 10 * log10(noise / count) - 20 * log10(2147483648.0);
+}
+
+static void check_loudness(const int32_t *input, float volume) {
+  int32_t *float_output = malloc(sizeof(int32_t) * TEST_FRAMES);
+  int32_t *attenuated_input = malloc(sizeof(int32_t) * TEST_FRAMES);
+  double *reference = malloc(sizeof(double) * TEST_FRAMES);
+  if ((float_output == NULL) || (attenuated_input == NULL) || (reference == NULL)) {
+    fprintf(stderr, "can not allocate memory for the loudness test.\n");
+    exit(EXIT_FAILURE);
+  }
+  loudness_set_volume(volume);
+  loudness_processor p = loudness_l;
+
+  // the volume is applied first, as the player does, so that the boost doesn't saturate
+  int32_t fix_volume = (int32_t)(65536.0 * pow(10.0, volume / 20.0));
+  int i;
+  for (i = 0; i < TEST_FRAMES; i++)
+    attenuated_input[i] = ((int64_t)input[2 * i] * fix_volume) >> 16;
+  input = attenuated_input;
+
+  // the reference, in double precision with the float filter's coefficients
+  double i1 = 0.0, i2 = 0.0, o1 = 0.0, o2 = 0.0;
+  for (i = 0; i < TEST_FRAMES; i++) {
+    double i0 = input[i];
+    double o0 = (double)p.a0 * i0 + (double)p.a1 * i1 + (double)p.a2 * i2 - (double)p.b1 * o1 -
+                (double)p.b2 * o2;
+    o2 = o1;
+    o1 = o0;
+    i2 = i1;
+    i1 = i0;
+    reference[i] = o0;
+  }
+
+  double start = time_now();
+  for (i = 0; i < TEST_FRAMES; i++)
+    float_output[i] = saturate(loudness_process(&p, (float)input[i]));
+  double float_time = time_now() - start;
+  double float_error = rms_error_db(float_output, reference, TEST_FRAMES);
+  printf("loudness at %.0f dB: float %.1f dB, %.1f ns per sample", volume, float_error,
+         float_time * 1000000000 / TEST_FRAMES);
+  if (float_error > -90.0)
+    failures++;
+
+#ifdef CONFIG_FIXED_POINT
+  int32_t *fixed_output = malloc(sizeof(int32_t) * TEST_FRAMES);
+  if (fixed_output == NULL) {
+    fprintf(stderr, "can not allocate memory for the loudness test.\n");
+    exit(EXIT_FAILURE);
+  }
+  p = loudness_l;
+  start = time_now();
+  for (i = 0; i < TEST_FRAMES; i++)
+    fixed_output[i] = loudness_process_fixed(&p, input[i]);
+  double fixed_time = time_now() - start;
+  double fixed_error = rms_error_db(fixed_output, reference, TEST_FRAMES);
+  printf("; fixed point %.1f dB, %.1f ns per sample", fixed_error,
+         fixed_time * 1000000000 / TEST_FRAMES);
+  if (fixed_error > -110.0)
+    failures++;
+  free(fixed_output);
+#endif
+  printf(".\n");
+  free(attenuated_input);
+  free(float_output);
+  free(reference);
+}
+
+static void check_resampler(const int32_t *input, unsigned int output_rate,
+                            resampler_quality_type quality) {
+  resampler_t *r = resampler_create(44100, output_rate, quality, TEST_PACKET_FRAMES);
+  if (r == NULL) {
+    fprintf(stderr, "can not create a resampler.\n");
+    exit(EXIT_FAILURE);
+  }
+  size_t maximum_output_frames =
+      resampler_max_output_frames(r, TEST_PACKET_FRAMES) * (TEST_FRAMES / TEST_PACKET_FRAMES + 1);
+  int32_t *output = malloc(sizeof(int32_t) * 2 * maximum_output_frames);
+  double *reference = malloc(sizeof(double) * 2 * maximum_output_frames);
+  double *history = calloc(r->taps_per_phase - 1 + TEST_FRAMES, sizeof(double));
+  if ((output == NULL) || (reference == NULL) || (history == NULL)) {
+    fprintf(stderr, "can not allocate memory for the resampler test.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  size_t output_frames = 0;
+  int frames_done;
+  double start = time_now();
+  for (frames_done = 0; frames_done + TEST_PACKET_FRAMES <= TEST_FRAMES;
+       frames_done += TEST_PACKET_FRAMES)
+    output_frames += resampler_process(r, input + 2 * frames_done, TEST_PACKET_FRAMES,
+                                       output + 2 * output_frames);
+  double resampler_time = time_now() - start;
+
+  // the reference, in double precision with the resampler's own coefficients, on the left channel
+  unsigned int taps = r->taps_per_phase;
+  unsigned int L = r->interpolation_factor;
+  unsigned int M = r->decimation_factor;
+  int i;
+  for (i = 0; i < frames_done; i++)
+    history[taps - 1 + i] = input[2 * i];
+  size_t reference_frames = 0;
+  int64_t index = 0;
+  unsigned int phase = 0;
+  while ((index < frames_done) && (reference_frames < output_frames)) {
+    double sum = 0.0;
+    unsigned int j;
+    for (j = 0; j < taps; j++) {
+#ifdef CONFIG_FIXED_POINT
+      double coefficient =
+          r->coefficients[phase * taps + j] / (double)(1 << RESAMPLER_COEFFICIENT_BITS);
+#else
+      double coefficient = r->coefficients[phase * taps + j];
+#endif
+      sum += coefficient * history[index + j];
+    }
+    reference[reference_frames++] = sum;
+    phase += M;
+    index += phase / L;
+    phase = phase % L;
+  }
+
+  double maximum_error = 0.0;
+  size_t k;
+  for (k = 0; k < reference_frames; k++) {
+    double error = fabs(output[2 * k] - reference[k]);
+    if (error > maximum_error)
+      maximum_error = error;
+  }
+  double maximum_error_db =
+      maximum_error == 0.0 ? -999.0 : 20 * log10(maximum_error / 2147483648.0);
+  printf("resampler 44100 to %u, %s quality, %s: maximum error %.1f dB of full scale, %.1f ns per "
+         "frame.\n",
+         output_rate, resampler_quality_description(quality),
+#ifdef CONFIG_FIXED_POINT
+         "fixed point",
+#else
+         "float",
+#endif
+         maximum_error_db, resampler_time * 1000000000 / frames_done);
+  if ((reference_frames != output_frames) || (maximum_error_db > -120.0))
+    failures++;
+  free(history);
+  free(reference);
+  free(output);
+  resampler_free(r);
+}
+
+int main(void) {
+  int32_t *input = malloc(sizeof(int32_t) * 2 * TEST_FRAMES);
+  if (input == NULL) {
+    fprintf(stderr, "can not allocate memory for the test input.\n");
+    return EXIT_FAILURE;
+  }
+  make_input(input, TEST_FRAMES);
+
+  config.loudness_reference_volume_db = -20.0;
+  check_loudness(input, -20.0); // no boost
+  check_loudness(input, -40.0); // 10 dB boost at 10 Hz
+  check_loudness(input, -60.0); // 20 dB boost at 10 Hz
+
+  check_resampler(input, 48000, RQ_low);
+  check_resampler(input, 48000, RQ_medium);
+  check_resampler(input, 48000, RQ_high);
+  check_resampler(input, 96000, RQ_medium);
+
+  free(input);
+  if (failures != 0) {
+    printf("%d checks out of tolerance.\n", failures);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,117 @@
+// Measures what the tracing probes cost when nothing is attached to them. Built and run by
+// "make check"; it exits with a non-zero status if a probe costs more than probe_cost_limit_ns.
+//
+// The same per-packet loop -- a look at the start of each packet, kept small so that the probes'
+// cost isn't lost in it -- is timed with and without two probes in it, the same ones
+// player_put_packet and buffer_get_frame have, with the same kinds of arguments. The two are timed
+// several times, and the median difference taken, to leave out interruptions. Built --with-usdt,
+// each probe is a nop and its arguments are left where a tracer can find them; otherwise the probes
+// compile to nothing, and the two loops should take the same time. The limit is well above the
+// cost of a nop, as timings on a busy or virtual machine vary from run to run.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "probes.h"
+
+#define TEST_PACKETS 2000000
+#define TEST_PACKET_FRAMES 352
+#define TEST_PACKET_WORDS 16 // of each packet looked at
+#define TEST_RUNS 15
+#define PROBES_PER_PACKET 2
+
+static const double probe_cost_limit_ns = 5.0;
+
+static int32_t packet[TEST_PACKET_WORDS];
+
+static uint64_t time_now_ns(void) {
+  struct timespec tn;
+  clock_gettime(CLOCK_MONOTONIC, &tn);
+  return (uint64_t)tn.tv_sec * 1000000000 + tn.tv_nsec;
+}
+
+static __attribute__((noinline)) int64_t packets_without_probes(int connection_number) {
+  int64_t checksum = connection_number;
+  uint16_t seqno;
+  uint32_t timestamp = 0;
+  int i, j;
+  for (i = 0, seqno = 0; i < TEST_PACKETS; i++, seqno++, timestamp += TEST_PACKET_FRAMES) {
+    for (j = 0; j < TEST_PACKET_WORDS; j++)
+      checksum += packet[j] ^ seqno;
+  }
+  return checksum + timestamp;
+}
+
+static __attribute__((noinline)) int64_t packets_with_probes(int connection_number) {
+  int64_t checksum = connection_number;
+  uint16_t seqno;
+  uint32_t timestamp = 0;
+  int i, j;
+  for (i = 0, seqno = 0; i < TEST_PACKETS; i++, seqno++, timestamp += TEST_PACKET_FRAMES) {
+    SPS_PROBE4(put_packet, connection_number, seqno, timestamp, 0);
+    for (j = 0; j < TEST_PACKET_WORDS; j++)
+      checksum += packet[j] ^ seqno;
+    SPS_PROBE4(get_frame, connection_number, seqno, 1, i & 0xff);
+  }
+  return checksum + timestamp;
+}
+
+// the time taken for TEST_PACKETS packets, in nanoseconds per packet
+static double time_per_packet(int64_t (*packets)(int), int run, int64_t *checksum) {
+  uint64_t start = time_now_ns();
+  *checksum = packets(run);
+  return (1.0 * (time_now_ns() - start)) / TEST_PACKETS;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+int main(void) {
+  int i;
+  for (i = 0; i < TEST_PACKET_WORDS; i++)
+    packet[i] = i * 65536;
+
+  // The two are timed turn about, each going first in alternate runs, after a run of each to warm
+  // up, so that a change in the clock speed affects both alike.
+  int64_t checksum_without, checksum_with;
+  double without_probes = 0.0, with_probes = 0.0;
+  double differences[TEST_RUNS];
+  int run;
+  for (run = 0; run <= TEST_RUNS; run++) {
+    double t_without, t_with;
+    if (run % 2) {
+      t_without = time_per_packet(packets_without_probes, run, &checksum_without);
+      t_with = time_per_packet(packets_with_probes, run, &checksum_with);
+    } else {
+      t_with = time_per_packet(packets_with_probes, run, &checksum_with);
+      t_without = time_per_packet(packets_without_probes, run, &checksum_without);
+    }
+    if (run != 0) {
+      without_probes += t_without / TEST_RUNS;
+      with_probes += t_with / TEST_RUNS;
+      differences[run - 1] = t_with - t_without;
+    }
+  }
+  qsort(differences, TEST_RUNS, sizeof(double), compare_doubles);
+  double probe_cost = differences[TEST_RUNS / 2] / PROBES_PER_PACKET;
+  printf("probes %s: %.1f ns per packet without probes, %.1f ns with %d, %.2f ns per probe.\n",
+#ifdef CONFIG_USDT
+         "built in",
+#else
+         "compiled out",
+#endif
+         without_probes, with_probes, PROBES_PER_PACKET, probe_cost);
+  if (checksum_with != checksum_without) {
+    printf("the loops' results differ.\n");
+    return EXIT_FAILURE;
+  }
+  if (probe_cost > probe_cost_limit_ns) {
+    printf("an unattached probe costs more than %.0f ns.\n", probe_cost_limit_ns);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}